@@ -0,0 +1,201 @@
+#include "burst_aggregator.h"
+
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+
+namespace SudoMonitor {
+struct BurstAggregator::Impl {
+    struct CommStats {
+        uint64_t spawned = 0, exited = 0, utime = 0, stime = 0;
+        uint32_t live = 0, peakLive = 0;
+    };
+    using Comms = std::map<std::string, CommStats, std::less<>>;
+    struct Parent {
+        Clock::time_point windowStart;
+        uint32_t created = 0; // in the current window
+        bool bursting = false;
+        bool draining = false; // the burst ended with children still folded, summaries go on until they are removed
+        Clock::time_point periodStart;
+        Clock::time_point nextSummary;
+        Comms comms;
+        std::unordered_map<pid_t, Comms::iterator> folded; // live folded children
+    };
+
+    BurstPolicy _policy;
+    OnSummary _onSummary;
+    std::unordered_map<pid_t, Parent> _parents;
+    std::atomic<uint64_t> _bursts{0}, _active{0}, _folded{0}, _summaries{0};
+
+    Impl(const BurstPolicy& policy, const OnSummary& onSummary) : _policy(policy), _onSummary(onSummary) {}
+
+    Parent* find(pid_t ppid) {
+        auto it = ppid > 0 ? _parents.find(ppid) : _parents.end();
+        return it == _parents.end() ? nullptr : &it->second;
+    }
+    void emit(pid_t pid, Parent& p, Clock::time_point now, bool ended) {
+        BurstSummary s;
+        s.parent = pid;
+        s.ended = ended;
+        s.periodMs = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(now - p.periodStart).count());
+        for (auto it = p.comms.begin(); it != p.comms.end();) {
+            auto& c = it->second;
+            if (c.spawned || c.exited || c.live) {
+                s.comm = it->first;
+                s.spawned = c.spawned;
+                s.exited = c.exited;
+                s.utime = c.utime;
+                s.stime = c.stime;
+                s.live = c.live;
+                s.peakLive = c.peakLive;
+                ++_summaries;
+                if (_onSummary)
+                    _onSummary(s);
+            }
+            if (!c.live) { // nothing folded refers to it
+                it = p.comms.erase(it);
+                continue;
+            }
+            c = {0, 0, 0, 0, c.live, c.live};
+            ++it;
+        }
+        p.periodStart = now;
+    }
+    void rollWindow(pid_t pid, Parent& p, Clock::time_point now) {
+        if (now - p.windowStart < _policy.window)
+            return;
+        auto last = now - p.windowStart < 2 * _policy.window ? p.created : 0; // children of the last whole window
+        p.created = 0;
+        p.windowStart = now;
+        if (p.bursting && last < _policy.exitChildren) {
+            p.bursting = false;
+            p.draining = !p.folded.empty();
+            emit(pid, p, now, !p.draining);
+            if (!p.draining)
+                --_active;
+        }
+    }
+
+    bool childCreated(pid_t pid, pid_t ppid, std::string_view comm, Clock::time_point now) {
+        if (!_policy.enterChildren || ppid <= 0)
+            return false;
+        auto [it, added] = _parents.try_emplace(ppid);
+        auto& p = it->second;
+        if (added)
+            p.windowStart = now;
+        rollWindow(ppid, p, now);
+        if (++p.created >= _policy.enterChildren && !p.bursting) {
+            p.bursting = true;
+            p.periodStart = now;
+            p.nextSummary = now + _policy.summaryInterval;
+            ++_bursts;
+            if (!p.draining)
+                ++_active;
+            p.draining = false;
+        }
+        if (!p.bursting)
+            return false;
+        auto c = p.comms.find(comm);
+        if (c == p.comms.end())
+            c = p.comms.emplace(std::string(comm), CommStats{}).first;
+        ++c->second.spawned;
+        c->second.peakLive = std::max(c->second.peakLive, ++c->second.live);
+        p.folded[pid] = c;
+        ++_folded;
+        return true;
+    }
+    bool childExec(pid_t pid, pid_t ppid, std::string_view comm) {
+        auto p = find(ppid);
+        if (!p)
+            return false;
+        auto it = p->folded.find(pid);
+        if (it == p->folded.end())
+            return false;
+        auto& from = it->second;
+        if (from->first == comm)
+            return true;
+        auto to = p->comms.find(comm);
+        if (to == p->comms.end())
+            to = p->comms.emplace(std::string(comm), CommStats{}).first;
+        if (from->second.spawned) { // otherwise its spawn was already summarized under the former comm
+            --from->second.spawned;
+            ++to->second.spawned;
+        }
+        --from->second.live;
+        to->second.peakLive = std::max(to->second.peakLive, ++to->second.live);
+        from = to;
+        return true;
+    }
+    bool childDied(pid_t pid, pid_t ppid, uint64_t utime, uint64_t stime) {
+        auto p = find(ppid);
+        if (!p)
+            return false;
+        auto it = p->folded.find(pid);
+        if (it == p->folded.end())
+            return false;
+        auto& c = it->second->second;
+        ++c.exited;
+        --c.live;
+        c.utime += utime;
+        c.stime += stime;
+        ++_folded;
+        return true;
+    }
+    bool childRemoved(pid_t pid, pid_t ppid, Clock::time_point now) {
+        auto p = find(ppid);
+        if (!p || !p->folded.erase(pid))
+            return false;
+        ++_folded;
+        if (p->draining && p->folded.empty()) {
+            emit(ppid, *p, now, true);
+            p->draining = false;
+            --_active;
+        }
+        return true;
+    }
+    void advance(Clock::time_point now) {
+        for (auto it = _parents.begin(); it != _parents.end();) {
+            auto& [pid, p] = *it;
+            rollWindow(pid, p, now);
+            if ((p.bursting || p.draining) && now >= p.nextSummary) {
+                emit(pid, p, now, false);
+                p.nextSummary = now + _policy.summaryInterval;
+            }
+            if (!p.bursting && !p.draining && !p.created && p.folded.empty())
+                it = _parents.erase(it);
+            else
+                ++it;
+        }
+    }
+};
+
+BurstAggregator::BurstAggregator(const BurstPolicy& policy, const OnSummary& onSummary)
+    : pimpl(std::make_unique<Impl>(policy, onSummary)) {}
+
+BurstAggregator::~BurstAggregator() = default;
+
+bool BurstAggregator::childCreated(pid_t pid, pid_t ppid, std::string_view comm, Clock::time_point now) {
+    return pimpl->childCreated(pid, ppid, comm, now);
+}
+
+bool BurstAggregator::childExec(pid_t pid, pid_t ppid, std::string_view comm) {
+    return pimpl->childExec(pid, ppid, comm);
+}
+
+bool BurstAggregator::childDied(pid_t pid, pid_t ppid, uint64_t utime, uint64_t stime) {
+    return pimpl->childDied(pid, ppid, utime, stime);
+}
+
+bool BurstAggregator::childRemoved(pid_t pid, pid_t ppid, Clock::time_point now) {
+    return pimpl->childRemoved(pid, ppid, now);
+}
+
+void BurstAggregator::advance(Clock::time_point now) {
+    pimpl->advance(now);
+}
+
+BurstMetrics BurstAggregator::metrics() const {
+    return {pimpl->_bursts, pimpl->_active, pimpl->_folded, pimpl->_summaries};
+}
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+
+namespace SudoMonitor {
+// A parent creating enterChildren children within one window switches to summaries; it switches back
+// after a whole window with fewer than exitChildren new children
+struct BurstPolicy {
+    uint32_t enterChildren = Config::BurstEnterChildren; // 0: aggregation disabled
+    uint32_t exitChildren = Config::BurstExitChildren;
+    std::chrono::milliseconds window{Config::BurstWindowMs};
+    std::chrono::milliseconds summaryInterval{Config::BurstSummaryMs};
+};
+
+// Children of one parent with the same comm, over one summary period
+struct BurstSummary {
+    pid_t parent = 0;
+    std::string comm;
+    uint64_t spawned = 0;  // children created in the period
+    uint64_t exited = 0;
+    uint64_t utime = 0;    // clock ticks of the children that exited in the period
+    uint64_t stime = 0;
+    uint32_t live = 0;     // folded children still running
+    uint32_t peakLive = 0; // peak concurrency in the period
+    uint64_t periodMs = 0;
+    bool ended = false;    // the last summary of the burst, no child of it is left folded
+};
+
+struct BurstMetrics {
+    uint64_t bursts = 0;    // parents switched to summaries
+    uint64_t active = 0;    // parents currently in summary mode, until their last folded child is removed
+    uint64_t folded = 0;    // Created/Died/Removed events replaced by summaries
+    uint64_t summaries = 0;
+};
+
+// Event stage of ProcTreeMonitor: the child* calls return true when the event is folded into the
+// parent's summary and must not be reported on its own, except childExec. A child is folded from Created to Removed, so
+// children created before the burst keep their own events, and those still running when it ends stay folded:
+// the summaries go on until the last of them is removed, and only that summary is marked ended.
+// Not thread-safe (the tree worker holds the monitor lock), except metrics().
+class BurstAggregator {
+public:
+    using Clock = std::chrono::steady_clock;
+    using OnSummary = std::function<void(const BurstSummary&)>;
+
+    BurstAggregator(const BurstPolicy& policy, const OnSummary& onSummary);
+    ~BurstAggregator();
+    BurstAggregator(const BurstAggregator&) = delete;
+    BurstAggregator& operator=(const BurstAggregator&) = delete;
+
+    bool childCreated(pid_t pid, pid_t ppid, std::string_view comm, Clock::time_point now);
+    // An Exec is never folded: returns true when the child is, after moving it under its exec'd comm (a connector
+    // Created carries the comm of the parent it forked from)
+    bool childExec(pid_t pid, pid_t ppid, std::string_view comm);
+    bool childDied(pid_t pid, pid_t ppid, uint64_t utime, uint64_t stime);
+    bool childRemoved(pid_t pid, pid_t ppid, Clock::time_point now); // the last folded child ends a drained burst
+    // Rolls the windows, emits the periodic summaries and ends quiet bursts; once per tree pass
+    void advance(Clock::time_point now);
+    [[nodiscard]] BurstMetrics metrics() const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> pimpl;
+};
+}
@@ -0,0 +1,163 @@
+#include "cgroup_session.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <linux/magic.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+namespace SudoMonitor {
+namespace {
+bool isCgroup2(const std::string& dir) {
+    struct statfs fs{};
+    return statfs(dir.c_str(), &fs) == 0 && fs.f_type == CGROUP2_SUPER_MAGIC;
+}
+bool writeFile(const std::string& path, const std::string& value) {
+    int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    bool ok = write(fd, value.c_str(), value.size()) == static_cast<ssize_t>(value.size());
+    close(fd);
+    return ok;
+}
+std::string readFile(const std::string& path) {
+    std::string content;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return content;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        content.append(buf, static_cast<size_t>(n));
+    close(fd);
+    return content;
+}
+}
+
+CgroupEvents::~CgroupEvents() {
+    if (_fd >= 0)
+        close(_fd);
+}
+
+bool CgroupEvents::init() {
+    _fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    return _fd >= 0;
+}
+
+int CgroupEvents::watch(const std::string& eventsFile) {
+    return _fd < 0 ? -1 : inotify_add_watch(_fd, eventsFile.c_str(), IN_MODIFY);
+}
+
+void CgroupEvents::unwatch(int wd) {
+    if (_fd >= 0 && wd >= 0)
+        inotify_rm_watch(_fd, wd);
+}
+
+std::vector<int> CgroupEvents::wait(int timeoutMs) {
+    std::vector<int> fired;
+    pollfd pfd{_fd, POLLIN, 0};
+    if (_fd < 0 || poll(&pfd, 1, timeoutMs) <= 0)
+        return fired;
+    alignas(inotify_event) char buf[16 * (sizeof(inotify_event) + NAME_MAX + 1)];
+    ssize_t n;
+    while ((n = read(_fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t pos = 0; pos < n;) {
+            auto event = reinterpret_cast<const inotify_event*>(buf + pos);
+            if (event->mask & IN_MODIFY)
+                fired.push_back(event->wd);
+            pos += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+        }
+    }
+    return fired;
+}
+
+struct CgroupSession::Impl {
+    std::string _base;
+    std::string _path;
+    pid_t _rootPid;
+    CgroupEvents* _events = nullptr;
+    int _wd = -1;
+    bool _created = false; // by init(), an existing leaf is not removed
+    bool _populated = true;
+
+    Impl(const std::string& base, pid_t rootPid)
+        : _base(base), _path(base + "/session-" + std::to_string(rootPid)), _rootPid(rootPid) {}
+    ~Impl() {
+        if (_events)
+            _events->unwatch(_wd);
+        if (_created && rmdir(_path.c_str()) < 0)
+            perror(("cgroup: leaf left behind " + _path).c_str());
+    }
+    bool readPopulated() {
+        auto events = readFile(_path + "/cgroup.events");
+        auto pos = events.find("populated ");
+        return pos == std::string::npos || events[pos + strlen("populated ")] != '0';
+    }
+};
+
+CgroupSession::CgroupSession(const std::string& basePath, pid_t rootPid)
+    : pimpl(std::make_unique<Impl>(basePath, rootPid)) {}
+
+CgroupSession::~CgroupSession() = default;
+
+bool CgroupSession::init(CgroupEvents& events) {
+    auto parent = pimpl->_base.substr(0, pimpl->_base.find_last_of('/'));
+    if (!isCgroup2(parent.empty() ? "/" : parent))
+        return false;
+    if (mkdir(pimpl->_base.c_str(), 0755) < 0 && errno != EEXIST)
+        return false;
+    if (mkdir(pimpl->_path.c_str(), 0755) == 0)
+        pimpl->_created = true;
+    else if (errno != EEXIST)
+        return false;
+    pimpl->_wd = events.watch(pimpl->_path + "/cgroup.events"); // before the move: no "populated" change is missed
+    if (pimpl->_wd < 0)
+        return false; // the destructor removes the empty leaf
+    pimpl->_events = &events;
+    if (!writeFile(pimpl->_path + "/cgroup.procs", std::to_string(pimpl->_rootPid))) {
+        perror(("cgroup: cannot move pid into " + pimpl->_path).c_str());
+        return false;
+    }
+    pimpl->_populated = pimpl->readPopulated();
+    return true;
+}
+
+std::vector<pid_t> CgroupSession::members() const {
+    std::vector<pid_t> pids;
+    auto content = readFile(pimpl->_path + "/cgroup.procs");
+    const char* p = content.c_str();
+    while (*p) {
+        char* end;
+        long pid = strtol(p, &end, 10);
+        if (end == p)
+            break;
+        pids.push_back(static_cast<pid_t>(pid));
+        p = end;
+        while (*p == '\n')
+            ++p;
+    }
+    return pids;
+}
+
+bool CgroupSession::populated() const {
+    return pimpl->_populated;
+}
+
+void CgroupSession::eventsChanged() {
+    pimpl->_populated = pimpl->readPopulated();
+}
+
+int CgroupSession::watch() const {
+    return pimpl->_wd;
+}
+
+const std::string& CgroupSession::path() const {
+    return pimpl->_path;
+}
+}
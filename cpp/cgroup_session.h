@@ -0,0 +1,51 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+namespace SudoMonitor {
+// One inotify instance for the cgroup.events files of every session leaf, read by a single thread
+class CgroupEvents {
+public:
+    CgroupEvents() = default;
+    ~CgroupEvents();
+    CgroupEvents(const CgroupEvents&) = delete;
+    CgroupEvents& operator=(const CgroupEvents&) = delete;
+
+    bool init();
+    int watch(const std::string& eventsFile); // watch descriptor, -1 on failure
+    void unwatch(int wd);
+    // Blocks up to timeoutMs (0: does not block). Returns the watch descriptors that fired, empty on timeout.
+    std::vector<int> wait(int timeoutMs);
+
+private:
+    int _fd = -1;
+};
+
+// A dedicated cgroup v2 leaf holding one sudo session. Every descendant of the moved pid stays in the leaf,
+// including double-forked and reparented processes, so membership costs O(session size) to read.
+class CgroupSession {
+public:
+    CgroupSession(const std::string& basePath, pid_t rootPid);
+    ~CgroupSession(); // removes the leaf it created, keep it until populated() is false
+    CgroupSession(const CgroupSession&) = delete;
+    CgroupSession& operator=(const CgroupSession&) = delete;
+
+    // Creates the leaf, moves rootPid into it and watches its cgroup.events through events (which must outlive it).
+    // Returns false (and leaves nothing behind) when cgroup v2 delegation is not available.
+    bool init(CgroupEvents& events);
+    [[nodiscard]] std::vector<pid_t> members() const;
+    // false once cgroup.events reported "populated 0", as of the last eventsChanged()
+    [[nodiscard]] bool populated() const;
+    // The watch fired: re-reads cgroup.events
+    void eventsChanged();
+    [[nodiscard]] int watch() const;
+    [[nodiscard]] const std::string& path() const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> pimpl;
+};
+}
@@ -13,8 +13,60 @@ namespace SudoMonitor {
         static constexpr auto SudoToDaemonSockMode = 0666;
         static constexpr auto SudoToDaemonSockTimeoutMs = 10;
         static constexpr auto SocketBufSize = 4096;
+        static constexpr auto ClientQueueBytes = 4 << 20;   // QUEUED_CLIENT ring, messages beyond it are dropped
+        static constexpr auto PluginQueueBytes = 64 << 10;  // the plugin's ring, allocated in every sudo process
+        static constexpr auto ServerMessageMaxBytes = 8192; // SERVER: a client exceeding it unterminated is closed
+        static constexpr auto ClientWriteBatchBytes = 16 << 10; // QUEUED_CLIENT sends write once this much is queued
+        static constexpr auto ClientReconnectMinMs = 50;    // QUEUED_CLIENT reconnect backoff, doubled per failure
+        static constexpr auto ClientReconnectMaxMs = 5000;
+        static constexpr auto ClientCloseFlushMs = 500;     // a stopping daemon writes its queued UI records this long
+        static constexpr auto UpstreamPort = "7514";        // sudo_collector
+        static constexpr auto UpstreamSpoolDir = "/var/spool/sudo_monitor"; // owned by the daemon user, 0700
+        static constexpr auto UpstreamSpoolMaxBytes = 256ull << 20; // compressed batches, the oldest are dropped past it
+        static constexpr auto UpstreamBatchBytes = 256 << 10;    // a batch is sealed at this many record bytes,
+        static constexpr auto UpstreamBatchEvents = 4096;        // records,
+        static constexpr auto UpstreamBatchMs = 1000;            // or age
+        static constexpr auto UpstreamWindow = 8;                // batches sent and not acknowledged yet
+        static constexpr auto UpstreamConnectTimeoutMs = 2000;
+        static constexpr auto UpstreamAckTimeoutMs = 10000;      // the connection is dropped when acks stop for this long
+        static constexpr auto UpstreamReconnectMinMs = 100;      // doubled per failure
+        static constexpr auto UpstreamReconnectMaxMs = 10000;
+        static constexpr auto ProfileIntervalMs = 1000;          // --profile: per-thread CPU record period
+        static constexpr auto ProfileDumpDir = "/run/sudo_monitor"; // SIGUSR1 writes profile.folded there
         static constexpr auto DaemonToMonitorSock = "/tmp/ui_monitor.sock";
         static constexpr auto DaemonToMonitorSockMode = 0666; //to allow access for non-sudo user at the testing stage
+        static constexpr auto EventBufSize = 8192; // max size of one serialized event record
+        // attribute=tier list, see AttrPolicy::parse
+        static constexpr auto DefaultAttrTiers = "status=start,exe=start,cwd=start,cgroup=start,io=periodic,fd=periodic";
+        static constexpr auto AttrPeriodicIntervalMs = 1000;
+        static constexpr auto MetricsIntervalMs = 10000; // daemon metrics record period
+        static constexpr auto ExitRecordTtlMs = 1000;   // taskstats records wait this long for their process to be reaped
+        static constexpr auto MaxExitRecords = 65536;   // pending taskstats records, newer ones are dropped
+        static constexpr auto CgroupBase = "/sys/fs/cgroup/sudo_monitor"; // parent of the per-session cgroup v2 leaves
+        static constexpr auto PamToDaemonSock = "/tmp/sudo_audit_pam.sock"; // datagrams from the PAM module
+        static constexpr auto PamToDaemonSockMode = 0600; // the PAM module sends as root (sudo, login), others are dropped
+        static constexpr auto PamNotifyBudgetUs = 200;  // a slower (or failed) notification suspends the notifier
+        static constexpr auto PamNotifyRetryMs = 1000;  // how long a suspended notifier stays silent
+        static constexpr auto CorrelationWindowMs = 300000; // PAM activity older than this is not joined to a session
+        static constexpr auto CorrelationMaxEntries = 65536; // (user, tty) histories, new ones are dropped when full
+        static constexpr auto CorrelationMaxPids = 16;       // pids remembered per history for the pid/parent join
+        static constexpr auto CorrelationWheelSlots = 64;
+        static constexpr auto SessionMemoryCapBytes = 64 << 20; // tree storage per session, 0: unlimited
+        static constexpr auto SessionReducedPercent = 75;       // of the cap, attribute tiers stop being collected
+        static constexpr auto SessionArenaInitialBytes = 16 << 10;
+        static constexpr auto UntrackedFilterSlots = 1024;      // recently seen untracked pids, so each is counted once
+        static constexpr auto BurstWindowMs = 1000;     // child creation rate window of the burst aggregation
+        static constexpr auto BurstEnterChildren = 50;  // children per window switching a parent to summary events
+        static constexpr auto BurstExitChildren = 10;   // fewer per window switch it back
+        static constexpr auto BurstSummaryMs = 10000;   // summary period while in a burst
+        static constexpr auto ProcScanThreads = 3;      // helper threads of a full /proc scan, capped at the cpus - 1
+        static constexpr auto ProcScanParallelMin = 2048; // smaller scans stay on the calling thread
+        static constexpr auto MaxQueuedProcEvents = 65536; // connector events waiting for the tree worker, newer are dropped
+        static constexpr auto RemovedFilterSlots = 1024;    // recently removed pids, their late fork events are ignored
+        static constexpr auto KernelStampEntries = 65536; // fork/exit timestamps kept for the latency spans
+        static constexpr auto KernelStampTtlMs = 10000;   // older ones never matched a tracked process
+        static constexpr auto InternShards = 16;          // independently locked parts of the comm/cmdline pool
+        static constexpr auto InternSweepMs = 30000;      // unreferenced strings are freed after one to two periods
 
     };
 static inline void two_digits(char* p, int v) {
@@ -22,12 +74,12 @@ static inline void two_digits(char* p, int v) {
     p[1] = char('0' + (v%10));
 }
 
-static inline std::string getLogTime() {
-    timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);                  // ns precision
+static constexpr int LogTimeLen = 15; // HH:MM:SS.uuuuuu
+
+// Writes LogTimeLen chars (not null terminated) of the given wall clock time
+static inline void formatLogTime(char* out, const timespec& ts) {
     std::tm tm;
     localtime_r(&ts.tv_sec, &tm);
-    char out[16]; // 8 + 1 + 6 + 1 = 16
     two_digits(out+0,  tm.tm_hour);
     out[2] = ':';
     two_digits(out+3,  tm.tm_min);
@@ -42,8 +94,14 @@ static inline std::string getLogTime() {
     out[12] = char('0' + (usec/100)%10);
     out[13] = char('0' + (usec/10)%10);
     out[14] = char('0' + (usec)%10);
-    out[15] = 0;
+}
 
+static inline std::string getLogTime() {
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);                  // ns precision
+    char out[LogTimeLen + 1];
+    formatLogTime(out, ts);
+    out[LogTimeLen] = 0;
     return out;
 }
 
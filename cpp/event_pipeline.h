@@ -0,0 +1,189 @@
+#pragma once
+
+#include "event_serializer.h"
+#include "monitor_subprocesses.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string_view>
+#include <tuple>
+#include <unordered_set>
+#include <utility>
+
+namespace SudoMonitor {
+// One monitor event on its way through a pipeline; the Serialize stage fills record
+struct PipelineEvent {
+    const ProcessData& pd;
+    ProcStatEvent event;
+    std::string_view record;
+};
+
+// Monitor events through a chain of stages composed at compile time. A stage is any type with
+//   template <typename Next> void operator()(PipelineEvent& e, Next&& next)
+// calling next(e) to pass the event on, or returning to drop it. Each stage sees the concrete type of the rest of
+// the chain, so the whole pipeline inlines into one call; the only type-erased dispatch left is at the edge, where
+// the pipeline is handed to ProcTreeMonitor as its OnProcStatChange.
+// Stages are built in place from one argument each, so they may hold atomics and references.
+template <typename... Stages>
+class EventPipeline {
+public:
+    template <typename... Args>
+    explicit EventPipeline(Args&&... args) : _stages(std::forward<Args>(args)...) {}
+    EventPipeline(const EventPipeline&) = delete;
+    EventPipeline& operator=(const EventPipeline&) = delete;
+
+    void operator()(const ProcessData& pd, ProcStatEvent event) {
+        PipelineEvent e{pd, event, {}};
+        run<0>(e);
+    }
+    template <typename Stage>
+    Stage& stage() { return std::get<Stage>(_stages); }
+    template <typename Stage>
+    const Stage& stage() const { return std::get<Stage>(_stages); }
+
+private:
+    template <size_t I>
+    void run(PipelineEvent& e) {
+        if constexpr (I < sizeof...(Stages))
+            std::get<I>(_stages)(e, [this](PipelineEvent& next) { run<I + 1>(next); });
+    }
+
+    std::tuple<Stages...> _stages;
+};
+
+// Passes the event types of a mask, e.g. EventFilter::bit(Created) | EventFilter::bit(Died)
+class EventFilter {
+public:
+    static constexpr uint32_t All = ~0u;
+    static constexpr uint32_t bit(ProcStatEvent event) { return 1u << event; }
+    // "Created,Exec,Died" (procStatEventName names). Returns false and leaves mask untouched on an unknown name.
+    static bool parse(std::string_view list, uint32_t& mask) {
+        if (list.empty())
+            return false;
+        uint32_t parsed = 0;
+        while (!list.empty()) {
+            auto comma = list.find(',');
+            auto name = list.substr(0, comma);
+            list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+            auto event = Created;
+            while (event < NUM_OF_EVENTS && name != procStatEventName(event))
+                event = static_cast<ProcStatEvent>(event + 1);
+            if (event == NUM_OF_EVENTS)
+                return false;
+            parsed |= bit(event);
+        }
+        mask = parsed;
+        return true;
+    }
+
+    explicit EventFilter(uint32_t mask = All) : _mask(mask) {}
+    template <typename Next>
+    void operator()(PipelineEvent& e, Next&& next) {
+        if (_mask & bit(e.event))
+            next(e);
+        else
+            _filtered.fetch_add(1, std::memory_order_relaxed);
+    }
+    [[nodiscard]] uint64_t filtered() const { return _filtered.load(std::memory_order_relaxed); }
+
+private:
+    uint32_t _mask;
+    std::atomic<uint64_t> _filtered{0};
+};
+
+struct PipelineOptions {
+    uint32_t eventMask = EventFilter::All; // --events
+    uint32_t maxEventRate = 0;             // --max-event-rate, per second, 0: unlimited
+};
+
+// Token bucket over the lifecycles of child processes, at most perSecond new ones per second with bursts of up to one
+// second's worth. A child's Created takes the token, and its Died and Removed pass or drop with it, so the records
+// stay paired. An Exec always passes and makes the rest of that lifecycle pass, so a fork flood can not hide an exec.
+// Root events (session start/end and totals), burst summaries and query answers always pass. 0: unlimited.
+// Put it before an EventFilter, so it sees the Created of a lifecycle even when those are filtered out.
+// Not locked: the monitor calls the pipeline under its lock, as it does for the serializer buffer.
+class RateLimiter {
+public:
+    using Clock = std::chrono::steady_clock;
+    explicit RateLimiter(uint32_t perSecond) : _perSecond(perSecond), _tokens(perSecond) {}
+    template <typename Next>
+    void operator()(PipelineEvent& e, Next&& next) {
+        if (pass(e))
+            next(e);
+        else
+            _limited.fetch_add(1, std::memory_order_relaxed);
+    }
+    [[nodiscard]] uint64_t limited() const { return _limited.load(std::memory_order_relaxed); }
+
+private:
+    bool pass(const PipelineEvent& e) {
+        if (!_perSecond || !e.pd.ppid)
+            return true;
+        switch (e.event) {
+            case Created:
+                if (!take())
+                    return false;
+                _passing.insert(e.pd.pid);
+                return true;
+            case Exec:
+                if (!e.pd.props.count("burst_folded")) // a folded child's Died and Removed are summarized
+                    _passing.insert(e.pd.pid);
+                return true;
+            case Died:
+                return _passing.count(e.pd.pid) > 0;
+            case Removed:
+                return _passing.erase(e.pd.pid) > 0;
+            default:
+                return true;
+        }
+    }
+    bool take() {
+        auto now = Clock::now();
+        auto elapsed = std::chrono::duration<double>(now - _last).count();
+        _last = now;
+        _tokens = std::min<double>(_perSecond, _tokens + elapsed * _perSecond);
+        if (_tokens < 1)
+            return false;
+        _tokens -= 1;
+        return true;
+    }
+
+    uint32_t _perSecond;
+    double _tokens;
+    Clock::time_point _last = Clock::now();
+    std::unordered_set<pid_t> _passing; // children whose lifecycle is reported, until their Removed
+    std::atomic<uint64_t> _limited{0};
+};
+
+// Formats the event into the serializer's buffer, valid for the stages after it
+class Serialize {
+public:
+    explicit Serialize(EventSerializer& serializer) : _serializer(serializer) {}
+    template <typename Next>
+    void operator()(PipelineEvent& e, Next&& next) {
+        e.record = _serializer.serialize(e.pd, e.event);
+        next(e);
+    }
+
+private:
+    EventSerializer& _serializer;
+};
+
+// Hands the serialized record to writer (void(std::string_view)) and passes the event on, so consecutive writers fan
+// the record out
+template <typename Writer>
+class WriteRecord {
+public:
+    explicit WriteRecord(Writer writer) : _writer(std::move(writer)) {}
+    template <typename Next>
+    void operator()(PipelineEvent& e, Next&& next) {
+        _writer(e.record);
+        next(e);
+    }
+
+private:
+    Writer _writer;
+};
+}
@@ -0,0 +1,294 @@
+#include "event_serializer.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <ctime>
+#include <iterator>
+
+namespace SudoMonitor {
+namespace {
+constexpr char HexDigits[] = "0123456789abcdef";
+constexpr uint8_t BinaryVersion = 3;
+constexpr char FrameHasSession = 0x1;
+constexpr char FrameTruncated = 0x2;
+constexpr size_t SessionCounters = 10;
+
+// The session object of a root's Removed record, in the order of the binary frame
+std::array<EventSerializer::Counter, SessionCounters> sessionCounters(const SessionTotals& t) {
+    return {{{"utime", t.utime}, {"stime", t.stime}, {"peak_rss", t.peakRss}, {"processes", t.processCount},
+             {"live", t.liveCount}, {"max_depth", t.maxDepth}, {"wall_ms", t.wallTimeMs},
+             {"arena_peak_bytes", t.arenaPeakBytes}, {"untracked", t.untracked}, {"degraded", t.degraded}}};
+}
+
+// Length of the valid UTF-8 sequence at the start of s, 0: invalid (overlong, surrogate, above U+10FFFF, cut short)
+size_t utf8Length(const unsigned char* s, size_t size) {
+    auto c = s[0];
+    size_t n = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : 2;
+    if (c < 0xc2 || c > 0xf4 || size < n)
+        return 0;
+    for (size_t i = 1; i < n; ++i) {
+        if ((s[i] & 0xc0) != 0x80)
+            return 0;
+    }
+    if ((c == 0xe0 && s[1] < 0xa0) || (c == 0xed && s[1] > 0x9f) || (c == 0xf0 && s[1] < 0x90) ||
+        (c == 0xf4 && s[1] > 0x8f))
+        return 0;
+    return n;
+}
+}
+
+int64_t EventSerializer::nowUs(timespec& ts) const {
+    if (_clock)
+        _clock(ts);
+    else
+        clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+void EventSerializer::putRaw(const char* s, size_t n) {
+    if (n > room()) {
+        n = room();
+        _truncated = true;
+    }
+    memcpy(_buf + _len, s, n);
+    _len += n;
+}
+
+void EventSerializer::putInt(int64_t v) {
+    char tmp[20];
+    int i = sizeof(tmp);
+    uint64_t u = v < 0 ? 0 - static_cast<uint64_t>(v) : static_cast<uint64_t>(v);
+    do {
+        tmp[--i] = char('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (v < 0)
+        put('-');
+    putRaw(tmp + i, sizeof(tmp) - i);
+}
+
+void EventSerializer::putEscaped(std::string_view s) {
+    put('"');
+    auto* p = reinterpret_cast<const unsigned char*>(s.data());
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (room() < 6) { // worst case: \u00XX or \ufffd
+            _truncated = true;
+            break;
+        }
+        auto c = p[i];
+        switch (c) {
+            case '"':  _buf[_len++] = '\\'; _buf[_len++] = '"'; break;
+            case '\\': _buf[_len++] = '\\'; _buf[_len++] = '\\'; break;
+            case '\n': _buf[_len++] = '\\'; _buf[_len++] = 'n'; break;
+            case '\r': _buf[_len++] = '\\'; _buf[_len++] = 'r'; break;
+            case '\t': _buf[_len++] = '\\'; _buf[_len++] = 't'; break;
+            default:
+                if (c < 0x20) { // includes the NUL separators of /proc/<pid>/cmdline
+                    memcpy(_buf + _len, "\\u00", 4);
+                    _buf[_len + 4] = HexDigits[c >> 4];
+                    _buf[_len + 5] = HexDigits[c & 0xf];
+                    _len += 6;
+                } else if (c < 0x80) {
+                    _buf[_len++] = static_cast<char>(c);
+                } else if (auto n = utf8Length(p + i, s.size() - i)) {
+                    memcpy(_buf + _len, p + i, n);
+                    _len += n;
+                    i += n - 1;
+                } else { // comm/cmdline are arbitrary bytes, the record must stay valid JSON
+                    memcpy(_buf + _len, "\\ufffd", 6);
+                    _len += 6;
+                }
+        }
+    }
+    put('"');
+}
+
+void EventSerializer::putHeader(std::string_view kind) {
+    timespec ts{};
+    auto tsUs = nowUs(ts);
+    if (ts.tv_sec != _timeSec) {
+        formatLogTime(_time, ts);
+        _timeSec = ts.tv_sec;
+    } else {
+        int usec = int(ts.tv_nsec / 1000);
+        for (int i = LogTimeLen - 1; i > 8; --i, usec /= 10)
+            _time[i] = char('0' + usec % 10);
+    }
+    put(R"({"ts":)");
+    putInt(tsUs);
+    put(R"(,"time":")");
+    putRaw(_time, LogTimeLen);
+    put(R"(","kind":)");
+    putEscaped(kind);
+}
+
+void EventSerializer::putClose() {
+    // the tail reserve guarantees room for the closing part
+    static constexpr char truncated[] = R"(,"truncated":true)";
+    if (_truncated) {
+        memcpy(_buf + _len, truncated, sizeof(truncated) - 1);
+        _len += sizeof(truncated) - 1;
+    }
+    _buf[_len++] = '}';
+    _buf[_len++] = '\n';
+}
+
+std::string_view EventSerializer::serialize(const ProcessData& pd, ProcStatEvent event) {
+    reset();
+    return _format == Format::BINARY ? writeBinary(pd, event) : writeJson(pd, event);
+}
+
+std::string_view EventSerializer::writeJson(const ProcessData& pd, ProcStatEvent event) {
+    putHeader("proc");
+    put(R"(,"event":)");
+    putEscaped(procStatEventName(event));
+    put(R"(,"pid":)");
+    putInt(pd.pid);
+    put(R"(,"ppid":)");
+    putInt(pd.ppid);
+    put(pd.active ? R"(,"active":true)" : R"(,"active":false)");
+    put(R"(,"props":{)");
+    bool first = true;
+    pd.forEachProp([&](std::string_view name, std::string_view value) {
+        if (_truncated)
+            return;
+        if (!first)
+            put(',');
+        first = false;
+        putEscaped(name);
+        put(':');
+        putEscaped(value);
+    });
+    put('}');
+    if (pd.session && !_truncated) {
+        auto totals = sessionCounters(*pd.session);
+        put(R"(,"session":)");
+        putCounters(totals.data(), totals.size());
+    }
+    putClose();
+    return {_buf, _len};
+}
+
+void EventSerializer::putCounters(const Counter* counters, size_t count) {
+    put('{');
+    for (size_t i = 0; i < count && !_truncated; ++i) {
+        if (i)
+            put(',');
+        putEscaped(counters[i].name);
+        put(':');
+        putInt(static_cast<int64_t>(counters[i].value));
+    }
+    put('}');
+}
+
+void EventSerializer::putMembers(const Counter* counters, size_t count) {
+    for (size_t i = 0; i < count && !_truncated; ++i) {
+        put(',');
+        putEscaped(counters[i].name);
+        put(':');
+        putInt(static_cast<int64_t>(counters[i].value));
+    }
+}
+
+std::string_view EventSerializer::serializeMessage(std::string_view kind, std::string_view text) {
+    reset();
+    putHeader(kind);
+    put(R"(,"text":)");
+    putEscaped(text);
+    putClose();
+    return {_buf, _len};
+}
+
+std::string_view EventSerializer::serializeCounters(std::string_view kind, const Counter* counters, size_t count) {
+    reset();
+    putHeader(kind);
+    put(R"(,"counters":)");
+    putCounters(counters, count);
+    putClose();
+    return {_buf, _len};
+}
+
+std::string_view EventSerializer::serializeRecord(std::string_view kind, const Field* fields, size_t fieldCount,
+                                                  const Counter* counters, size_t counterCount) {
+    reset();
+    putHeader(kind);
+    for (size_t i = 0; i < fieldCount && !_truncated; ++i) {
+        put(',');
+        putEscaped(fields[i].name);
+        put(':');
+        putEscaped(fields[i].value);
+    }
+    putMembers(counters, counterCount);
+    putClose();
+    return {_buf, _len};
+}
+
+// Frame layout (host byte order):
+//   u32 length of the rest of the frame | u8 version | u8 event | u8 active | u8 flags |
+//   i64 timestamp us | i32 pid | i32 ppid | u16 props count | props... | [session]
+// each prop: u8 name length | name | u16 value length | value
+// flags & FrameTruncated: the props did not fit, the longest value (a cmdline) was cut to make room for the others
+// session (flags & FrameHasSession): u64 utime | stime | peak_rss | processes | live | max_depth | wall_ms |
+//   arena_peak_bytes | untracked | degraded
+std::string_view EventSerializer::writeBinary(const ProcessData& pd, ProcStatEvent event) {
+    timespec ts{};
+    int64_t tsUs = nowUs(ts);
+    int32_t pid = pd.pid, ppid = pd.ppid;
+    uint16_t count = 0;
+
+    _len = sizeof(uint32_t); // length is patched at the end
+    put(static_cast<char>(BinaryVersion));
+    put(static_cast<char>(event));
+    put(static_cast<char>(pd.active));
+    size_t flagsPos = _len;
+    put('\0');
+    putRaw(reinterpret_cast<const char*>(&tsUs), sizeof(tsUs));
+    putRaw(reinterpret_cast<const char*>(&pid), sizeof(pid));
+    putRaw(reinterpret_cast<const char*>(&ppid), sizeof(ppid));
+    size_t countPos = _len;
+    _len += sizeof(count);
+    auto propSize = [](std::string_view name, size_t valueLen) {
+        return sizeof(uint8_t) + std::min<size_t>(name.size(), UINT8_MAX) + sizeof(uint16_t) + valueLen;
+    };
+    size_t total = 0, longest = 0;
+    pd.forEachProp([&](std::string_view name, std::string_view value) {
+        auto valueLen = std::min<size_t>(value.size(), UINT16_MAX);
+        total += propSize(name, valueLen);
+        longest = std::max(longest, valueLen);
+    });
+    size_t sessionBytes = pd.session ? SessionCounters * sizeof(uint64_t) : 0;
+    size_t budget = room() > sessionBytes ? room() - sessionBytes : 0;
+    size_t cut = total > budget ? total - budget : 0; // taken off the longest value
+    pd.forEachProp([&](std::string_view name, std::string_view value) {
+        auto nameLen = static_cast<uint8_t>(std::min<size_t>(name.size(), UINT8_MAX));
+        auto valueLen = std::min<size_t>(value.size(), UINT16_MAX);
+        if (cut && valueLen == longest) {
+            valueLen -= std::min(cut, valueLen);
+            cut = 0;
+            _truncated = true;
+        }
+        if (propSize(name, valueLen) > room()) { // the cut was not enough
+            _truncated = true;
+            return;
+        }
+        put(static_cast<char>(nameLen));
+        putRaw(name.data(), nameLen);
+        auto len16 = static_cast<uint16_t>(valueLen);
+        putRaw(reinterpret_cast<const char*>(&len16), sizeof(len16));
+        putRaw(value.data(), valueLen);
+        ++count;
+    });
+    if (_truncated)
+        _buf[flagsPos] |= FrameTruncated;
+    memcpy(_buf + countPos, &count, sizeof(count));
+    if (pd.session && SessionCounters * sizeof(uint64_t) <= room()) {
+        _buf[flagsPos] |= FrameHasSession;
+        for (const auto& counter : sessionCounters(*pd.session))
+            putRaw(reinterpret_cast<const char*>(&counter.value), sizeof(counter.value));
+    }
+    auto frameLen = static_cast<uint32_t>(_len - sizeof(uint32_t));
+    memcpy(_buf, &frameLen, sizeof(frameLen));
+    return {_buf, _len};
+}
+}
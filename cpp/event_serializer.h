@@ -0,0 +1,71 @@
+#pragma once
+
+#include "common.h"
+#include "monitor_subprocesses.h"
+
+#include <cstdint>
+#include <string_view>
+
+namespace SudoMonitor {
+// Formats events into a fixed buffer owned by the serializer: no heap allocations per event.
+// The returned view is valid until the next call on the same instance.
+// NDJSON: exactly one newline-terminated JSON object per event.
+// BINARY: one length-prefixed frame per event (see writeBinary for the layout).
+class EventSerializer {
+public:
+    enum class Format { NDJSON, BINARY };
+    static constexpr size_t Capacity = Config::EventBufSize;
+    struct Counter {
+        std::string_view name;
+        uint64_t value;
+    };
+    struct Field {
+        std::string_view name;
+        std::string_view value;
+    };
+    // Source of the record timestamps, CLOCK_REALTIME by default (a trace replay substitutes the recorded time)
+    using Clock = void (*)(timespec& ts);
+
+    explicit EventSerializer(Format format = Format::NDJSON) : _format(format) {}
+
+    std::string_view serialize(const ProcessData& pd, ProcStatEvent event);
+    // Free text records (e.g. unhandled protocol messages), NDJSON only
+    std::string_view serializeMessage(std::string_view kind, std::string_view text);
+    // Flat {"name":value} metrics records, NDJSON only
+    std::string_view serializeCounters(std::string_view kind, const Counter* counters, size_t count);
+    // Flat record: the fields and counters become top level members, NDJSON only
+    std::string_view serializeRecord(std::string_view kind, const Field* fields, size_t fieldCount,
+                                     const Counter* counters, size_t counterCount);
+
+    [[nodiscard]] Format format() const { return _format; }
+    void setClock(Clock clock) { _clock = clock; }
+
+private:
+    // bytes reserved at the tail so a truncated record can always be closed
+    static constexpr size_t TailReserve = 32;
+
+    void reset() { _len = 0; _truncated = false; }
+    [[nodiscard]] size_t room() const { return _len < Capacity - TailReserve ? Capacity - TailReserve - _len : 0; }
+    void putRaw(const char* s, size_t n);
+    void put(char c) { if (_len < Capacity) _buf[_len++] = c; }
+    void put(std::string_view s) { putRaw(s.data(), s.size()); }
+    void putInt(int64_t v);
+    void putEscaped(std::string_view s);
+    int64_t nowUs(timespec& ts) const;
+    void putHeader(std::string_view kind);
+    void putCounters(const Counter* counters, size_t count);
+    void putMembers(const Counter* counters, size_t count);
+    void putClose();
+
+    std::string_view writeJson(const ProcessData& pd, ProcStatEvent event);
+    std::string_view writeBinary(const ProcessData& pd, ProcStatEvent event);
+
+    Format _format;
+    Clock _clock = nullptr;
+    size_t _len = 0;
+    bool _truncated = false;
+    time_t _timeSec = -1;     // localtime_r is only called when the second changes
+    char _time[LogTimeLen];
+    char _buf[Capacity];
+};
+}
@@ -0,0 +1,116 @@
+#include "intern_pool.h"
+#include "common.h"
+
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace SudoMonitor {
+namespace {
+struct Shard {
+    std::mutex mtx;
+    std::vector<InternEntry*> buckets = std::vector<InternEntry*>(64); // power of two
+    InternMetrics metrics;
+
+    InternEntry*& bucket(size_t hash) { return buckets[(hash / Config::InternShards) & (buckets.size() - 1)]; }
+    void grow() {
+        std::vector<InternEntry*> old(buckets.size() * 2);
+        old.swap(buckets);
+        for (auto* head : old) {
+            while (head) {
+                auto* next = head->next;
+                auto& slot = bucket(head->hash);
+                head->next = slot;
+                slot = head;
+                head = next;
+            }
+        }
+    }
+};
+
+Shard* shards() {
+    static auto* s = new Shard[Config::InternShards]; // never destroyed, like the pool
+    return s;
+}
+}
+
+Symbol::Symbol(std::string_view text) : Symbol(InternPool::instance().intern(text)) {}
+
+InternPool& InternPool::instance() {
+    static auto* pool = new InternPool;
+    return *pool;
+}
+
+Symbol InternPool::intern(std::string_view text) {
+    if (text.empty())
+        return {};
+    auto hash = std::hash<std::string_view>{}(text);
+    auto& shard = shards()[hash % Config::InternShards];
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    ++shard.metrics.lookups;
+    auto& head = shard.bucket(hash);
+    for (auto* e = head; e; e = e->next) {
+        if (e->hash == hash && e->size == text.size() && memcmp(e->text(), text.data(), text.size()) == 0) {
+            e->refs.fetch_add(1, std::memory_order_relaxed);
+            e->idleSweeps = 0;
+            ++shard.metrics.hits;
+            shard.metrics.sharedBytes += text.size();
+            return Symbol(e);
+        }
+    }
+    auto* e = new (::operator new(sizeof(InternEntry) + text.size())) InternEntry;
+    memcpy(const_cast<char*>(e->text()), text.data(), text.size());
+    e->size = static_cast<uint32_t>(text.size());
+    e->hash = hash;
+    e->refs.store(1, std::memory_order_relaxed);
+    e->next = head;
+    head = e;
+    ++shard.metrics.entries;
+    shard.metrics.bytes += text.size();
+    if (shard.metrics.entries > shard.buckets.size())
+        shard.grow();
+    return Symbol(e);
+}
+
+void InternPool::sweep() {
+    for (size_t i = 0; i < Config::InternShards; ++i) {
+        auto& shard = shards()[i];
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        for (auto& head : shard.buckets) {
+            for (auto** link = &head; *link;) {
+                auto* e = *link;
+                // a new reference needs the shard lock (intern) or an existing one (copy)
+                if (e->refs.load(std::memory_order_acquire) != 0) {
+                    e->idleSweeps = 0;
+                } else if (e->idleSweeps++ > 0) {
+                    *link = e->next;
+                    --shard.metrics.entries;
+                    shard.metrics.bytes -= e->size;
+                    ++shard.metrics.evicted;
+                    e->~InternEntry();
+                    ::operator delete(e);
+                    continue;
+                }
+                link = &e->next;
+            }
+        }
+    }
+}
+
+InternMetrics InternPool::metrics() const {
+    InternMetrics total;
+    for (size_t i = 0; i < Config::InternShards; ++i) {
+        auto& shard = shards()[i];
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        total.entries += shard.metrics.entries;
+        total.bytes += shard.metrics.bytes;
+        total.lookups += shard.metrics.lookups;
+        total.hits += shard.metrics.hits;
+        total.sharedBytes += shard.metrics.sharedBytes;
+        total.evicted += shard.metrics.evicted;
+    }
+    return total;
+}
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string_view>
+
+namespace SudoMonitor {
+struct InternEntry {
+    std::atomic<uint32_t> refs{0};
+    uint32_t size = 0;
+    uint32_t idleSweeps = 0;    // under the shard lock: sweeps seen without a reference
+    size_t hash = 0;
+    InternEntry* next = nullptr; // bucket chain, under the shard lock
+    [[nodiscard]] const char* text() const { return reinterpret_cast<const char*>(this + 1); }
+};
+
+// Counted reference to an interned string: 8 bytes in a process record, copied without touching the text.
+// Resolved to text (view()) only where a record is serialized. Safe to copy and release from any thread.
+class Symbol {
+public:
+    Symbol() = default;
+    explicit Symbol(std::string_view text); // InternPool::intern, empty text: the empty symbol
+    Symbol(const Symbol& other) : _entry(other._entry) { acquire(); }
+    Symbol(Symbol&& other) noexcept : _entry(other._entry) { other._entry = nullptr; }
+    Symbol& operator=(const Symbol& other) {
+        if (_entry != other._entry) {
+            release();
+            _entry = other._entry;
+            acquire();
+        }
+        return *this;
+    }
+    Symbol& operator=(Symbol&& other) noexcept {
+        if (this != &other) {
+            release();
+            _entry = other._entry;
+            other._entry = nullptr;
+        }
+        return *this;
+    }
+    ~Symbol() { release(); }
+
+    [[nodiscard]] bool empty() const { return !_entry; }
+    [[nodiscard]] std::string_view view() const { return _entry ? std::string_view(_entry->text(), _entry->size) : ""; }
+    bool operator==(const Symbol& other) const { return _entry == other._entry; } // one entry per distinct text
+    bool operator!=(const Symbol& other) const { return _entry != other._entry; }
+
+private:
+    friend class InternPool;
+    explicit Symbol(InternEntry* entry) : _entry(entry) {} // already counted
+    void acquire() {
+        if (_entry)
+            _entry->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    void release() {
+        if (_entry)
+            _entry->refs.fetch_sub(1, std::memory_order_acq_rel);
+    }
+
+    InternEntry* _entry = nullptr;
+};
+
+struct InternMetrics {
+    uint64_t entries = 0;     // distinct strings held
+    uint64_t bytes = 0;       // their text
+    uint64_t lookups = 0;     // intern() calls
+    uint64_t hits = 0;        // lookups that found the string already interned
+    uint64_t sharedBytes = 0; // text of the hits, not copied again
+    uint64_t evicted = 0;
+};
+
+// Process-wide pool of the comm/cmdline strings, shared by every session and event: one copy per distinct string.
+// Sharded by hash, each shard a chained hash table under its own lock; resolving a Symbol takes no lock.
+// An entry whose last Symbol is gone stays for one more sweep() (InternSweepMs), so a command that runs again soon
+// after finds it, and is freed by the next one.
+class InternPool {
+public:
+    static InternPool& instance(); // never destroyed, symbols may be released while the process exits
+
+    Symbol intern(std::string_view text);
+    void sweep(); // frees the entries unreferenced since the previous sweep
+    [[nodiscard]] InternMetrics metrics() const;
+
+private:
+    InternPool() = default;
+};
+}
@@ -0,0 +1,118 @@
+#include "latency_tracer.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <mutex>
+#include <unistd.h>
+
+namespace SudoMonitor {
+namespace {
+constexpr const char* StageNames[] = {"transport", "parse", "monitor", "ui_send", "add_root", "first_sync",
+                                      "end_to_end", "kernel_fork", "kernel_exit", "kernel_exec"};
+static_assert(std::size(StageNames) == static_cast<size_t>(LatencyStage::NUM_OF_STAGES));
+
+size_t bucketOf(uint64_t ns) {
+    if (ns < 16)
+        return static_cast<size_t>(ns);
+    auto exp = 63 - static_cast<size_t>(__builtin_clzll(ns)); // >= 4
+    auto sub = static_cast<size_t>(ns >> (exp - 3)) & 7;
+    return std::min<size_t>(16 + (exp - 4) * 8 + sub, LatencyHistogram::NumBuckets - 1);
+}
+
+uint64_t bucketUpper(size_t bucket) {
+    if (bucket < 16)
+        return bucket;
+    auto exp = (bucket - 16) / 8 + 4;
+    auto sub = (bucket - 16) % 8;
+    return ((8 + sub + 1) << (exp - 3)) - 1;
+}
+}
+
+const char* latencyStageName(LatencyStage stage) {
+    auto index = static_cast<size_t>(stage);
+    return index < std::size(StageNames) ? StageNames[index] : "unknown";
+}
+
+void LatencyHistogram::record(uint64_t ns) {
+    ++_buckets[bucketOf(ns)];
+    ++_count;
+    _max = std::max(_max, ns);
+}
+
+uint64_t LatencyHistogram::quantile(double q) const {
+    if (!_count)
+        return 0;
+    auto rank = static_cast<uint64_t>(q * static_cast<double>(_count - 1)) + 1;
+    uint64_t seen = 0;
+    for (size_t b = 0; b < _buckets.size(); ++b) {
+        seen += _buckets[b];
+        if (seen >= rank)
+            return std::min(bucketUpper(b), _max);
+    }
+    return _max;
+}
+
+struct LatencyTracer::Impl {
+    std::string _chromePath;
+    FILE* _chrome = nullptr;
+    bool _firstEvent = true;
+    std::mutex _mtx;
+    std::array<LatencyHistogram, static_cast<size_t>(LatencyStage::NUM_OF_STAGES)> _histograms;
+
+    explicit Impl(std::string chromePath) : _chromePath(std::move(chromePath)) {}
+    ~Impl() {
+        if (_chrome) {
+            fputs("\n]\n", _chrome);
+            fclose(_chrome);
+        }
+    }
+};
+
+LatencyTracer::LatencyTracer(std::string chromePath) : pimpl(std::make_unique<Impl>(std::move(chromePath))) {}
+
+LatencyTracer::~LatencyTracer() = default;
+
+bool LatencyTracer::init() {
+    if (pimpl->_chromePath.empty())
+        return true;
+    pimpl->_chrome = fopen(pimpl->_chromePath.c_str(), "w");
+    if (!pimpl->_chrome)
+        return false;
+    fputs("[\n", pimpl->_chrome); // the closing bracket is optional for the trace viewers, a killed daemon still leaves a valid file
+    return true;
+}
+
+void LatencyTracer::span(LatencyStage stage, std::string_view trace, pid_t tid, uint64_t beginNs, uint64_t endNs) {
+    if (endNs < beginNs || stage >= LatencyStage::NUM_OF_STAGES)
+        return;
+    std::lock_guard<std::mutex> lock(pimpl->_mtx);
+    pimpl->_histograms[static_cast<size_t>(stage)].record(endNs - beginNs);
+    if (!pimpl->_chrome)
+        return;
+    fprintf(pimpl->_chrome, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+                            "\"args\":{\"trace\":\"%.*s\"}}",
+            pimpl->_firstEvent ? "" : ",\n", latencyStageName(stage), static_cast<double>(beginNs) / 1000,
+            static_cast<double>(endNs - beginNs) / 1000, static_cast<int>(getpid()), static_cast<int>(tid),
+            static_cast<int>(trace.size()), trace.data());
+    pimpl->_firstEvent = false;
+}
+
+LatencyTracer::StageStats LatencyTracer::stats(LatencyStage stage) const {
+    std::lock_guard<std::mutex> lock(pimpl->_mtx);
+    const auto& h = pimpl->_histograms[static_cast<size_t>(stage)];
+    return {h.count(), h.quantile(0.5), h.quantile(0.99), h.max()};
+}
+
+void LatencyTracer::flush() {
+    std::lock_guard<std::mutex> lock(pimpl->_mtx);
+    if (pimpl->_chrome)
+        fflush(pimpl->_chrome);
+}
+
+uint64_t LatencyTracer::nowNs() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+}
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+
+namespace SudoMonitor {
+// Pipeline stages between a sudo session message (or a kernel process event) and its delivery to the UI
+enum class LatencyStage {
+    Transport = 0, // plugin send -> daemon receive
+    Parse,         // receive -> message parsed
+    Monitor,       // parsed -> root Created/Died callback
+    UiSend,        // callback -> record queued for the UI socket
+    AddRoot,       // parsed -> addRootProc returned
+    FirstSync,     // root Created callback -> first tree pass over the new root
+    EndToEnd,      // plugin send -> record queued for the UI socket
+    KernelFork,    // proc connector fork timestamp -> Created callback
+    KernelExit,    // proc connector exit timestamp -> Died callback
+    KernelExec,    // proc connector exec timestamp -> Exec callback
+    NUM_OF_STAGES
+};
+const char* latencyStageName(LatencyStage stage);
+
+// Log-linear buckets (8 per power of two), so quantiles are within 12.5%
+class LatencyHistogram {
+public:
+    static constexpr size_t NumBuckets = 16 + 60 * 8;
+    void record(uint64_t ns);
+    [[nodiscard]] uint64_t quantile(double q) const; // upper bound of the bucket holding the q quantile
+    [[nodiscard]] uint64_t count() const { return _count; }
+    [[nodiscard]] uint64_t max() const { return _max; }
+
+private:
+    std::array<uint64_t, NumBuckets> _buckets{};
+    uint64_t _count = 0;
+    uint64_t _max = 0;
+};
+
+// Collects spans from the daemon and the monitor threads into one histogram per stage and, optionally,
+// a Chrome trace-event file (chrome://tracing, Perfetto). Timestamps are CLOCK_MONOTONIC ns, the clock of
+// proc_event.timestamp_ns and of the plugin's mono_ns stamp.
+class LatencyTracer {
+public:
+    struct StageStats {
+        uint64_t count = 0;
+        uint64_t p50Ns = 0;
+        uint64_t p99Ns = 0;
+        uint64_t maxNs = 0;
+    };
+
+    explicit LatencyTracer(std::string chromePath = ""); // empty: histograms only
+    ~LatencyTracer();
+    LatencyTracer(const LatencyTracer&) = delete;
+    LatencyTracer& operator=(const LatencyTracer&) = delete;
+
+    bool init(); // opens the Chrome trace file, if any
+    // tid: the session root (or the process for kernel stages); trace: the plugin's trace id, may be empty
+    void span(LatencyStage stage, std::string_view trace, pid_t tid, uint64_t beginNs, uint64_t endNs);
+    [[nodiscard]] StageStats stats(LatencyStage stage) const;
+    void flush();
+    static uint64_t nowNs();
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> pimpl;
+};
+}
@@ -1,13 +1,22 @@
 #include "monitor_subprocesses.h"
+#include "burst_aggregator.h"
+#include "cgroup_session.h"
 #include "common.h"
+#include "proc_source.h"
+#include "proc_trace.h"
+#include "self_profiler.h"
+#include "session_arena.h"
+#include "taskstats_listener.h"
 
 #include <iostream>
 #include <vector>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <string>
 #include <thread>
 #include <mutex>
-#include <fstream>
 #include <dirent.h>
 #include <algorithm>
 #include <atomic>
@@ -19,27 +28,14 @@
 #include <linux/connector.h>
 #include <linux/cn_proc.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
+#include <ctime>
 
 
 namespace SudoMonitor {
 namespace { //namespace for local helpers
 using PropsList = std::vector<std::string>;
 
-std::string readProcFile(const std::string& pid, const std::string& fileName) {
-    try {
-        std::string path = "/proc/" + pid + "/" + fileName;
-        std::ifstream stat_file(path);
-        if (!stat_file.is_open())
-            return "";
-        return static_cast<std::stringstream&>(std::stringstream() << std::ifstream(path).rdbuf()).str();
-    } catch (...) { //TODO: add error handling
-        return "";
-    }
-}
-
-std::string readProcFile(pid_t pid, const std::string& fileName) {
-    return readProcFile(std::to_string(pid), fileName);
-}
 const std::string& statFieldNameByIndex(uint index, bool dynamicOnly) {
     struct Fld{const std::string name; bool dynamic;};
     static const std::vector<Fld> fields = {
@@ -57,10 +53,10 @@ const std::string& statFieldNameByIndex(uint index, bool dynamicOnly) {
         {"cminflt", false},      // 11 cminflt     	Number of minor faults made by waited-for children.
         {"majflt", true},        // 12 majflt      	Number of major faults (required loading a memory page from disk).
         {"cmajflt", true},       // 13 cmajflt     	Number of major faults made by waited-for children.
-        {"utime", false},        // 14 utime       	CPU time spent in user mode (in clock ticks).
+        {"utime", true},         // 14 utime       	CPU time spent in user mode (in clock ticks).
         {"stime", true},         // 15 stime       	CPU time spent in kernel mode (in clock ticks).
-        {"cutime", false},       // 16 cutime      	User CPU time of waited-for children (in clock ticks).
-        {"cstime", false},       // 17 cstime      	Kernel CPU time of waited-for children (in clock ticks).
+        {"cutime", true},        // 16 cutime      	User CPU time of waited-for children (in clock ticks).
+        {"cstime", true},        // 17 cstime      	Kernel CPU time of waited-for children (in clock ticks).
         {"priority", true},      // 18 priority    	Standard scheduling priority (+15 to +20).
         {"nice", false},         // 19 nice        	The nice value (quality of "neighborliness" to others).
         {"num_threads", true},   // 20 num_threads  Number of threads in this process.
@@ -73,26 +69,47 @@ const std::string& statFieldNameByIndex(uint index, bool dynamicOnly) {
         return fields[0].name;
     return fields[index].name;
 }
-void createUpdateProcessData(ProcessData& processData, const PropsList& props) {
-    bool isOld  = !processData.props.empty();
+void setStatProps(ProcessData& processData, const PropsList& props, bool dynamicOnly) {
     uint index = 1;
     for (const auto& prop : props) {
-        auto name = statFieldNameByIndex(index++, isOld);
+        auto name = statFieldNameByIndex(index++, dynamicOnly);
         if (!name.empty())
-            processData.props[name] = prop;
+            processData.set(name, prop);
     }
+}
+// full: re-read the static fields too (e.g. after exec replaced comm/cmdline)
+void createUpdateProcessData(ProcSource& source, ProcessData& processData, const PropsList& props, bool full = false) {
+    bool isOld  = !full && !processData.props.empty();
+    setStatProps(processData, props, isOld);
     if (!isOld) {
-        auto cmd = readProcFile(processData.pid, "cmdline");
+        auto cmd = source.readFile(processData.pid, "cmdline");
         if (!cmd.empty())
-            processData.props["cmdline"] = cmd;
+            processData.set("cmdline", cmd);
     }
 }
+uint64_t propU64(const ProcessData& pd, std::string_view name) {
+    auto it = pd.props.find(name);
+    return it == pd.props.end() ? 0 : strtoull(it->second.c_str(), nullptr, 10);
+}
+
+// Moved, never copied: a copy would leave the session arena
 struct Node {
-    using SubProc = std::vector<Node>;
+    using SubProc = std::pmr::vector<Node>;
     ProcessData processData;
     SubProc subProc;
+    std::chrono::steady_clock::time_point nextPeriodic; // next AttrTier::Periodic refresh
+    struct Accounted {
+        uint64_t utime = 0, stime = 0, rss = 0;
+        size_t symbols = 0; // comm/cmdline bytes charged to the session arena
+    } accounted; // already folded into the session totals
+    bool zombie = false; // died through the connector, kept until reaped so a tree pass cannot add it again
+    bool exitPending = false; // gone from /proc while the connector's Exit may still be queued
 
-    Node(pid_t p, pid_t ppid = 0) : processData(p, ppid) {}
+    Node(pid_t p, pid_t ppid, std::pmr::memory_resource* mr) : processData(p, ppid, mr), subProc(mr) {}
+    Node(Node&&) = default;
+    Node& operator=(Node&&) = default;
+    Node(const Node&) = delete;
+    Node& operator=(const Node&) = delete;
 
     bool active() const { return processData.active; }
     pid_t pid() const { return processData.pid; }
@@ -109,6 +126,7 @@ struct Node {
         return -1;
     }
 };
+static_assert(std::is_nothrow_move_constructible_v<Node>, "vector growth must move nodes within the arena");
 
 PropsList conditionalSplit(const std::string& s, pid_t ppid) {
     std::vector<std::string> tokens;
@@ -121,113 +139,705 @@ PropsList conditionalSplit(const std::string& s, pid_t ppid) {
     }
     return tokens;
 }
-std::string ProcStatEventToString(ProcStatEvent event) {
+// wait(2) status, from a taskstats record or the connector's exit event
+void applyExitStatus(ProcessData& pd, uint32_t exitStatus) {
+    auto status = static_cast<int>(exitStatus);
+    pd.set("exit_code", std::to_string(WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status)));
+    if (WIFSIGNALED(status))
+        pd.set("exit_signal", std::to_string(WTERMSIG(status)));
+}
+// Final kernel accounting replaces the last polled values
+void applyExitRecord(ProcessData& pd, const ExitRecord& rec) {
+    static const uint64_t ticksPerSec = static_cast<uint64_t>(sysconf(_SC_CLK_TCK));
+    auto& props = pd.props;
+    applyExitStatus(pd, rec.exitStatus);
+    props["exit_utime_us"] = std::to_string(rec.utimeUs);
+    props["exit_stime_us"] = std::to_string(rec.stimeUs);
+    props["exit_elapsed_us"] = std::to_string(rec.elapsedUs);
+    props["exit_hiwater_rss_kb"] = std::to_string(rec.hiwaterRssKb);
+    props["exit_hiwater_vm_kb"] = std::to_string(rec.hiwaterVmKb);
+    props["exit_read_bytes"] = std::to_string(rec.readBytes);
+    props["exit_write_bytes"] = std::to_string(rec.writeBytes);
+    auto utime = rec.utimeUs * ticksPerSec / 1000000;
+    auto stime = rec.stimeUs * ticksPerSec / 1000000;
+    if (utime > propU64(pd, "utime"))
+        props["utime"] = std::to_string(utime);
+    if (stime > propU64(pd, "stime"))
+        props["stime"] = std::to_string(stime);
+}
+
+using ProcList = std::vector<std::pair<pid_t, PropsList>>;
+PropsList statToProcList(ProcSource& source, pid_t pid, pid_t ppid = 0) {
+    auto content = source.readFile(pid, "stat");
+    return conditionalSplit(content, ppid);
+}
+// Children by parent for one tree pass: from one cgroup.procs read per session (membership), or from one
+// full /proc scan shared by the sessions without a cgroup
+struct MemberIndex {
+    bool membership = false; // members holds every process of the session, so it answers alive()
+    std::set<pid_t> members;
+    std::map<pid_t, ProcList> children; // by ppid, members reparented out of the session are listed under the root
+    std::set<pid_t> reparented;
+
+    [[nodiscard]] bool alive(pid_t pid) const { return members.count(pid) > 0; }
+    [[nodiscard]] const ProcList& childrenOf(pid_t pid) const {
+        static const ProcList none;
+        auto it = children.find(pid);
+        return it == children.end() ? none : it->second;
+    }
+};
+
+}
+
+const char* procStatEventName(ProcStatEvent event) {
     switch (event) {
         case ProcStatEvent::Created: return "Created";
         case ProcStatEvent::Died: return "Died";
         case ProcStatEvent::Removed: return "Removed";
+        case ProcStatEvent::Summary: return "Summary";
+        case ProcStatEvent::Exec: return "Exec";
+        case ProcStatEvent::Queried: return "Queried";
         default: return "Unknown";
     }
 }
 
-bool isPidAlive(pid_t pid) {
-    if (pid <= 0)
+struct Session {
+    SessionTotals totals;
+    int64_t currentRss = 0;
+    std::chrono::steady_clock::time_point start;
+    std::unique_ptr<CgroupSession> cgroup; // null when the session is tracked by scanning /proc
+    std::unique_ptr<SessionArena> arena;   // the tree storage, must outlive the session's nodes
+    std::vector<pid_t> untrackedSeen;      // direct-mapped by pid, allocated when the cap is first reached
+
+    SessionTotals snapshot(std::chrono::steady_clock::time_point now) const {
+        auto result = totals;
+        result.wallTimeMs = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+            now - start).count());
+        if (arena)
+            result.arenaPeakBytes = arena->peak();
+        return result;
+    }
+    std::pmr::memory_resource* resource() const {
+        return arena ? arena.get() : std::pmr::get_default_resource();
+    }
+    SessionArena::Pressure pressure() {
+        auto level = arena ? arena->pressure() : SessionArena::Pressure::Normal;
+        totals.degraded = std::max(totals.degraded, static_cast<uint32_t>(level));
+        return level;
+    }
+    // At the cap new processes are only counted, once per pid while it stays in the filter
+    bool admit(pid_t pid) {
+        if (pressure() != SessionArena::Pressure::Full)
+            return true;
+        if (untrackedSeen.empty())
+            untrackedSeen.resize(Config::UntrackedFilterSlots);
+        auto& slot = untrackedSeen[static_cast<size_t>(pid) % untrackedSeen.size()];
+        if (slot != pid) {
+            slot = pid;
+            ++totals.untracked;
+        }
         return false;
-    if (::kill(pid, 0) == 0)
-        return true;
-    if (errno == EPERM)
-        return true;
-    return false;
-}
-using ProcList = std::vector<std::pair<pid_t, PropsList>>;
-PropsList statToProcList(const std::string& pid, pid_t ppid = 0) {
-    auto content = readProcFile(std::stoi(pid), "stat");
-    return conditionalSplit(content, ppid);
-}
-ProcList getChildrenFromOS(pid_t ppid) {
-    ProcList children;
-    DIR* dir = opendir("/proc");
-    if (!dir) return children;
-
-    struct dirent* entry;
-    while ((entry = readdir(dir)) != nullptr) {
-        if (isdigit(entry->d_name[0])) {
-            pid_t pid = atoi(entry->d_name);
-            auto props = statToProcList(std::to_string(pid), ppid);
-            if (props.empty())
-                continue;
-            children.emplace_back(pid, std::move(props));
+    }
+    // The pool shares the text between sessions, but a cmdline can be up to ARG_MAX: each node is charged the full
+    // size of its symbols, so distinct long command lines run into the cap like the tree storage does
+    void chargeSymbols(Node& node) {
+        auto bytes = node.processData.comm.view().size() + node.processData.cmdline.view().size();
+        if (!arena || bytes == node.accounted.symbols)
+            return;
+        arena->uncharge(node.accounted.symbols);
+        arena->charge(bytes);
+        node.accounted.symbols = bytes;
+    }
+    void released(Node& node) {
+        if (arena)
+            arena->uncharge(node.accounted.symbols);
+        node.accounted.symbols = 0;
+    }
+    void added(Node& node, uint32_t depth) {
+        ++totals.processCount;
+        ++totals.liveCount;
+        totals.maxDepth = std::max(totals.maxDepth, depth);
+        account(node);
+    }
+    // folds the change since the last call, so the cost is per updated node and not per tree
+    void account(Node& node) {
+        chargeSymbols(node);
+        if (!node.active())
+            return;
+        const auto& pd = node.processData;
+        auto& acc = node.accounted;
+        auto utime = propU64(pd, "utime");
+        auto stime = propU64(pd, "stime");
+        auto rss = propU64(pd, "rss");
+        if (utime > acc.utime) {
+            totals.utime += utime - acc.utime;
+            acc.utime = utime;
         }
+        if (stime > acc.stime) {
+            totals.stime += stime - acc.stime;
+            acc.stime = stime;
+        }
+        currentRss += static_cast<int64_t>(rss) - static_cast<int64_t>(acc.rss);
+        acc.rss = rss;
+        totals.peakRss = std::max(totals.peakRss, static_cast<uint64_t>(std::max<int64_t>(currentRss, 0)));
     }
-    closedir(dir);
-    return children;
-}
-
-}
+    void died(Node& node) {
+        --totals.liveCount;
+        currentRss -= static_cast<int64_t>(node.accounted.rss);
+        node.accounted.rss = 0;
+    }
+};
 
 struct ProcTreeMonitor::Impl {
     const std::chrono::milliseconds TreeUpdateTimeout{5};
+    CgroupEvents _cgroupEvents; // outlives the session leaves watched through it
+    std::map<pid_t, Session> _sessions; // by root pid, declared first: the trees are destroyed before their arenas
     std::map<pid_t, Node> _processTrees;
     OnProcStatChange _onProcStatChange;
     std::thread _treeUpdateWorker;
     std::thread _netLinkWorker;
     std::mutex _mtx;
     std::atomic<bool> _running{false};
-    std::condition_variable _cv;
-    bool _eventTriggered = false;
+    ProcAttrCollector _attrs;
+    BurstAggregator _bursts;
+    std::set<pid_t> _execPending; // exec seen by netlink, consumed (or dropped) by the next tree pass
+    std::vector<pid_t> _scanParents;     // scanProc buffers, reused across passes
+    std::vector<pid_t> _scanPpids;
+    std::vector<std::string> _scanLines;
+    std::chrono::steady_clock::time_point _nextInternSweep{};
+
+    struct PendingExit {
+        ExitRecord record;
+        std::chrono::steady_clock::time_point expires;
+    };
+    bool _useTaskstats;
+    std::unique_ptr<TaskstatsListener> _taskstats;
+    std::thread _taskstatsWorker;
+    std::mutex _exitsMtx;                // the listener thread only touches _newExits
+    std::vector<ExitRecord> _newExits;
+    std::map<pid_t, PendingExit> _exits; // tree worker side, under _mtx
+    std::atomic<uint64_t> _exitsAttached{0}, _exitsShortLived{0};
+
+    std::string _cgroupBase; // empty: cgroup containment disabled
+    std::thread _cgroupWorker;
+    std::vector<int> _firedWatches; // cgroup.events watches that fired, under _eventsMtx
+    std::vector<std::unique_ptr<CgroupSession>> _retiredCgroups; // leaves of removed sessions, kept until empty
+    size_t _sessionMemoryCap;
+
+    // Connector events of tracked processes, with the /proc reads taken by the netlink thread when they arrived
+    struct QueuedEvent {
+        ProcEvent event;
+        std::string stat;
+        Symbol cmdline; // interned by the netlink thread
+    };
+    bool _procEvents;
+    std::mutex _eventsMtx;              // never held across a /proc read or a tree pass
+    std::condition_variable _eventsCv;  // wakes the tree worker
+    std::vector<QueuedEvent> _events;
+    std::vector<QueuedEvent> _applying; // tree worker side, swapped with _events
+    std::unordered_set<pid_t> _tracked; // pids of the tracked nodes, checked by the netlink thread
+    // Where each node of the trees is, tree worker side under _mtx: a lookup walks one path instead of every tree
+    struct TreePos {
+        pid_t root;
+        pid_t parent; // 0: a root
+        uint32_t depth;
+    };
+    std::unordered_map<pid_t, TreePos> _positions;
+    std::vector<pid_t> _path; // findNode scratch
+    bool _passRequested = false;
+    std::vector<pid_t> _recentlyRemoved; // direct-mapped, a late fork event must not bring back a removed process
+    std::atomic<uint64_t> _forksApplied{0}, _execsApplied{0}, _exitsApplied{0}, _eventsDropped{0};
 
-    explicit Impl(const OnProcStatChange& cb) : _onProcStatChange(cb) {}
+    struct KernelStamp {
+        uint64_t forkNs = 0;
+        uint64_t execNs = 0;
+        uint64_t exitNs = 0;
+    };
+    MonitorSpans _spans;
+    std::vector<pid_t> _firstSyncPending;                 // roots added since the last tree pass
+    std::mutex _stampsMtx;                                // the netlink thread only touches _kernelStamps
+    std::unordered_map<pid_t, KernelStamp> _kernelStamps; // only kept with a kernel span hook
+    uint64_t _nextStampPruneNs = 0;
+
+    std::unique_ptr<TraceWriter> _trace; // declared before _source, which may record into it
+    RecordingProcSource* _recording = nullptr; // _source when recording
+    std::shared_ptr<ProcSource> _source;
+
+    Impl(const OnProcStatChange& cb, const MonitorOptions& options)
+        : _onProcStatChange(cb), _attrs(options.attrs),
+          _bursts(options.bursts, [this](const BurstSummary& s) { onBurstSummary(s); }),
+          _useTaskstats(options.taskstats),
+          _cgroupBase(options.cgroups ? options.cgroupBase : ""), _sessionMemoryCap(options.sessionMemoryCap),
+          _procEvents(options.procEvents), _spans(options.spans),
+          _source(options.source ? options.source : liveProcSource()) {
+        if (!_cgroupBase.empty() && !_cgroupEvents.init()) {
+            perror("inotify, cgroup containment disabled");
+            _cgroupBase.clear();
+        }
+        if (options.recordPath.empty())
+            return;
+        _trace = std::make_unique<TraceWriter>(options.recordPath);
+        if (_trace->init()) {
+            auto recording = std::make_shared<RecordingProcSource>(_source, *_trace);
+            _recording = recording.get();
+            _source = std::move(recording);
+        } else {
+            perror(("cannot record into " + options.recordPath).c_str());
+            _trace.reset();
+        }
+    }
     ~Impl() {
         _running = false;
         if (_treeUpdateWorker.joinable())
             _treeUpdateWorker.join();
         if (_netLinkWorker.joinable())
             _netLinkWorker.join();
+        if (_taskstatsWorker.joinable())
+            _taskstatsWorker.join();
+        if (_cgroupWorker.joinable())
+            _cgroupWorker.join();
+    }
+    void markDied(Node& node, Session& session) {
+        if (attachExitRecord(node))
+            session.account(node);
+        session.died(node);
+        node.died();
+    }
+    bool attachExitRecord(Node& node) {
+        auto exit = _exits.find(node.pid());
+        if (exit == _exits.end())
+            return false;
+        applyExitRecord(node.processData, exit->second.record);
+        _exits.erase(exit);
+        ++_exitsAttached;
+        return true;
+    }
+    void startTaskstats() {
+        if (!_useTaskstats)
+            return;
+        _taskstats = std::make_unique<TaskstatsListener>([this](const ExitRecord& rec) {
+            std::lock_guard<std::mutex> lock(_exitsMtx);
+            if (_newExits.size() < Config::MaxExitRecords)
+                _newExits.push_back(rec);
+        });
+        if (!_taskstats->init()) {
+            perror("taskstats unavailable, exit accounting disabled");
+            _taskstats.reset();
+            return;
+        }
+        _taskstatsWorker = std::thread([this] {
+            SelfProfiler::nameThread("taskstats");
+            _taskstats->run(_running);
+        });
+    }
+    void collectExitRecords() {
+        std::vector<ExitRecord> records;
+        {
+            std::lock_guard<std::mutex> lock(_exitsMtx);
+            records.swap(_newExits);
+        }
+        auto expires = _source->now() + std::chrono::milliseconds(Config::ExitRecordTtlMs);
+        for (const auto& rec : records) {
+            if (_exits.size() < Config::MaxExitRecords)
+                _exits[rec.pid] = {rec, expires};
+        }
+    }
+    // Children of tracked processes that exited before a tree pass saw them are reported from their exit record.
+    // Records of tracked processes wait for syncActiveState (a zombie is still "alive" until reaped).
+    void reportShortLived() {
+        auto now = _source->now();
+        for (auto it = _exits.begin(); it != _exits.end();) {
+            const auto& rec = it->second.record;
+            if (_positions.count(rec.pid)) {
+                ++it;
+                continue;
+            }
+            if (auto parent = _positions.find(rec.ppid); parent != _positions.end()) {
+                auto& session = _sessions[parent->second.root];
+                Node node(rec.pid, rec.ppid, std::pmr::get_default_resource()); // reported, never stored
+                auto& props = node.processData.props;
+                props["pid"] = std::to_string(rec.pid);
+                props["ppid"] = std::to_string(rec.ppid);
+                node.processData.set("comm", std::string("(") + rec.comm + ")");
+                props["short_lived"] = "true";
+                session.added(node, parent->second.depth + 1);
+                notify(node.processData, ProcStatEvent::Created);
+                applyExitRecord(node.processData, rec);
+                session.account(node);
+                session.died(node);
+                node.processData.active = false;
+                notify(node.processData, ProcStatEvent::Died);
+                notify(node.processData, ProcStatEvent::Removed);
+                ++_exitsShortLived;
+                it = _exits.erase(it);
+            } else if (now >= it->second.expires) {
+                it = _exits.erase(it);
+            } else {
+                ++it;
+            }
+        }
     }
-    void syncActiveState(Node& node) {
+    void syncActiveState(Node& node, Session& session, const MemberIndex& index) {
         if (!node.active())
             return;
-        if (isPidAlive(node.pid()))
+        if (index.membership ? index.alive(node.pid()) : _source->isAlive(node.pid()))
             return;
-        node.died();
-        if (_onProcStatChange)
-            _onProcStatChange(node.processData, ProcStatEvent::Died);
+        if (_procEvents && !node.exitPending) { // one more pass, so its Exec and Exit are applied before it dies
+            node.exitPending = true;
+            return;
+        }
+        markDied(node, session);
+        notify(node.processData, ProcStatEvent::Died);
+    }
+    // Child events go through the burst aggregation, roots are never folded (their ppid is 0). The Exec of a folded
+    // child is reported, marked burst_folded: its Died and Removed go into the summaries.
+    void notify(ProcessData& pd, ProcStatEvent event) {
+        bool folded = false;
+        switch (event) {
+            case ProcStatEvent::Created: {
+                folded = _bursts.childCreated(pd.pid, pd.ppid, pd.comm.view(), _source->now());
+                break;
+            }
+            case ProcStatEvent::Exec:
+                if (_bursts.childExec(pd.pid, pd.ppid, pd.comm.view()))
+                    pd.set("burst_folded", "true");
+                break;
+            case ProcStatEvent::Died:
+                folded = _bursts.childDied(pd.pid, pd.ppid, propU64(pd, "utime"), propU64(pd, "stime"));
+                break;
+            case ProcStatEvent::Removed:
+                folded = _bursts.childRemoved(pd.pid, pd.ppid, _source->now());
+                break;
+            default:
+                break;
+        }
+        if (_spans.kernel && event != ProcStatEvent::Removed && event != ProcStatEvent::Summary)
+            kernelSpan(pd.pid, event);
+        if (!folded && _onProcStatChange)
+            _onProcStatChange(pd, event);
+    }
+    void kernelSpan(pid_t pid, ProcStatEvent event) {
+        uint64_t ns = 0;
+        {
+            std::lock_guard<std::mutex> lock(_stampsMtx);
+            auto it = _kernelStamps.find(pid);
+            if (it == _kernelStamps.end())
+                return;
+            ns = event == ProcStatEvent::Created ? it->second.forkNs
+                 : event == ProcStatEvent::Exec  ? it->second.execNs
+                                                 : it->second.exitNs;
+            if (event == ProcStatEvent::Died)
+                _kernelStamps.erase(it);
+        }
+        if (ns)
+            _spans.kernel(pid, event, ns);
+    }
+    void stampKernelEvent(const ProcEvent& event) {
+        if (!_spans.kernel || !event.timestampNs)
+            return;
+        std::lock_guard<std::mutex> lock(_stampsMtx);
+        auto it = _kernelStamps.find(event.pid);
+        if (it == _kernelStamps.end()) {
+            if (_kernelStamps.size() >= Config::KernelStampEntries)
+                return;
+            it = _kernelStamps.emplace(event.pid, KernelStamp{}).first;
+        }
+        auto& stamp = it->second;
+        (event.type == ProcEvent::Fork ? stamp.forkNs : event.type == ProcEvent::Exec ? stamp.execNs : stamp.exitNs) =
+            event.timestampNs;
+    }
+    void pruneKernelStamps() {
+        timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        auto now = static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+        if (now < _nextStampPruneNs)
+            return;
+        constexpr uint64_t ttl = Config::KernelStampTtlMs * 1000000ull;
+        _nextStampPruneNs = now + ttl / 10;
+        std::lock_guard<std::mutex> lock(_stampsMtx);
+        for (auto it = _kernelStamps.begin(); it != _kernelStamps.end();) {
+            if (std::max({it->second.forkNs, it->second.execNs, it->second.exitNs}) + ttl < now)
+                it = _kernelStamps.erase(it);
+            else
+                ++it;
+        }
+    }
+    void onBurstSummary(const BurstSummary& s) {
+        if (!_onProcStatChange)
+            return;
+        auto parent = findNode(s.parent);
+        ProcessData pd(s.parent, parent ? parent->processData.ppid : 0);
+        pd.active = parent && parent->active();
+        if (parent)
+            pd.comm = parent->processData.comm;
+        pd.set("burst_comm", s.comm);
+        pd.set("burst_state", s.ended ? "ended" : "active");
+        pd.set("burst_children", std::to_string(s.spawned));
+        pd.set("burst_exited", std::to_string(s.exited));
+        pd.set("burst_live", std::to_string(s.live));
+        pd.set("burst_peak_live", std::to_string(s.peakLive));
+        pd.set("burst_utime", std::to_string(s.utime));
+        pd.set("burst_stime", std::to_string(s.stime));
+        pd.set("burst_period_ms", std::to_string(s.periodMs));
+        _onProcStatChange(pd, ProcStatEvent::Summary);
     }
     void syncProcessData(Node& node) {
-        const auto props = statToProcList(std::to_string(node.pid()));
-        createUpdateProcessData(node.processData, statToProcList(std::to_string(node.pid())));
+        createUpdateProcessData(*_source, node.processData, statToProcList(*_source, node.pid()));
+    }
+    void processStarted(Node& node, Session& session) {
+        if (session.pressure() == SessionArena::Pressure::Normal)
+            _attrs.collect(node.processData, AttrTier::OnStart, *_source);
+        node.nextPeriodic = _source->now();
+    }
+    void syncAttributes(Node& node, Session& session) {
+        if (!node.active())
+            return;
+        bool reduced = session.pressure() != SessionArena::Pressure::Normal;
+        if (_execPending.erase(node.pid())) {
+            createUpdateProcessData(*_source, node.processData, statToProcList(*_source, node.pid()), true);
+            if (!reduced)
+                _attrs.collect(node.processData, AttrTier::OnStart, *_source);
+        }
+        if (reduced)
+            return;
+        auto now = _source->now();
+        if (now >= node.nextPeriodic && _attrs.policy().uses(AttrTier::Periodic)) {
+            _attrs.collect(node.processData, AttrTier::Periodic, *_source);
+            node.nextPeriodic = now + _attrs.policy().periodicInterval;
+        }
+    }
+    Node* findNode(pid_t pid, pid_t* rootPid = nullptr, uint32_t* depth = nullptr) {
+        auto pos = _positions.find(pid);
+        if (pos == _positions.end())
+            return nullptr;
+        auto tree = _processTrees.find(pos->second.root);
+        if (tree == _processTrees.end())
+            return nullptr;
+        _path.clear();
+        for (auto p = pos; p->second.parent; p = _positions.find(p->second.parent)) {
+            _path.push_back(p->first);
+            if (!_positions.count(p->second.parent))
+                return nullptr;
+        }
+        auto node = &tree->second;
+        for (auto it = _path.rbegin(); it != _path.rend(); ++it) {
+            auto child = node->findChild(*it);
+            if (child < 0)
+                return nullptr;
+            node = &node->subProc[child];
+        }
+        if (rootPid)
+            *rootPid = pos->second.root;
+        if (depth)
+            *depth = pos->second.depth;
+        return node;
+    }
+    // A root replaces the position of a child with the same pid (a nested session), a child does not replace a root
+    void indexNode(pid_t pid, pid_t parent) {
+        if (!parent) {
+            _positions[pid] = {pid, 0, 0};
+            return;
+        }
+        auto pos = _positions.find(parent);
+        if (pos != _positions.end())
+            _positions.emplace(pid, TreePos{pos->second.root, parent, pos->second.depth + 1});
+    }
+    void unindexNode(pid_t pid, pid_t parent) {
+        auto pos = _positions.find(pid);
+        if (pos != _positions.end() && pos->second.parent == parent)
+            _positions.erase(pos);
+    }
+    void record(TraceRecordType type, pid_t pid = 0) {
+        if (!_trace)
+            return;
+        TraceRecord rec;
+        rec.type = type;
+        rec.pid = pid;
+        _trace->write(rec);
     }
     void triggerUpdateTree() {
         {
-            std::lock_guard<std::mutex> lock(_mtx);
-            _eventTriggered = true;
+            std::lock_guard<std::mutex> lock(_eventsMtx);
+            _passRequested = true;
         }
-        _cv.notify_one();
+        _eventsCv.notify_one();
+    }
+    void track(pid_t pid) {
+        if (!_procEvents)
+            return;
+        std::lock_guard<std::mutex> lock(_eventsMtx);
+        _tracked.insert(pid);
+    }
+    void untrack(pid_t pid, bool removed = true) {
+        if (!_procEvents)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(_eventsMtx);
+            _tracked.erase(pid);
+        }
+        if (!removed)
+            return;
+        if (_recentlyRemoved.empty())
+            _recentlyRemoved.resize(Config::RemovedFilterSlots);
+        _recentlyRemoved[static_cast<size_t>(pid) % _recentlyRemoved.size()] = pid;
+    }
+    bool wasRemoved(pid_t pid) {
+        if (_recentlyRemoved.empty())
+            return false;
+        auto& slot = _recentlyRemoved[static_cast<size_t>(pid) % _recentlyRemoved.size()];
+        if (slot != pid)
+            return false;
+        slot = 0; // once, a reused pid is found by the next pass anyway
+        return true;
+    }
+    void containSession(pid_t rootPid, Session& session) {
+        if (_cgroupBase.empty())
+            return;
+        auto cgroup = std::make_unique<CgroupSession>(_cgroupBase, rootPid);
+        if (cgroup->init(_cgroupEvents))
+            session.cgroup = std::move(cgroup);
+        else
+            std::cerr << "cgroup v2 delegation is not available under " << _cgroupBase
+                      << ", session " << rootPid << " is tracked through /proc" << std::endl;
     }
-    void syncNode(Node& node) {
-        syncActiveState(node);
+    // A leaf's populated state changes only through its cgroup.events watch: the sessions' to end them,
+    // the retired ones' to remove the leaf once its last process (often sudo itself, after END) has exited
+    void applyCgroupEvents() {
+        std::vector<int> fired;
+        {
+            std::lock_guard<std::mutex> lock(_eventsMtx);
+            fired.swap(_firedWatches);
+        }
+        if (!_running) // driven mode, no watcher thread
+            fired = _cgroupEvents.wait(0);
+        for (auto wd : fired) {
+            for (auto& [pid, session] : _sessions) {
+                if (session.cgroup && session.cgroup->watch() == wd)
+                    session.cgroup->eventsChanged();
+            }
+            for (auto it = _retiredCgroups.begin(); it != _retiredCgroups.end(); ++it) {
+                if ((*it)->watch() != wd)
+                    continue;
+                (*it)->eventsChanged();
+                if (!(*it)->populated())
+                    _retiredCgroups.erase(it);
+                break;
+            }
+        }
+    }
+    MemberIndex buildMemberIndex(Node& root, CgroupSession& cgroup) {
+        MemberIndex index;
+        index.membership = true;
+        if (!cgroup.populated()) // cgroup.events reported that every member exited
+            return index;
+        auto pids = cgroup.members();
+        index.members.insert(pids.begin(), pids.end());
+        for (auto pid : pids) {
+            if (pid == root.pid())
+                continue;
+            auto props = statToProcList(*_source, pid);
+            if (props.size() < 4)
+                continue;
+            auto ppid = static_cast<pid_t>(atoi(props[3].c_str()));
+            if (!index.alive(ppid)) {
+                if (auto pos = _positions.find(pid); pos != _positions.end() && pos->second.root == root.pid())
+                    continue; // still tracked under its dead parent
+                ppid = root.pid();
+                index.reparented.insert(pid);
+            }
+            index.children[ppid].emplace_back(pid, std::move(props));
+        }
+        return index;
+    }
+    static void collectPids(const Node& node, std::vector<pid_t>& out) {
+        out.push_back(node.pid());
+        for (const auto& sub : node.subProc)
+            collectPids(sub, out);
+    }
+    // One /proc pass per tree pass instead of one per tracked node: only the children of tracked processes are
+    // kept, then the children of the processes new in this pass (rejected by the first filter) are re-read.
+    MemberIndex scanProc() {
+        ProfileScope profile(ProfilePoint::ScanProc);
+        MemberIndex index;
+        _scanParents.clear();
+        for (const auto& [pid, root] : _processTrees) {
+            if (!_sessions[pid].cgroup)
+                collectPids(root, _scanParents);
+        }
+        if (_scanParents.empty())
+            return index;
+        std::sort(_scanParents.begin(), _scanParents.end());
+        auto pids = _source->listPids();
+        _source->readStats(pids, _scanParents, _scanPpids, _scanLines);
+        std::set<pid_t> found;
+        for (size_t i = 0; i < pids.size(); ++i) {
+            if (_scanLines[i].empty())
+                continue;
+            if (!std::binary_search(_scanParents.begin(), _scanParents.end(), pids[i]))
+                found.insert(pids[i]);
+            index.children[_scanPpids[i]].emplace_back(pids[i], conditionalSplit(_scanLines[i], 0));
+        }
+        while (!found.empty()) {
+            std::set<pid_t> next;
+            for (size_t i = 0; i < pids.size(); ++i) {
+                if (!_scanLines[i].empty() || !found.count(_scanPpids[i]))
+                    continue;
+                _scanLines[i] = _source->readFile(pids[i], "stat");
+                if (statPpid(_scanLines[i]) != _scanPpids[i])
+                    continue;
+                next.insert(pids[i]);
+                index.children[_scanPpids[i]].emplace_back(pids[i], conditionalSplit(_scanLines[i], 0));
+            }
+            found.swap(next);
+        }
+        return index;
+    }
+    void syncTree(Node& root, Session& session, const MemberIndex& scan) {
+        if (session.cgroup) {
+            auto index = buildMemberIndex(root, *session.cgroup);
+            syncNode(root, session, 0, index);
+        } else {
+            syncNode(root, session, 0, scan);
+        }
+    }
+    void syncNode(Node& node, Session& session, uint32_t depth, const MemberIndex& index) {
+        ProfileScope profile(ProfilePoint::SyncNode);
+        if (node.zombie && !(index.membership ? index.alive(node.pid()) : _source->isAlive(node.pid())))
+            node.zombie = false;
+        session.account(node);
+        syncActiveState(node, session, index);
         if (node.active() && node.orphan()) {
             syncProcessData(node);
         }
-        const auto osChildren = getChildrenFromOS(node.pid());
-        for (const auto& childProps : osChildren) {
+        syncAttributes(node, session);
+        for (const auto& childProps : index.childrenOf(node.pid())) {
             auto childIndex = node.findChild(childProps.first);
             if (childIndex < 0) {
-                Node newNode(childProps.first, node.processData.pid);
-                createUpdateProcessData(newNode.processData, childProps.second);
-                if (_onProcStatChange)
-                    _onProcStatChange(newNode.processData, ProcStatEvent::Created);
-                node.subProc.emplace_back(newNode);
+                if (!session.admit(childProps.first))
+                    continue;
+                Node newNode(childProps.first, node.processData.pid, session.resource());
+                createUpdateProcessData(*_source, newNode.processData, childProps.second);
+                if (index.reparented.count(childProps.first))
+                    newNode.processData.props["reparented"] = "true";
+                processStarted(newNode, session);
+                session.added(newNode, depth + 1);
+                track(newNode.pid());
+                indexNode(newNode.pid(), node.pid());
+                notify(newNode.processData, ProcStatEvent::Created);
+                node.subProc.push_back(std::move(newNode));
             } else {
-                createUpdateProcessData(node.subProc[childIndex].processData, childProps.second);
+                createUpdateProcessData(*_source, node.subProc[childIndex].processData, childProps.second);
             }
         }
 
         for (auto it = node.subProc.begin(); it != node.subProc.end(); ) {
-            syncNode(*it);
-            if (!it->processData.active && it->subProc.empty()) {
-                if (_onProcStatChange)
-                    _onProcStatChange(it->processData, ProcStatEvent::Removed);
+            syncNode(*it, session, depth + 1, index);
+            if (!it->processData.active && it->subProc.empty() && !it->zombie) {
+                attachExitRecord(*it); // a record that came after the connector's exit
+                untrack(it->pid());
+                unindexNode(it->pid(), node.pid());
+                notify(it->processData, ProcStatEvent::Removed);
+                session.released(*it);
                 it = node.subProc.erase(it);
             } else {
                 ++it;
@@ -239,26 +849,159 @@ struct ProcTreeMonitor::Impl {
         if (s < 0) { perror("socket"); return -1; }
         sockaddr_nl sa = { .nl_family = AF_NETLINK, .nl_pid = static_cast<uint>(getpid()) , .nl_groups = CN_IDX_PROC};
         if (bind(s, (sockaddr*)&sa, sizeof(sa)) < 0) { perror("bind"); close(s); return -1; }
+        timeval timeout{0, 200000}; // so a stopping monitor does not wait for the next process event
+        setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
         // subscribe
-        struct Req {
-            struct nlmsghdr nlh;
-            struct cn_msg   cn;
-            enum proc_cn_mcast_op op;
-        };
-        Req req;
-        req.nlh.nlmsg_len = sizeof(req);
-        req.nlh.nlmsg_pid = static_cast<uint32_t>(getpid());
-        req.nlh.nlmsg_type = NLMSG_DONE;
-
-        req.cn.id.idx = CN_IDX_PROC;
-        req.cn.id.val = CN_VAL_PROC;
-        req.cn.len = sizeof(enum proc_cn_mcast_op);
-
-        req.op = PROC_CN_MCAST_LISTEN;
-        if (send(s, &req, sizeof(req), 0) < 0) { perror("send"); close(s); return -1; }
+        // cn_msg ends with a flexible array, so the request is laid out in a raw buffer
+        constexpr size_t reqLen = NLMSG_LENGTH(sizeof(cn_msg) + sizeof(proc_cn_mcast_op));
+        alignas(nlmsghdr) char req[reqLen] = {};
+        auto nlh = reinterpret_cast<nlmsghdr*>(req);
+        nlh->nlmsg_len = reqLen;
+        nlh->nlmsg_pid = static_cast<uint32_t>(getpid());
+        nlh->nlmsg_type = NLMSG_DONE;
+
+        auto cn = static_cast<cn_msg*>(NLMSG_DATA(nlh));
+        cn->id.idx = CN_IDX_PROC;
+        cn->id.val = CN_VAL_PROC;
+        cn->len = sizeof(proc_cn_mcast_op);
+
+        *reinterpret_cast<proc_cn_mcast_op*>(cn->data) = PROC_CN_MCAST_LISTEN;
+        if (send(s, req, reqLen, 0) < 0) { perror("send"); close(s); return -1; }
         return s;
     }
 
+    void onProcEvent(const ProcEvent& event) {
+        stampKernelEvent(event);
+        if (_procEvents) {
+            queueProcEvent(event);
+            return;
+        }
+        switch (event.type) {
+            case ProcEvent::Fork:
+                recordEvent(event);
+                triggerUpdateTree();
+                break;
+            case ProcEvent::Exec: {
+                // cmdline and the OnStart attributes are re-read by the tree worker if the pid is tracked
+                std::lock_guard<std::mutex> lock(_mtx);
+                recordEvent(event);
+                _execPending.insert(event.pid);
+                break;
+            }
+            case ProcEvent::Exit:
+                recordEvent(event);
+                break;
+        }
+    }
+    // Netlink thread: what a short-lived process leaves behind is read now, before it can be reaped
+    void queueProcEvent(const ProcEvent& event) {
+        bool tracked;
+        {
+            std::lock_guard<std::mutex> lock(_eventsMtx);
+            tracked = _tracked.count(event.type == ProcEvent::Fork ? event.ppid : event.pid) > 0;
+            if (tracked && event.type == ProcEvent::Fork)
+                _tracked.insert(event.pid); // its exec can arrive before the fork is applied
+        }
+        QueuedEvent queued{event, {}, {}};
+        if (tracked) {
+            queued.stat = _source->readFile(event.pid, "stat");
+            if (event.type != ProcEvent::Exit)
+                queued.cmdline = Symbol(_source->readFile(event.pid, "cmdline"));
+        }
+        recordEvent(event); // after the reads it caused, a replay applies them first
+        if (!tracked)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(_eventsMtx);
+            if (_events.size() >= Config::MaxQueuedProcEvents) {
+                ++_eventsDropped;
+                return;
+            }
+            _events.push_back(std::move(queued));
+        }
+        _eventsCv.notify_one();
+    }
+    // Tree worker, under _mtx
+    void applyQueuedEvents() {
+        {
+            std::lock_guard<std::mutex> lock(_eventsMtx);
+            _applying.swap(_events);
+        }
+        for (const auto& queued : _applying)
+            applyProcEvent(queued);
+        _applying.clear();
+    }
+    void applyProcEvent(const QueuedEvent& queued) {
+        ProfileScope profile(ProfilePoint::ProcEvent);
+        const auto& event = queued.event;
+        pid_t rootPid = 0;
+        uint32_t depth = 0;
+        switch (event.type) {
+            case ProcEvent::Fork: {
+                if (_positions.count(event.pid) || wasRemoved(event.pid)) // already found by a tree pass
+                    break;
+                auto parent = findNode(event.ppid, &rootPid, &depth);
+                if (!parent || !parent->active() || !_sessions[rootPid].admit(event.pid)) {
+                    untrack(event.pid, false);
+                    break;
+                }
+                auto& session = _sessions[rootPid];
+                Node node(event.pid, event.ppid, session.resource());
+                if (queued.stat.empty()) {
+                    node.processData.set("pid", std::to_string(event.pid));
+                    node.processData.set("ppid", std::to_string(event.ppid));
+                }
+                setStatProps(node.processData, conditionalSplit(queued.stat, 0), false);
+                if (!queued.cmdline.empty())
+                    node.processData.cmdline = queued.cmdline;
+                processStarted(node, session);
+                session.added(node, depth + 1);
+                ++_forksApplied;
+                indexNode(event.pid, parent->pid());
+                notify(node.processData, ProcStatEvent::Created);
+                parent->subProc.push_back(std::move(node));
+                break;
+            }
+            case ProcEvent::Exec: {
+                auto node = findNode(event.pid, &rootPid);
+                if (!node || !node->active())
+                    break;
+                auto& session = _sessions[rootPid];
+                setStatProps(node->processData, conditionalSplit(queued.stat, 0), false);
+                if (!queued.cmdline.empty())
+                    node->processData.cmdline = queued.cmdline;
+                if (session.pressure() == SessionArena::Pressure::Normal)
+                    _attrs.collect(node->processData, AttrTier::OnStart, *_source);
+                ++_execsApplied;
+                notify(node->processData, ProcStatEvent::Exec);
+                break;
+            }
+            case ProcEvent::Exit: {
+                auto node = findNode(event.pid, &rootPid);
+                if (!node || !node->active())
+                    break;
+                auto& session = _sessions[rootPid];
+                if (!queued.stat.empty()) { // the zombie's final counters
+                    setStatProps(node->processData, conditionalSplit(queued.stat, 0), true);
+                    session.account(*node);
+                }
+                applyExitStatus(node->processData, event.exitCode);
+                markDied(*node, session);
+                node->zombie = true;
+                ++_exitsApplied;
+                notify(node->processData, ProcStatEvent::Died);
+                break;
+            }
+        }
+    }
+    void recordEvent(const ProcEvent& event) {
+        if (!_trace)
+            return;
+        TraceRecord rec;
+        rec.type = TraceRecordType::Event;
+        rec.event = event;
+        _trace->write(rec);
+    }
     void runNetLinkLoop() {
         try {
             int s = nl_open();
@@ -268,7 +1011,7 @@ struct ProcTreeMonitor::Impl {
             while (_running) {
                 ssize_t n = recv(s, buf, sizeof(buf), 0);
                 if (n <= 0) {
-                    if (errno == EINTR)
+                    if (errno == EINTR || errno == EAGAIN)
                         continue;
                     perror("recv");
                     break;
@@ -279,25 +1022,30 @@ struct ProcTreeMonitor::Impl {
                     cn_msg *cn = (struct cn_msg*)NLMSG_DATA(nlh);
                     proc_event *ev = (struct proc_event*)cn->data;
 
+                    ProcEvent event;
+                    event.timestampNs = ev->timestamp_ns;
                     switch (ev->what) {
-                        case proc_event::PROC_EVENT_FORK: {
-                            // pid_t ppid = ev->event_data.fork.parent_pid;
-                            // pid_t cpid = ev->event_data.fork.child_pid;
-                            // std::cout << "Netlink: Fork event detected, parent: " << ppid << ", child: " << cpid << std::endl;
-                        }
-                            triggerUpdateTree();
+                        case proc_event::PROC_EVENT_FORK:
+                            if (ev->event_data.fork.child_pid != ev->event_data.fork.child_tgid)
+                                continue; // a new thread
+                            event.type = ProcEvent::Fork;
+                            event.pid = ev->event_data.fork.child_tgid;
+                            event.ppid = ev->event_data.fork.parent_tgid;
                             break;
-                        case proc_event::PROC_EVENT_EXEC: {
-                            auto cmd = readProcFile(ev->event_data.exec.process_tgid, "cmdline");
-                            // logPrefix(std::cout) << "Netlink: exec event detected, pid: " << ev->event_data.exec.process_tgid << ", cmd: " << cmd << std::endl;
-
+                        case proc_event::PROC_EVENT_EXEC:
+                            event.type = ProcEvent::Exec;
+                            event.pid = ev->event_data.exec.process_tgid;
                             break;
-                        }
                         case proc_event::PROC_EVENT_EXIT:
-                            // logPrefix(std::cout) << "Netlink: exit event detected, pid: " << ev->event_data.exit.process_tgid << std::endl;
+                            if (ev->event_data.exit.process_pid != ev->event_data.exit.process_tgid)
+                                continue; // a thread, the process goes on
+                            event.type = ProcEvent::Exit;
+                            event.pid = ev->event_data.exit.process_tgid;
+                            event.exitCode = ev->event_data.exit.exit_code;
                             break;
-                        default: break;
+                        default: continue;
                     }
+                    onProcEvent(event);
                 }
             }
             close(s);
@@ -305,33 +1053,108 @@ struct ProcTreeMonitor::Impl {
             std::cerr << "Netlink error: " << e.what() << std::endl;
         }
     }
+    void removeRoot(std::map<pid_t, Node>::iterator it) {
+        auto session = _sessions.find(it->first);
+        if (session != _sessions.end())
+            it->second.processData.session = session->second.snapshot(_source->now());
+        if (_onProcStatChange)
+            _onProcStatChange(it->second.processData, ProcStatEvent::Removed);
+        untrack(it->first);
+        _path.clear();
+        collectPids(it->second, _path);
+        for (auto pid : _path) {
+            if (auto pos = _positions.find(pid); pos != _positions.end() && pos->second.root == it->first)
+                _positions.erase(pos);
+        }
+        _processTrees.erase(it);
+        if (session == _sessions.end())
+            return;
+        if (session->second.cgroup && session->second.cgroup->populated())
+            _retiredCgroups.push_back(std::move(session->second.cgroup));
+        _sessions.erase(session); // releases the whole tree storage at once
+    }
     void run() {
         _running = true;
-        _netLinkWorker = std::thread([this] { runNetLinkLoop(); });
+        _netLinkWorker = std::thread([this] {
+            SelfProfiler::nameThread("netlink");
+            runNetLinkLoop();
+        });
+        startTaskstats();
+        if (!_cgroupBase.empty()) {
+            _cgroupWorker = std::thread([this] {
+                SelfProfiler::nameThread("cgroup_events");
+                while (_running) {
+                    auto fired = _cgroupEvents.wait(200); // bounds how long a stopping monitor waits
+                    if (fired.empty())
+                        continue;
+                    {
+                        std::lock_guard<std::mutex> lock(_eventsMtx);
+                        _firedWatches.insert(_firedWatches.end(), fired.begin(), fired.end());
+                        _passRequested = true;
+                    }
+                    _eventsCv.notify_one();
+                }
+            });
+        }
+        // Connector events are applied as they arrive, the tree passes keep their period unless one is requested
         _treeUpdateWorker = std::thread([this]() {
+            SelfProfiler::nameThread("tree_worker");
+            auto nextPass = std::chrono::steady_clock::now();
             while (_running) {
-                std::unique_lock<std::mutex> lock(_mtx);
-                _cv.wait_for(lock, TreeUpdateTimeout, [this] {
-                    return !_running || _eventTriggered;
-                });
-                    for (auto it = _processTrees.begin(); it != _processTrees.end();) {
-                        const auto& [pid, node] = *it;
-                        syncNode(it->second);
-                        if (!node.active() && node.subProc.empty()) {
-                            if (_onProcStatChange)
-                                _onProcStatChange(node.processData, ProcStatEvent::Removed);
-                            it = _processTrees.erase(it);
-                        } else {
-                            ++it;
-                        }
-                    }
+                bool pass;
+                {
+                    std::unique_lock<std::mutex> lock(_eventsMtx);
+                    _eventsCv.wait_until(lock, nextPass, [this] {
+                        return !_running || _passRequested || !_events.empty();
+                    });
+                    pass = _passRequested;
+                    _passRequested = false;
                 }
+                std::lock_guard<std::mutex> lock(_mtx);
+                applyQueuedEvents();
+                auto now = std::chrono::steady_clock::now();
+                if (pass || now >= nextPass) {
+                    syncAll();
+                    nextPass = now + TreeUpdateTimeout;
+                }
+            }
         });
     }
+    // one tree pass, under _mtx
+    void syncAll() {
+        ProfileScope profile(ProfilePoint::TreePass);
+        applyCgroupEvents();
+        collectExitRecords();
+        auto scan = scanProc();
+        for (auto it = _processTrees.begin(); it != _processTrees.end();) {
+            auto& [pid, node] = *it;
+            syncTree(node, _sessions[pid], scan);
+            if (!node.active() && node.subProc.empty()) {
+                removeRoot(it++);
+            } else {
+                ++it;
+            }
+        }
+        _execPending.clear(); // execs of untracked processes
+        for (auto root : _firstSyncPending)
+            _spans.firstSync(root);
+        _firstSyncPending.clear();
+        if (_spans.kernel)
+            pruneKernelStamps();
+        reportShortLived();
+        _bursts.advance(_source->now());
+        if (_source->now() >= _nextInternSweep) {
+            InternPool::instance().sweep();
+            _nextInternSweep = _source->now() + std::chrono::milliseconds(Config::InternSweepMs);
+        }
+        if (_recording)
+            _recording->endPass();
+        record(TraceRecordType::Tick);
+    }
 };
 // Public API Bridge
-ProcTreeMonitor::ProcTreeMonitor(const OnProcStatChange& cb)
-    : pimpl(std::make_unique<Impl>(cb)) {}
+ProcTreeMonitor::ProcTreeMonitor(const OnProcStatChange& cb, const MonitorOptions& options)
+    : pimpl(std::make_unique<Impl>(cb, options)) {}
 
 ProcTreeMonitor::~ProcTreeMonitor() = default;
 
@@ -339,12 +1162,23 @@ void ProcTreeMonitor::addRootProc(pid_t pid) {
     {
         std::lock_guard<std::mutex> lock(pimpl->_mtx);
         if (pimpl->_processTrees.find(pid) == pimpl->_processTrees.end()) {
-            Node root(pid);
+            auto& session = pimpl->_sessions[pid];
+            session.start = pimpl->_source->now();
+            session.arena = std::make_unique<SessionArena>(pimpl->_sessionMemoryCap);
+            Node root(pid, 0, session.resource());
             pimpl->syncProcessData(root);
+            pimpl->processStarted(root, session);
+            session.added(root, 0);
+            pimpl->containSession(pid, session);
             if (pimpl->_onProcStatChange)
                 pimpl->_onProcStatChange(root.processData, Created);
-            pimpl->_processTrees.emplace(pid, root);
-
+            pimpl->_processTrees.emplace(pid, std::move(root));
+            pimpl->track(pid);
+            pimpl->indexNode(pid, 0);
+            if (pimpl->_spans.firstSync)
+                pimpl->_firstSyncPending.push_back(pid);
+            // recorded after the reads it caused, a replay applies them first
+            pimpl->record(TraceRecordType::AddRoot, pid);
         } else {
             //TODO: error handling
             return;
@@ -357,26 +1191,84 @@ void ProcTreeMonitor::rootProcDied(pid_t pid) {
     std::lock_guard<std::mutex> lock(pimpl->_mtx);
     auto it = pimpl->_processTrees.find(pid);
     if (it != pimpl->_processTrees.end()) {
-        it->second.died();
-        if (it->second.subProc.empty()) {
+        if (it->second.active()) {
+            pimpl->markDied(it->second, pimpl->_sessions[pid]);
             if (pimpl->_onProcStatChange)
-                pimpl->_onProcStatChange(it->second.processData, Removed);
-            pimpl->_processTrees.erase(it);
+                pimpl->_onProcStatChange(it->second.processData, ProcStatEvent::Died);
         }
+        if (it->second.subProc.empty())
+            pimpl->removeRoot(it);
     }
+    pimpl->record(TraceRecordType::RootDied, pid);
 }
 
 void ProcTreeMonitor::run() {
     pimpl->run();
 }
+
+void ProcTreeMonitor::syncOnce() {
+    std::lock_guard<std::mutex> lock(pimpl->_mtx);
+    pimpl->syncAll();
 }
 
-std::ostream& operator<<(std::ostream& os, const SudoMonitor::ProcessData& pd) {
-    for (auto it = pd.props.begin(); it != pd.props.end(); ++it) {
-        os << it->first << ": " << it->second.c_str() << "; ";
+void ProcTreeMonitor::injectProcEvent(const ProcEvent& event) {
+    pimpl->onProcEvent(event);
+    std::lock_guard<std::mutex> lock(pimpl->_mtx);
+    pimpl->applyQueuedEvents();
+}
+
+bool ProcTreeMonitor::queryProcess(pid_t pid, ProcessData& out) {
+    std::lock_guard<std::mutex> lock(pimpl->_mtx);
+    auto node = pimpl->findNode(pid);
+    if (!node)
+        return false;
+    if (node->active())
+        pimpl->_attrs.collect(node->processData, AttrTier::OnDemand, *pimpl->_source);
+    out = node->processData;
+    return true;
+}
+
+bool ProcTreeMonitor::sessionTotals(pid_t rootPid, SessionTotals& out) {
+    std::lock_guard<std::mutex> lock(pimpl->_mtx);
+    auto it = pimpl->_sessions.find(rootPid);
+    if (it == pimpl->_sessions.end())
+        return false;
+    out = it->second.snapshot(pimpl->_source->now());
+    return true;
+}
+
+AttrMetrics ProcTreeMonitor::attrMetrics() const {
+    return pimpl->_attrs.metrics();
+}
+
+BurstMetrics ProcTreeMonitor::burstMetrics() const {
+    return pimpl->_bursts.metrics();
+}
+
+ProcEventMetrics ProcTreeMonitor::procEventMetrics() const {
+    return {pimpl->_forksApplied, pimpl->_execsApplied, pimpl->_exitsApplied, pimpl->_eventsDropped};
+}
+
+ExitMetrics ProcTreeMonitor::exitMetrics() const {
+    ExitMetrics metrics;
+    if (pimpl->_taskstats) {
+        auto listener = pimpl->_taskstats->metrics();
+        metrics.enabled = true;
+        metrics.records = listener.records;
+        metrics.overruns = listener.overruns;
     }
+    metrics.attached = pimpl->_exitsAttached;
+    metrics.shortLived = pimpl->_exitsShortLived;
+    return metrics;
+}
+}
+
+std::ostream& operator<<(std::ostream& os, const SudoMonitor::ProcessData& pd) {
+    pd.forEachProp([&os](std::string_view name, std::string_view value) {
+        os << name << ": " << value.substr(0, value.find('\0')) << "; ";
+    });
     return os;
 }
 std::ostream& operator<<(std::ostream& os, const SudoMonitor::ProcStatEvent& event) {
-    return os << SudoMonitor::ProcStatEventToString(event);
+    return os << SudoMonitor::procStatEventName(event);
 }
\ No newline at end of file
@@ -1,26 +1,138 @@
 #pragma once
 
+#include "burst_aggregator.h"
+#include "common.h"
+#include "intern_pool.h"
+#include "proc_attributes.h"
+
+#include <cstdint>
 #include <functional>
+#include <iterator>
 #include <map>
 #include <memory>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
 
 namespace SudoMonitor {
-enum ProcStatEvent {Created, Died, Removed}; //TODO: add "Changed" event
+class ProcSource;
+struct ProcEvent;
+
+// Summary: children of a high-churn parent folded into one event per comm, see BurstAggregator
+// Exec: a tracked process called exec, comm/cmdline are the ones read when the connector reported it
+enum ProcStatEvent {Created, Died, Removed, Summary, Exec, Queried, NUM_OF_EVENTS}; //TODO: add "Changed" event
+// Queried: the answer to a process query (queryProcess), not a lifecycle change
+const char* procStatEventName(ProcStatEvent event);
+
+// Resource usage of a whole sudo session (root and all descendants), maintained incrementally
+struct SessionTotals {
+    uint64_t utime = 0;        // clock ticks, summed over every process seen in the session
+    uint64_t stime = 0;        // (cutime/cstime are left out: they repeat the time of waited-for children seen here)
+    uint64_t peakRss = 0;      // pages, peak of the summed rss of the live processes
+    uint32_t processCount = 0; // processes seen, including the root
+    uint32_t liveCount = 0;
+    uint32_t maxDepth = 0;     // the root is depth 0
+    uint64_t wallTimeMs = 0;   // since addRootProc, up to Removed
+    uint64_t arenaPeakBytes = 0; // peak tree storage, see MonitorOptions::sessionMemoryCap
+    uint32_t untracked = 0;    // processes not tracked because the session reached its memory cap
+    uint32_t degraded = 0;     // highest SessionArena::Pressure reached: 1 attributes dropped, 2 processes dropped
+};
 
+// Tracked processes live in the session arena; copies (events snapshots, queryProcess) use the default resource.
+// comm and cmdline, the same few strings across sessions, are interned symbols kept out of props; the serializers
+// list them among props, in name order.
 struct ProcessData {
-    using PropsMap = std::map<std::string, std::string>;
+    using PropsMap = std::pmr::map<std::pmr::string, std::pmr::string, std::less<>>;
     pid_t pid = 0;
     pid_t ppid = 0;
     bool active = false;
     PropsMap props;
+    Symbol comm;
+    Symbol cmdline;
+    std::optional<SessionTotals> session; // set on the root's Removed event only
     ProcessData() = default;
-    ProcessData(pid_t p, pid_t ppid) : pid(p), ppid(ppid), active(true) {}
+    ProcessData(pid_t p, pid_t ppid, std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+        : pid(p), ppid(ppid), active(true), props(mr) {}
+    void set(std::string_view name, std::string_view value) {
+        if (auto symbol = interned(name)) {
+            if (symbol->view() != value)
+                *symbol = Symbol(value);
+            return;
+        }
+        auto it = props.find(name);
+        if (it == props.end())
+            props.emplace(name, value);
+        else
+            it->second = value;
+    }
+    // Every property in name order, the interned ones included: f(std::string_view name, std::string_view value)
+    template <typename F>
+    void forEachProp(F&& f) const {
+        const std::pair<std::string_view, const Symbol*> symbols[] = {{"cmdline", &cmdline}, {"comm", &comm}};
+        size_t next = 0;
+        auto symbolsBefore = [&](std::string_view name) {
+            for (; next < std::size(symbols) && (name.empty() || symbols[next].first < name); ++next) {
+                if (!symbols[next].second->empty())
+                    f(symbols[next].first, symbols[next].second->view());
+            }
+        };
+        for (const auto& [name, value] : props) {
+            symbolsBefore(name);
+            f(std::string_view(name), std::string_view(value));
+        }
+        symbolsBefore({});
+    }
+
+private:
+    Symbol* interned(std::string_view name) {
+        return name == "comm" ? &comm : name == "cmdline" ? &cmdline : nullptr;
+    }
+};
+
+// Latency marks for the daemon's tracer, called from the tree worker under the monitor lock
+struct MonitorSpans {
+    std::function<void(pid_t root)> firstSync; // first tree pass over a root added by addRootProc
+    // Created/Exec/Died of a process whose fork/exec/exit the proc connector reported, with its CLOCK_MONOTONIC timestamp
+    std::function<void(pid_t pid, ProcStatEvent event, uint64_t kernelNs)> kernel;
+};
+
+struct MonitorOptions {
+    AttrPolicy attrs;
+    bool taskstats = false; // exit accounting through TASKSTATS genetlink (needs CAP_NET_ADMIN)
+    bool cgroups = false;   // contain each session in a cgroup v2 leaf under cgroupBase, falls back to /proc scans
+    std::string cgroupBase = Config::CgroupBase;
+    std::shared_ptr<ProcSource> source; // null: the live /proc
+    std::string recordPath;             // non empty: record the monitor input into this trace file
+    // Tree storage per session, 0: unlimited. Past SessionReducedPercent of it the attribute tiers are no longer
+    // collected for the session; at the cap its new processes are not tracked, only counted in SessionTotals::untracked.
+    size_t sessionMemoryCap = Config::SessionMemoryCapBytes;
+    BurstPolicy bursts;
+    MonitorSpans spans;
+    // Connector fork/exec/exit under a tracked root become events as they arrive, with comm/cmdline read at exec
+    // and the exit code of the exit event. false: processes are only found by the tree passes.
+    bool procEvents = true;
+};
+
+struct ExitMetrics {
+    bool enabled = false;    // taskstats listener is running
+    uint64_t records = 0;    // exit records received
+    uint64_t overruns = 0;   // kernel buffer overflows
+    uint64_t attached = 0;   // records attached to a Died event of a tracked process
+    uint64_t shortLived = 0; // tracked-parent children that exited before the tree saw them
+};
+
+struct ProcEventMetrics {
+    uint64_t forks = 0;   // connector events applied to the tracked trees
+    uint64_t execs = 0;
+    uint64_t exits = 0;
+    uint64_t dropped = 0; // queue overflows, left to the tree passes
 };
 
 class ProcTreeMonitor {
 public:
     using OnProcStatChange = std::function<void(const ProcessData&, ProcStatEvent)>;
-    explicit ProcTreeMonitor(const OnProcStatChange& cb = nullptr);
+    explicit ProcTreeMonitor(const OnProcStatChange& cb = nullptr, const MonitorOptions& options = {});
     ~ProcTreeMonitor();
     ProcTreeMonitor(const ProcTreeMonitor&) = delete;
     ProcTreeMonitor& operator=(const ProcTreeMonitor&) = delete;
@@ -28,6 +140,19 @@ public:
     void addRootProc(pid_t pid);
     void rootProcDied(pid_t pid);
     void run();
+    // Driven mode (trace replay): one synchronous tree pass and a connector event, without run()
+    void syncOnce();
+    void injectProcEvent(const ProcEvent& event);
+
+    // Copies the tracked process data of pid, refreshed with the OnDemand attribute tier.
+    // Returns false if pid is not tracked.
+    bool queryProcess(pid_t pid, ProcessData& out);
+    // Current totals of the live session rooted at rootPid. Returns false if it is not tracked.
+    bool sessionTotals(pid_t rootPid, SessionTotals& out);
+    [[nodiscard]] AttrMetrics attrMetrics() const;
+    [[nodiscard]] ExitMetrics exitMetrics() const;
+    [[nodiscard]] BurstMetrics burstMetrics() const;
+    [[nodiscard]] ProcEventMetrics procEventMetrics() const;
 
 private:
     struct Impl;           // Forward declaration of the implementation
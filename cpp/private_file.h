@@ -0,0 +1,15 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+namespace SudoMonitor {
+// Files the daemon keeps in directories no other user can write to (or read: spooled records, profiles).
+
+// Creates dir (0700) if needed. false (EPERM): it is a link, or not a directory of the effective user closed to
+// group and others.
+bool privateDir(const std::string& dir);
+// Writes data under tmp and renames it to path, so path only ever holds a whole content. tmp is created afresh
+// (O_EXCL, O_NOFOLLOW): a leftover or a planted link in its place is removed first, never written through.
+bool replaceFile(const std::string& tmp, const std::string& path, std::string_view data);
+}
@@ -0,0 +1,166 @@
+#include "proc_attributes.h"
+#include "common.h"
+#include "monitor_subprocesses.h"
+#include "proc_source.h"
+
+#include <algorithm>
+#include <iterator>
+#include <sstream>
+
+namespace SudoMonitor {
+namespace {
+constexpr const char* AttrNames[] = {"status", "io", "fd", "cwd", "exe", "cgroup"};
+constexpr const char* TierNames[] = {"off", "start", "demand", "periodic"};
+static_assert(std::size(AttrNames) == AttrPolicy::NumOfAttrs);
+static_assert(std::size(TierNames) == static_cast<size_t>(AttrTier::NUM_OF_TIERS));
+
+template <size_t N>
+int indexOf(const char* const (&names)[N], const std::string& name) {
+    for (size_t i = 0; i < N; ++i) {
+        if (name == names[i])
+            return static_cast<int>(i);
+    }
+    return -1;
+}
+
+std::string trim(const std::string& s) {
+    auto begin = s.find_first_not_of(" \t\n");
+    if (begin == std::string::npos)
+        return "";
+    auto end = s.find_last_not_of(" \t\n");
+    return s.substr(begin, end - begin + 1);
+}
+
+// "Key:\tv1\tv2\n" lines; maps selected keys to prop names, tabs become spaces
+void copyKeyValueLines(const std::string& content, ProcessData& pd,
+                       const std::initializer_list<std::pair<const char*, const char*>>& keys,
+                       const char* prefix = nullptr) {
+    std::istringstream lines(content);
+    std::string line;
+    while (std::getline(lines, line)) {
+        auto colon = line.find(':');
+        if (colon == std::string::npos)
+            continue;
+        auto key = line.substr(0, colon);
+        auto value = trim(line.substr(colon + 1));
+        std::replace(value.begin(), value.end(), '\t', ' ');
+        if (prefix) {
+            pd.set(prefix + key, value);
+            continue;
+        }
+        for (const auto& [from, to] : keys) {
+            if (key == from) {
+                pd.set(to, value);
+                break;
+            }
+        }
+    }
+}
+}
+
+const char* attrTierName(AttrTier tier) {
+    auto index = static_cast<size_t>(tier);
+    return index < std::size(TierNames) ? TierNames[index] : "unknown";
+}
+
+AttrPolicy::AttrPolicy() : periodicInterval(Config::AttrPeriodicIntervalMs) {
+    parse(Config::DefaultAttrTiers);
+}
+
+bool AttrPolicy::uses(AttrTier tier) const {
+    for (auto t : tiers) {
+        if (t == tier)
+            return true;
+    }
+    return false;
+}
+
+bool AttrPolicy::parse(const std::string& spec) {
+    auto parsed = tiers;
+    std::istringstream items(spec);
+    std::string item;
+    while (std::getline(items, item, ',')) {
+        item = trim(item);
+        if (item.empty())
+            continue;
+        auto eq = item.find('=');
+        if (eq == std::string::npos)
+            return false;
+        int attr = indexOf(AttrNames, item.substr(0, eq));
+        int tier = indexOf(TierNames, item.substr(eq + 1));
+        if (attr < 0 || tier < 0)
+            return false;
+        parsed[attr] = static_cast<AttrTier>(tier);
+    }
+    tiers = parsed;
+    return true;
+}
+
+size_t ProcAttrCollector::readAttr(ProcessData& pd, ProcAttr attr, ProcSource& source) {
+    auto& props = pd.props;
+    switch (attr) {
+        case ProcAttr::Status: {
+            auto content = source.readFile(pd.pid, "status");
+            copyKeyValueLines(content, pd, {{"Uid", "uid"}, {"Gid", "gid"}, {"CapPrm", "cap_prm"}, {"CapEff", "cap_eff"}});
+            return content.size();
+        }
+        case ProcAttr::Io: {
+            auto content = source.readFile(pd.pid, "io");
+            copyKeyValueLines(content, pd, {}, "io_");
+            return content.size();
+        }
+        case ProcAttr::FdCount: {
+            int count = source.countDirEntries(pd.pid, "fd");
+            if (count < 0)
+                return 0;
+            props["fd_count"] = std::to_string(count);
+            return 1;
+        }
+        case ProcAttr::Cwd:
+        case ProcAttr::Exe: {
+            const char* name = attr == ProcAttr::Cwd ? "cwd" : "exe";
+            auto target = source.readLink(pd.pid, name);
+            if (!target.empty())
+                props[name] = target;
+            return target.size();
+        }
+        case ProcAttr::Cgroup: {
+            auto content = trim(source.readFile(pd.pid, "cgroup"));
+            if (!content.empty())
+                props["cgroup"] = content;
+            return content.size();
+        }
+        default:
+            return 0;
+    }
+}
+
+void ProcAttrCollector::collect(ProcessData& pd, AttrTier tier, ProcSource& source) {
+    if (tier == AttrTier::Disabled)
+        return;
+    auto& counters = _counters[static_cast<size_t>(tier)];
+    for (size_t i = 0; i < AttrPolicy::NumOfAttrs; ++i) {
+        if (_policy.tiers[i] != tier)
+            continue;
+        auto start = std::chrono::steady_clock::now();
+        auto bytes = readAttr(pd, static_cast<ProcAttr>(i), source);
+        auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        counters.reads.fetch_add(1, std::memory_order_relaxed);
+        counters.bytes.fetch_add(bytes, std::memory_order_relaxed);
+        counters.nanos.fetch_add(static_cast<uint64_t>(nanos), std::memory_order_relaxed);
+        if (bytes == 0)
+            counters.failures.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+AttrMetrics ProcAttrCollector::metrics() const {
+    AttrMetrics result;
+    for (size_t i = 0; i < result.size(); ++i) {
+        result[i].reads = _counters[i].reads.load(std::memory_order_relaxed);
+        result[i].failures = _counters[i].failures.load(std::memory_order_relaxed);
+        result[i].bytes = _counters[i].bytes.load(std::memory_order_relaxed);
+        result[i].nanos = _counters[i].nanos.load(std::memory_order_relaxed);
+    }
+    return result;
+}
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace SudoMonitor {
+struct ProcessData;
+class ProcSource;
+
+// When an attribute beyond /proc/<pid>/stat is read
+enum class AttrTier {
+    Disabled = 0,
+    OnStart,   // once when the process is Created and again on every exec
+    OnDemand,  // only through ProcTreeMonitor::queryProcess
+    Periodic,  // every AttrPolicy::periodicInterval
+    NUM_OF_TIERS
+};
+
+enum class ProcAttr {
+    Status = 0, // uid/gid and capabilities from /proc/<pid>/status
+    Io,         // /proc/<pid>/io counters
+    FdCount,    // number of entries in /proc/<pid>/fd
+    Cwd,        // /proc/<pid>/cwd link
+    Exe,        // /proc/<pid>/exe link
+    Cgroup,     // /proc/<pid>/cgroup
+    NUM_OF_ATTRS
+};
+
+const char* attrTierName(AttrTier tier);
+
+struct AttrPolicy {
+    static constexpr size_t NumOfAttrs = static_cast<size_t>(ProcAttr::NUM_OF_ATTRS);
+    std::array<AttrTier, NumOfAttrs> tiers{};
+    std::chrono::milliseconds periodicInterval;
+
+    AttrPolicy(); // Config::DefaultAttrTiers / Config::AttrPeriodicIntervalMs
+    [[nodiscard]] AttrTier tier(ProcAttr attr) const { return tiers[static_cast<size_t>(attr)]; }
+    [[nodiscard]] bool uses(AttrTier tier) const;
+
+    // Spec format: "status=start,io=periodic,fd=demand,cwd=off" (unlisted attributes keep their tier).
+    // Returns false and leaves the policy untouched on a malformed spec.
+    bool parse(const std::string& spec);
+};
+
+struct AttrTierMetrics {
+    uint64_t reads = 0;    // attribute reads issued
+    uint64_t failures = 0; // reads that returned nothing (process gone, no permission)
+    uint64_t bytes = 0;    // bytes read from /proc
+    uint64_t nanos = 0;    // wall time spent reading
+};
+using AttrMetrics = std::array<AttrTierMetrics, static_cast<size_t>(AttrTier::NUM_OF_TIERS)>;
+
+// Reads the attributes assigned to a tier into ProcessData::props and accounts the cost per tier
+class ProcAttrCollector {
+public:
+    explicit ProcAttrCollector(const AttrPolicy& policy) : _policy(policy) {}
+
+    void collect(ProcessData& pd, AttrTier tier, ProcSource& source);
+    [[nodiscard]] const AttrPolicy& policy() const { return _policy; }
+    [[nodiscard]] AttrMetrics metrics() const; // safe to call from any thread
+
+private:
+    struct Counters {
+        std::atomic<uint64_t> reads{0}, failures{0}, bytes{0}, nanos{0};
+    };
+    size_t readAttr(ProcessData& pd, ProcAttr attr, ProcSource& source);
+
+    AttrPolicy _policy;
+    std::array<Counters, static_cast<size_t>(AttrTier::NUM_OF_TIERS)> _counters;
+};
+}
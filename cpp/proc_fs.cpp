@@ -0,0 +1,290 @@
+#include "proc_fs.h"
+#include "proc_source.h"
+#include "common.h"
+#include "self_profiler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <csignal>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+namespace SudoMonitor {
+namespace {
+void procPath(char (&path)[PATH_MAX], pid_t pid, const char* name, const char* root) {
+    snprintf(path, sizeof(path), "%s/%d/%s", root, static_cast<int>(pid), name);
+}
+}
+
+std::string readProcFile(pid_t pid, const char* fileName, const char* root) {
+    ProfileScope profile(ProfilePoint::ReadProcFile);
+    char path[PATH_MAX];
+    procPath(path, pid, fileName, root);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return "";
+    std::string content;
+    char buf[4096];
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        content.append(buf, static_cast<size_t>(n));
+    }
+    close(fd);
+    return content;
+}
+
+std::string readProcLink(pid_t pid, const char* linkName, const char* root) {
+    char path[PATH_MAX];
+    procPath(path, pid, linkName, root);
+    char target[PATH_MAX];
+    ssize_t n = readlink(path, target, sizeof(target));
+    if (n <= 0)
+        return "";
+    return {target, static_cast<size_t>(n)};
+}
+
+int countProcDirEntries(pid_t pid, const char* dirName, const char* root) {
+    char path[PATH_MAX];
+    procPath(path, pid, dirName, root);
+    DIR* dir = opendir(path);
+    if (!dir)
+        return -1;
+    int count = 0;
+    while (auto entry = readdir(dir)) {
+        if (entry->d_name[0] != '.')
+            ++count;
+    }
+    closedir(dir);
+    return count;
+}
+}
+
+namespace SudoMonitor {
+std::vector<pid_t> listProcPids(const char* root) {
+    struct Dirent64 {
+        ino64_t d_ino;
+        off64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+    std::vector<pid_t> pids;
+    int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return pids;
+    alignas(Dirent64) char buf[64 * 1024]; // ~2700 entries per syscall
+    for (;;) {
+        long n = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        for (long off = 0; off < n;) {
+            auto entry = reinterpret_cast<const Dirent64*>(buf + off);
+            off += entry->d_reclen;
+            pid_t pid = 0;
+            const char* c = entry->d_name;
+            for (; *c >= '0' && *c <= '9'; ++c)
+                pid = pid * 10 + (*c - '0');
+            if (!*c && c != entry->d_name)
+                pids.push_back(pid);
+        }
+    }
+    close(fd);
+    return pids;
+}
+
+pid_t statPpid(std::string_view line) {
+    // "pid (comm) state ppid ...", comm may contain spaces and parentheses
+    auto close = line.rfind(')');
+    if (close == std::string_view::npos || close + 4 >= line.size())
+        return 0;
+    auto field = line.substr(close + 4);
+    pid_t ppid = 0;
+    auto [end, ec] = std::from_chars(field.data(), field.data() + field.size(), ppid);
+    return ec == std::errc() ? ppid : 0;
+}
+
+void ProcSource::readStats(const std::vector<pid_t>& pids, const std::vector<pid_t>& parents,
+                           std::vector<pid_t>& ppids, std::vector<std::string>& lines) {
+    ppids.assign(pids.size(), 0);
+    lines.resize(pids.size());
+    for (size_t i = 0; i < pids.size(); ++i) {
+        auto line = readFile(pids[i], "stat");
+        ppids[i] = statPpid(line);
+        if (ppids[i] && std::binary_search(parents.begin(), parents.end(), ppids[i]))
+            lines[i] = std::move(line);
+        else
+            lines[i].clear();
+    }
+}
+
+namespace {
+// Helper threads for the full scans, the calling thread takes a share of each batch too
+class ScanPool {
+public:
+    using Work = std::function<void(size_t begin, size_t end)>;
+    static constexpr size_t Chunk = 256;
+
+    explicit ScanPool(size_t helpers) {
+        for (size_t i = 0; i < helpers; ++i)
+            _threads.emplace_back([this] {
+                SelfProfiler::nameThread("proc_scan");
+                helperLoop();
+            });
+    }
+    ~ScanPool() {
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            _stop = true;
+        }
+        _cv.notify_all();
+        for (auto& t : _threads)
+            t.join();
+    }
+    // Returns once every helper is done with this batch, so none can still see it when the next one starts
+    void run(size_t n, const Work& work) {
+        std::lock_guard<std::mutex> batch(_runMtx);
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            _work = &work;
+            _n = n;
+            _next = 0;
+            _finished = 0;
+            ++_generation;
+        }
+        _cv.notify_all();
+        drain(work, n);
+        std::unique_lock<std::mutex> lock(_mtx);
+        _doneCv.wait(lock, [this] { return _finished == _threads.size(); });
+    }
+
+private:
+    void drain(const Work& work, size_t n) {
+        for (size_t begin; (begin = _next.fetch_add(Chunk)) < n;)
+            work(begin, std::min(begin + Chunk, n));
+    }
+    void helperLoop() {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(_mtx);
+        for (;;) {
+            _cv.wait(lock, [&] { return _stop || _generation != seen; });
+            if (_stop)
+                return;
+            seen = _generation;
+            auto work = _work;
+            auto n = _n;
+            lock.unlock();
+            drain(*work, n);
+            lock.lock();
+            if (++_finished == _threads.size())
+                _doneCv.notify_one();
+        }
+    }
+
+    std::vector<std::thread> _threads;
+    std::mutex _runMtx; // one batch at a time
+    std::mutex _mtx;
+    std::condition_variable _cv;
+    std::condition_variable _doneCv;
+    const Work* _work = nullptr;
+    size_t _n = 0;
+    std::atomic<size_t> _next{0};
+    size_t _finished = 0;
+    uint64_t _generation = 0;
+    bool _stop = false;
+};
+
+class LiveProcSource : public ProcSource {
+public:
+    explicit LiveProcSource(std::string root = "/proc") : _root(std::move(root)) {}
+
+    std::string readFile(pid_t pid, const char* name) override { return readProcFile(pid, name, _root.c_str()); }
+    std::string readLink(pid_t pid, const char* name) override { return readProcLink(pid, name, _root.c_str()); }
+    int countDirEntries(pid_t pid, const char* name) override {
+        return countProcDirEntries(pid, name, _root.c_str());
+    }
+    std::vector<pid_t> listPids() override { return listProcPids(_root.c_str()); }
+    bool isAlive(pid_t pid) override {
+        if (pid <= 0)
+            return false;
+        if (_root != "/proc")
+            return countDirEntries(pid, ".") >= 0;
+        return ::kill(pid, 0) == 0 || errno == EPERM;
+    }
+    // Only the matching lines are copied out of the read buffer
+    void readStats(const std::vector<pid_t>& pids, const std::vector<pid_t>& parents,
+                   std::vector<pid_t>& ppids, std::vector<std::string>& lines) override {
+        ppids.assign(pids.size(), 0);
+        lines.resize(pids.size());
+        int rootFd = open(_root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC); // relative opens skip the root lookup
+        if (rootFd < 0)
+            return;
+        ScanPool::Work work = [&](size_t begin, size_t end) {
+            char path[32];
+            char buf[4096];
+            for (auto i = begin; i < end; ++i) {
+                lines[i].clear();
+                snprintf(path, sizeof(path), "%d/stat", static_cast<int>(pids[i]));
+                int fd = openat(rootFd, path, O_RDONLY | O_CLOEXEC);
+                if (fd < 0)
+                    continue;
+                ssize_t n = read(fd, buf, sizeof(buf));
+                close(fd);
+                if (n <= 0)
+                    continue;
+                std::string_view line(buf, static_cast<size_t>(n));
+                ppids[i] = statPpid(line);
+                if (ppids[i] && std::binary_search(parents.begin(), parents.end(), ppids[i]))
+                    lines[i].assign(line);
+            }
+        };
+        if (auto pool = pids.size() >= Config::ProcScanParallelMin ? scanPool() : nullptr)
+            pool->run(pids.size(), work);
+        else
+            work(0, pids.size());
+        close(rootFd);
+    }
+
+private:
+    ScanPool* scanPool() {
+        std::call_once(_poolOnce, [this] {
+            auto cpus = std::thread::hardware_concurrency();
+            size_t helpers = std::min<size_t>(Config::ProcScanThreads, cpus > 1 ? cpus - 1 : 0);
+            if (helpers)
+                _pool = std::make_unique<ScanPool>(helpers);
+        });
+        return _pool.get();
+    }
+
+    std::string _root;
+    std::once_flag _poolOnce;
+    std::unique_ptr<ScanPool> _pool;
+};
+}
+
+std::shared_ptr<ProcSource> liveProcSource() {
+    static auto source = std::make_shared<LiveProcSource>();
+    return source;
+}
+
+std::shared_ptr<ProcSource> procFsSource(const std::string& root) {
+    return std::make_shared<LiveProcSource>(root);
+}
+}
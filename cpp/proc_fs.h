@@ -0,0 +1,14 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+namespace SudoMonitor {
+// Thin /proc/<pid>/... readers. All of them return empty/-1 when the process is gone.
+std::string readProcFile(pid_t pid, const char* fileName, const char* root = "/proc");
+std::string readProcLink(pid_t pid, const char* linkName, const char* root = "/proc");
+int countProcDirEntries(pid_t pid, const char* dirName, const char* root = "/proc");
+// Pids of the numeric entries of root, read in getdents64 batches
+std::vector<pid_t> listProcPids(const char* root = "/proc");
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sys/types.h>
+
+namespace SudoMonitor {
+// Process lifecycle notification from the kernel proc connector
+struct ProcEvent {
+    enum Type : uint8_t { Fork = 1, Exec, Exit };
+    Type type = Fork;
+    pid_t pid = 0;          // child on Fork
+    pid_t ppid = 0;         // parent on Fork
+    uint32_t exitCode = 0;  // wait(2) status on Exit
+    uint64_t timestampNs = 0;
+};
+
+// Everything ProcTreeMonitor learns about processes goes through this interface,
+// so a recorded trace can stand in for the live /proc
+class ProcSource {
+public:
+    using Clock = std::chrono::steady_clock;
+    virtual ~ProcSource() = default;
+
+    virtual std::string readFile(pid_t pid, const char* name) = 0;
+    virtual std::string readLink(pid_t pid, const char* name) = 0;
+    virtual int countDirEntries(pid_t pid, const char* name) = 0; // -1 if the process is gone
+    virtual std::vector<pid_t> listPids() = 0;
+    virtual bool isAlive(pid_t pid) = 0;
+    virtual Clock::time_point now() { return Clock::now(); }
+    // Full scan: ppids[i] is the parent of pids[i] (0 when the process is gone), and lines[i] its stat line
+    // when that parent is in `parents` (sorted); the other processes are rejected as soon as their ppid is parsed.
+    // The default reads through readFile one pid after another.
+    virtual void readStats(const std::vector<pid_t>& pids, const std::vector<pid_t>& parents,
+                           std::vector<pid_t>& ppids, std::vector<std::string>& lines);
+};
+
+// ppid field of a /proc/<pid>/stat line, 0 if malformed
+pid_t statPpid(std::string_view line);
+
+std::shared_ptr<ProcSource> liveProcSource();
+// A /proc layout under another root, for benchmarks on a synthetic tree
+std::shared_ptr<ProcSource> procFsSource(const std::string& root);
+}
@@ -0,0 +1,355 @@
+#include "proc_trace.h"
+#include "monitor_subprocesses.h"
+
+#include <cstring>
+#include <ctime>
+#include <thread>
+
+namespace SudoMonitor {
+namespace {
+constexpr char TraceMagic[8] = {'S', 'M', 'T', 'R', 'A', 'C', 'E', '1'};
+
+// Record layout: u8 type | varint time delta ns | payload (see TraceWriter::write)
+void putVarint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back(static_cast<char>(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<char>(v));
+}
+void putBytes(std::string& out, const std::string& s) {
+    putVarint(out, s.size());
+    out.append(s);
+}
+bool getVarint(FILE* f, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = fgetc(f);
+        if (c == EOF)
+            return false;
+        v |= static_cast<uint64_t>(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return true;
+    }
+    return false;
+}
+bool getPid(FILE* f, pid_t& pid) {
+    uint64_t v;
+    if (!getVarint(f, v))
+        return false;
+    pid = static_cast<pid_t>(v);
+    return true;
+}
+bool getBytes(FILE* f, std::string& s) {
+    uint64_t len;
+    if (!getVarint(f, len) || len > (1u << 26))
+        return false;
+    s.resize(len);
+    return len == 0 || fread(s.data(), 1, len, f) == len;
+}
+std::pair<pid_t, std::string> textKey(TraceRecordType type, pid_t pid, const char* name) {
+    return {pid, static_cast<char>(type) + std::string(name)};
+}
+}
+
+TraceWriter::TraceWriter(const std::string& path) : _path(path) {}
+
+TraceWriter::~TraceWriter() {
+    if (_file)
+        fclose(_file);
+}
+
+bool TraceWriter::init() {
+    _file = fopen(_path.c_str(), "wb");
+    if (!_file)
+        return false;
+    timespec ts{};
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int64_t realtimeNs = static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    _start = std::chrono::steady_clock::now();
+    fwrite(TraceMagic, 1, sizeof(TraceMagic), _file);
+    fwrite(&realtimeNs, sizeof(realtimeNs), 1, _file);
+    _bytes = sizeof(TraceMagic) + sizeof(realtimeNs);
+    return true;
+}
+
+void TraceWriter::write(TraceRecord& rec) {
+    std::lock_guard<std::mutex> lock(_mtx);
+    if (!_file)
+        return;
+    auto now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - _start).count());
+    rec.timeNs = std::max(now, _lastNs);
+    _scratch.clear();
+    _scratch.push_back(static_cast<char>(rec.type));
+    putVarint(_scratch, rec.timeNs - _lastNs);
+    _lastNs = rec.timeNs;
+    switch (rec.type) {
+        case TraceRecordType::FileRead:
+        case TraceRecordType::LinkRead:
+            putVarint(_scratch, static_cast<uint64_t>(rec.pid));
+            putBytes(_scratch, rec.name);
+            putBytes(_scratch, rec.data);
+            break;
+        case TraceRecordType::DirCount:
+            putVarint(_scratch, static_cast<uint64_t>(rec.pid));
+            putBytes(_scratch, rec.name);
+            putVarint(_scratch, static_cast<uint64_t>(rec.value + 1)); // -1: gone
+            break;
+        case TraceRecordType::PidList:
+            putVarint(_scratch, rec.pids.size());
+            for (auto pid : rec.pids)
+                putVarint(_scratch, static_cast<uint64_t>(pid));
+            break;
+        case TraceRecordType::Alive:
+            putVarint(_scratch, static_cast<uint64_t>(rec.pid));
+            putVarint(_scratch, static_cast<uint64_t>(rec.value));
+            break;
+        case TraceRecordType::Event:
+            _scratch.push_back(static_cast<char>(rec.event.type));
+            putVarint(_scratch, static_cast<uint64_t>(rec.event.pid));
+            putVarint(_scratch, static_cast<uint64_t>(rec.event.ppid));
+            putVarint(_scratch, rec.event.exitCode);
+            putVarint(_scratch, rec.event.timestampNs);
+            break;
+        case TraceRecordType::AddRoot:
+        case TraceRecordType::RootDied:
+            putVarint(_scratch, static_cast<uint64_t>(rec.pid));
+            break;
+        case TraceRecordType::Tick:
+            break;
+    }
+    fwrite(_scratch.data(), 1, _scratch.size(), _file);
+    _bytes += _scratch.size();
+}
+
+TraceReader::TraceReader(const std::string& path) : _path(path) {}
+
+TraceReader::~TraceReader() {
+    if (_file)
+        fclose(_file);
+}
+
+bool TraceReader::init() {
+    _file = fopen(_path.c_str(), "rb");
+    if (!_file)
+        return false;
+    char magic[sizeof(TraceMagic)];
+    return fread(magic, 1, sizeof(magic), _file) == sizeof(magic) &&
+           memcmp(magic, TraceMagic, sizeof(magic)) == 0 &&
+           fread(&_startRealtimeNs, sizeof(_startRealtimeNs), 1, _file) == 1;
+}
+
+bool TraceReader::next(TraceRecord& rec) {
+    if (!_file)
+        return false;
+    int type = fgetc(_file);
+    uint64_t delta, v;
+    if (type == EOF || !getVarint(_file, delta))
+        return false;
+    rec.type = static_cast<TraceRecordType>(type);
+    _lastNs += delta;
+    rec.timeNs = _lastNs;
+    switch (rec.type) {
+        case TraceRecordType::FileRead:
+        case TraceRecordType::LinkRead:
+            return getPid(_file, rec.pid) && getBytes(_file, rec.name) && getBytes(_file, rec.data);
+        case TraceRecordType::DirCount:
+            if (!getPid(_file, rec.pid) || !getBytes(_file, rec.name) || !getVarint(_file, v))
+                return false;
+            rec.value = static_cast<int64_t>(v) - 1;
+            return true;
+        case TraceRecordType::PidList: {
+            if (!getVarint(_file, v) || v > (1u << 22))
+                return false;
+            rec.pids.resize(v);
+            for (auto& pid : rec.pids) {
+                if (!getPid(_file, pid))
+                    return false;
+            }
+            return true;
+        }
+        case TraceRecordType::Alive:
+            if (!getPid(_file, rec.pid) || !getVarint(_file, v))
+                return false;
+            rec.value = static_cast<int64_t>(v);
+            return true;
+        case TraceRecordType::Event: {
+            int evType = fgetc(_file);
+            if (evType == EOF || !getPid(_file, rec.event.pid) || !getPid(_file, rec.event.ppid) ||
+                !getVarint(_file, v) || !getVarint(_file, rec.event.timestampNs))
+                return false;
+            rec.event.type = static_cast<ProcEvent::Type>(evType);
+            rec.event.exitCode = static_cast<uint32_t>(v);
+            return true;
+        }
+        case TraceRecordType::AddRoot:
+        case TraceRecordType::RootDied:
+            return getPid(_file, rec.pid);
+        case TraceRecordType::Tick:
+            return true;
+        default:
+            return false;
+    }
+}
+
+std::string RecordingProcSource::recordText(TraceRecordType type, pid_t pid, const char* name, std::string value) {
+    std::lock_guard<std::mutex> lock(_mtx);
+    auto& last = _texts[textKey(type, pid, name)];
+    if (last != value || value.empty()) {
+        TraceRecord rec;
+        rec.type = type;
+        rec.pid = pid;
+        rec.name = name;
+        rec.data = value;
+        _writer.write(rec);
+        last = value;
+    }
+    return value;
+}
+
+std::string RecordingProcSource::readFile(pid_t pid, const char* name) {
+    return recordText(TraceRecordType::FileRead, pid, name, _inner->readFile(pid, name));
+}
+
+std::string RecordingProcSource::readLink(pid_t pid, const char* name) {
+    return recordText(TraceRecordType::LinkRead, pid, name, _inner->readLink(pid, name));
+}
+
+int RecordingProcSource::countDirEntries(pid_t pid, const char* name) {
+    int count = _inner->countDirEntries(pid, name);
+    std::lock_guard<std::mutex> lock(_mtx);
+    auto key = std::make_pair(pid, std::string(name));
+    auto it = _dirCounts.find(key);
+    if (it == _dirCounts.end() || it->second != count) {
+        TraceRecord rec;
+        rec.type = TraceRecordType::DirCount;
+        rec.pid = pid;
+        rec.name = name;
+        rec.value = count;
+        _writer.write(rec);
+        _dirCounts[key] = count;
+    }
+    return count;
+}
+
+std::vector<pid_t> RecordingProcSource::listPids() {
+    std::lock_guard<std::mutex> lock(_mtx);
+    if (_pidsListed)
+        return _pids;
+    auto pids = _inner->listPids();
+    _pidsListed = true;
+    if (pids != _pids) {
+        TraceRecord rec;
+        rec.type = TraceRecordType::PidList;
+        rec.pids = pids;
+        _writer.write(rec);
+        _pids = std::move(pids);
+    }
+    return _pids;
+}
+
+void RecordingProcSource::endPass() {
+    std::lock_guard<std::mutex> lock(_mtx);
+    _pidsListed = false;
+}
+
+bool RecordingProcSource::isAlive(pid_t pid) {
+    bool alive = _inner->isAlive(pid);
+    std::lock_guard<std::mutex> lock(_mtx);
+    auto it = _alive.find(pid);
+    if (it == _alive.end() || it->second != alive) {
+        TraceRecord rec;
+        rec.type = TraceRecordType::Alive;
+        rec.pid = pid;
+        rec.value = alive;
+        _writer.write(rec);
+    }
+    if (alive) {
+        _alive[pid] = true;
+    } else {
+        // the pid is gone: drop its cached state so the caches do not grow with every process ever seen
+        _alive.erase(pid);
+        _texts.erase(_texts.lower_bound({pid, ""}), _texts.lower_bound({pid + 1, ""}));
+        _dirCounts.erase(_dirCounts.lower_bound({pid, ""}), _dirCounts.lower_bound({pid + 1, ""}));
+    }
+    return alive;
+}
+
+void ReplayProcSource::apply(const TraceRecord& rec) {
+    _timeNs = rec.timeNs;
+    switch (rec.type) {
+        case TraceRecordType::FileRead:
+        case TraceRecordType::LinkRead:
+            _texts[textKey(rec.type, rec.pid, rec.name.c_str())] = rec.data;
+            break;
+        case TraceRecordType::DirCount:
+            _dirCounts[{rec.pid, rec.name}] = static_cast<int>(rec.value);
+            break;
+        case TraceRecordType::PidList:
+            _pids = rec.pids;
+            break;
+        case TraceRecordType::Alive:
+            _alive[rec.pid] = rec.value != 0;
+            break;
+        default:
+            break;
+    }
+}
+
+std::string ReplayProcSource::text(TraceRecordType type, pid_t pid, const char* name) const {
+    auto it = _texts.find(textKey(type, pid, name));
+    return it == _texts.end() ? "" : it->second;
+}
+
+std::string ReplayProcSource::readFile(pid_t pid, const char* name) {
+    return text(TraceRecordType::FileRead, pid, name);
+}
+
+std::string ReplayProcSource::readLink(pid_t pid, const char* name) {
+    return text(TraceRecordType::LinkRead, pid, name);
+}
+
+int ReplayProcSource::countDirEntries(pid_t pid, const char* name) {
+    auto it = _dirCounts.find({pid, name});
+    return it == _dirCounts.end() ? -1 : it->second;
+}
+
+bool ReplayProcSource::isAlive(pid_t pid) {
+    auto it = _alive.find(pid);
+    return it != _alive.end() && it->second;
+}
+
+TraceReplayer::Stats TraceReplayer::run(ProcTreeMonitor& monitor, bool realtime) {
+    Stats stats;
+    auto start = std::chrono::steady_clock::now();
+    TraceRecord rec;
+    while (_reader.next(rec)) {
+        if (realtime)
+            std::this_thread::sleep_until(start + std::chrono::nanoseconds(rec.timeNs));
+        _timeNs = rec.timeNs;
+        _source.apply(rec);
+        ++stats.records;
+        switch (rec.type) {
+            case TraceRecordType::Event:
+                monitor.injectProcEvent(rec.event);
+                ++stats.events;
+                break;
+            case TraceRecordType::AddRoot:
+                monitor.addRootProc(rec.pid);
+                break;
+            case TraceRecordType::RootDied:
+                monitor.rootProcDied(rec.pid);
+                break;
+            case TraceRecordType::Tick:
+                monitor.syncOnce();
+                ++stats.ticks;
+                break;
+            default:
+                break;
+        }
+    }
+    stats.elapsed = std::chrono::steady_clock::now() - start;
+    return stats;
+}
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include "proc_source.h"
+
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace SudoMonitor {
+class ProcTreeMonitor;
+
+// Trace of everything a ProcTreeMonitor consumed: /proc reads, connector events, API calls and tree passes.
+// Reads are stored only when their result differs from the previous one for the same key,
+// so a replay keeps a "last known state" of /proc instead of a log of identical reads. That state is applied before
+// the pass that read it, so the pid list is read once per pass and every caller within the pass gets the same list.
+enum class TraceRecordType : uint8_t {
+    FileRead = 1,
+    LinkRead,
+    DirCount,
+    PidList,
+    Alive,
+    Event,    // ProcEvent from the proc connector
+    AddRoot,  // ProcTreeMonitor::addRootProc
+    RootDied, // ProcTreeMonitor::rootProcDied
+    Tick,     // end of one tree pass
+};
+
+struct TraceRecord {
+    TraceRecordType type = TraceRecordType::Tick;
+    uint64_t timeNs = 0;     // steady clock, since the start of the trace
+    pid_t pid = 0;
+    std::string name;        // file, link or directory name
+    std::string data;        // file content or link target
+    int64_t value = 0;       // directory entry count or alive flag
+    std::vector<pid_t> pids; // PidList
+    ProcEvent event;
+};
+
+class TraceWriter {
+public:
+    explicit TraceWriter(const std::string& path);
+    ~TraceWriter();
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+
+    bool init();
+    void write(TraceRecord& rec); // fills rec.timeNs
+    [[nodiscard]] uint64_t bytesWritten() const { return _bytes; }
+
+private:
+    std::string _path;
+    FILE* _file = nullptr;
+    std::mutex _mtx;
+    std::chrono::steady_clock::time_point _start;
+    uint64_t _lastNs = 0;
+    uint64_t _bytes = 0;
+    std::string _scratch;
+};
+
+class TraceReader {
+public:
+    explicit TraceReader(const std::string& path);
+    ~TraceReader();
+    TraceReader(const TraceReader&) = delete;
+    TraceReader& operator=(const TraceReader&) = delete;
+
+    bool init();
+    bool next(TraceRecord& rec); // false at the end of the trace or on a corrupt record
+    [[nodiscard]] int64_t startRealtimeNs() const { return _startRealtimeNs; }
+
+private:
+    std::string _path;
+    FILE* _file = nullptr;
+    uint64_t _lastNs = 0;
+    int64_t _startRealtimeNs = 0;
+};
+
+// Forwards to another source and writes the changed results to a trace
+class RecordingProcSource : public ProcSource {
+public:
+    RecordingProcSource(std::shared_ptr<ProcSource> inner, TraceWriter& writer)
+        : _inner(std::move(inner)), _writer(writer) {}
+
+    std::string readFile(pid_t pid, const char* name) override;
+    std::string readLink(pid_t pid, const char* name) override;
+    int countDirEntries(pid_t pid, const char* name) override;
+    std::vector<pid_t> listPids() override;
+    bool isAlive(pid_t pid) override;
+    Clock::time_point now() override { return _inner->now(); }
+    void endPass(); // the next listPids reads /proc again
+
+private:
+    std::string recordText(TraceRecordType type, pid_t pid, const char* name, std::string value);
+
+    std::shared_ptr<ProcSource> _inner;
+    TraceWriter& _writer;
+    std::mutex _mtx;
+    std::map<std::pair<pid_t, std::string>, std::string> _texts; // key name is prefixed with the record type
+    std::map<std::pair<pid_t, std::string>, int> _dirCounts;
+    std::map<pid_t, bool> _alive;
+    std::vector<pid_t> _pids;
+    bool _pidsListed = false;
+};
+
+// Answers from the state accumulated by the trace records applied so far
+class ReplayProcSource : public ProcSource {
+public:
+    void apply(const TraceRecord& rec);
+
+    std::string readFile(pid_t pid, const char* name) override;
+    std::string readLink(pid_t pid, const char* name) override;
+    int countDirEntries(pid_t pid, const char* name) override;
+    std::vector<pid_t> listPids() override { return _pids; }
+    bool isAlive(pid_t pid) override;
+    Clock::time_point now() override { return Clock::time_point(std::chrono::nanoseconds(_timeNs)); }
+
+private:
+    std::string text(TraceRecordType type, pid_t pid, const char* name) const;
+
+    uint64_t _timeNs = 0;
+    std::map<std::pair<pid_t, std::string>, std::string> _texts;
+    std::map<std::pair<pid_t, std::string>, int> _dirCounts;
+    std::map<pid_t, bool> _alive;
+    std::vector<pid_t> _pids;
+};
+
+// Feeds a trace through a ProcTreeMonitor built on a ReplayProcSource (the monitor must not be run()).
+class TraceReplayer {
+public:
+    struct Stats {
+        uint64_t records = 0;
+        uint64_t ticks = 0;
+        uint64_t events = 0; // connector events
+        std::chrono::nanoseconds elapsed{0};
+    };
+
+    TraceReplayer(TraceReader& reader, ReplayProcSource& source) : _reader(reader), _source(source) {}
+    // realtime: honour the recorded gaps between records, otherwise replay as fast as possible
+    Stats run(ProcTreeMonitor& monitor, bool realtime);
+    // Trace time of the record being replayed, as wall clock time of the recording
+    [[nodiscard]] int64_t currentRealtimeNs() const { return _reader.startRealtimeNs() + static_cast<int64_t>(_timeNs); }
+
+private:
+    TraceReader& _reader;
+    ReplayProcSource& _source;
+    uint64_t _timeNs = 0;
+};
+}
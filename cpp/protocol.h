@@ -1,5 +1,9 @@
 #pragma once
 #include <string>
+#include <string_view>
+#include <algorithm>
+#include <cstdint>
+#include <ctime>
 
 namespace SudoMonitor {
 static constexpr auto SUDO_UNKNOWN = "UNKNOWN";
@@ -13,6 +17,7 @@ enum class SudoMsgType {
     PAM_AUTH_SUCCESS,
     PAM_AUTH_START_SESSION,
     PAM_AUTH_END_SESSION,
+    PROCESS_QUERY, // "process_query <pid>": the daemon publishes the process with its demand tier attributes
     NUM_OF_MSG_TYPES
 };
 
@@ -22,8 +27,27 @@ static std::string Messages[] = {"UNKNOWN",
     "pam_auth_attempt",
     "pam_auth_success",
     "pam_auth_start_session",
-    "pam_auth_end_session"
+    "pam_auth_end_session",
+    "process_query"
 };
+// A field value is one token: space, '=', '%' and control bytes are sent as %XX, so a value the caller chooses
+// (a PAM user name) can not add fields or shadow the ones after it. Matched as sent, never decoded.
+inline std::string escapeField(std::string_view s) {
+    static constexpr char hex[] = "0123456789ABCDEF";
+    std::string out;
+    out.reserve(s.size());
+    for (unsigned char c : s) {
+        if (c <= ' ' || c == '=' || c == '%' || c == 0x7f) {
+            out += '%';
+            out += hex[c >> 4];
+            out += hex[c & 0xf];
+        } else {
+            out += static_cast<char>(c);
+        }
+    }
+    return out;
+}
+
 struct SudoMsg {
     SudoMsgType type = SudoMsgType::UNKNOWN;
     std::string value;
@@ -31,6 +55,35 @@ struct SudoMsg {
     SudoMsg(SudoMsgType t, pid_t pid) : type(t), value(std::to_string(pid)) {}
     SudoMsg(SudoMsgType t, const std::string& v) : type(t), value(v) {}
     [[nodiscard]] pid_t pid() const { return static_cast<pid_t>(std::stoi(value)); }
+    // Optional " key=value" attributes after the first token of the value, e.g. "42 user=alice tty=/dev/pts/0"
+    SudoMsg& add(std::string_view key, std::string_view val) {
+        value.append(" ").append(key).append("=").append(escapeField(val));
+        return *this;
+    }
+    // Latency trace id and the CLOCK_MONOTONIC send time (the clock of the daemon and of the proc connector)
+    SudoMsg& stamp(std::string_view trace) {
+        timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        auto ns = static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+        return add("trace", trace).add("mono_ns", std::to_string(ns));
+    }
+    [[nodiscard]] std::string_view field(std::string_view key) const {
+        std::string_view v = value;
+        for (size_t pos = v.find(key); pos != std::string_view::npos; pos = v.find(key, pos + 1)) {
+            size_t end = pos + key.size();
+            if (pos > 0 && v[pos - 1] == ' ' && end < v.size() && v[end] == '=') {
+                auto rest = v.substr(end + 1);
+                return rest.substr(0, rest.find(' '));
+            }
+        }
+        return {};
+    }
+    // First token of the value (the pid for sudo messages, the PAM user for PAM messages)
+    [[nodiscard]] std::string_view subject() const {
+        std::string_view v = value;
+        v.remove_prefix(std::min(v.find_first_not_of(' '), v.size()));
+        return v.substr(0, v.find(' '));
+    }
     [[nodiscard]] std::string toString() const { return Messages[static_cast<uint>(type)] + " " + value; }
 };
 inline std::string startSudoSession(pid_t  pid) {
@@ -0,0 +1,240 @@
+#include "self_profiler.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+
+namespace SudoMonitor {
+namespace {
+constexpr size_t MaxFrames = 64;   // scope nesting, deeper scopes are not timed
+constexpr uint32_t MaxLevels = 7;  // frames of one path (4 bits each), deeper ones count in their parent
+constexpr size_t Slots = 64;       // paths per thread, more are not recorded
+
+uint64_t clockNs(clockid_t clock) {
+    timespec ts{};
+    if (clock_gettime(clock, &ts) != 0)
+        return 0;
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+struct ThreadProfile {
+    struct Slot {
+        std::atomic<uint32_t> path{0};
+        std::atomic<uint64_t> ns{0};
+    };
+    struct Frame {
+        uint64_t start;
+        uint64_t child;     // time of the timed frames called from this one
+        uint32_t prevPath;
+        int32_t parent;     // index of the enclosing timed frame, -1: none
+        bool merged;        // recursion (or too deep): not timed, its time is the enclosing frame's
+    };
+
+    std::string name;
+    clockid_t clock{};
+    bool hasClock = false;
+    std::atomic_bool alive = true;
+    std::atomic<uint64_t> exitCpuNs{0};
+    uint64_t baseCpuNs = 0;       // under the registry lock
+    uint64_t lastSampleCpuNs = 0;
+
+    // Written by the owning thread only; folded() reads the slots
+    Slot slots[Slots];
+    Frame frames[MaxFrames];
+    size_t depth = 0;
+    uint32_t path = 0;
+    uint32_t levels = 0;
+    int32_t lastTimed = -1;
+
+    [[nodiscard]] uint64_t cpu() const {
+        if (!alive)
+            return exitCpuNs;
+        return hasClock ? clockNs(clock) : 0;
+    }
+    void add(uint32_t key, uint64_t ns) {
+        for (size_t n = 0, i = (key * 2654435761u) % Slots; n < Slots; ++n, i = (i + 1) % Slots) {
+            auto current = slots[i].path.load(std::memory_order_relaxed);
+            if (current == key) {
+                slots[i].ns.store(slots[i].ns.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+                return;
+            }
+            if (current == 0) {
+                slots[i].ns.store(ns, std::memory_order_relaxed);
+                slots[i].path.store(key, std::memory_order_release);
+                return;
+            }
+        }
+    }
+};
+
+// Never destroyed: threads may still exit while the process exits
+struct Registry {
+    std::mutex mtx;
+    std::vector<std::shared_ptr<ThreadProfile>> threads;
+    uint64_t lastSampleNs = 0;
+    bool started = false; // CPU times count from the first enable()
+};
+Registry& registry() {
+    static auto* r = new Registry;
+    return *r;
+}
+
+struct Holder {
+    std::shared_ptr<ThreadProfile> profile;
+    ~Holder() {
+        if (!profile)
+            return;
+        profile->exitCpuNs = clockNs(CLOCK_THREAD_CPUTIME_ID);
+        profile->alive = false;
+    }
+};
+thread_local Holder current;
+
+ThreadProfile& self(const char* name = nullptr) {
+    if (!current.profile) {
+        auto p = std::make_shared<ThreadProfile>();
+        char buf[16] = {};
+        if (!name && pthread_getname_np(pthread_self(), buf, sizeof(buf)) == 0)
+            name = buf;
+        p->name = name ? name : "thread";
+        p->hasClock = pthread_getcpuclockid(pthread_self(), &p->clock) == 0;
+        auto& r = registry();
+        std::lock_guard lock(r.mtx);
+        if (r.started)
+            p->baseCpuNs = p->cpu();
+        r.threads.push_back(p);
+        current.profile = std::move(p);
+    }
+    return *current.profile;
+}
+}
+
+const char* profilePointName(ProfilePoint point) {
+    static const char* names[] = {"none", "treePass", "scanProc", "syncNode", "readProcFile", "parseSudoMsg", "procEvent"};
+    static_assert(std::size(names) == static_cast<size_t>(ProfilePoint::NUM_OF_POINTS));
+    return names[static_cast<size_t>(point)];
+}
+
+void SelfProfiler::enable() {
+    auto& r = registry();
+    std::lock_guard lock(r.mtx);
+    if (!r.started) {
+        for (auto& t : r.threads)
+            t->baseCpuNs = t->cpu();
+        r.lastSampleNs = clockNs(CLOCK_MONOTONIC);
+        r.started = true;
+    }
+    _enabled = true;
+}
+
+void SelfProfiler::disable() {
+    _enabled = false;
+}
+
+void SelfProfiler::nameThread(const char* name, bool rename) {
+    if (!enabled()) // nothing to name the thread for, and the plugin's threads run in sudo's process
+        return;
+    if (rename) {
+        char truncated[16] = {};
+        snprintf(truncated, sizeof(truncated), "%s", name);
+        pthread_setname_np(pthread_self(), truncated);
+    }
+    if (current.profile) {
+        std::lock_guard lock(registry().mtx);
+        current.profile->name = name;
+    } else {
+        self(name);
+    }
+}
+
+std::vector<SelfProfiler::ThreadCpu> SelfProfiler::sampleThreads() {
+    auto& r = registry();
+    std::lock_guard lock(r.mtx);
+    auto now = clockNs(CLOCK_MONOTONIC);
+    auto interval = std::max<uint64_t>(1, now - r.lastSampleNs);
+    r.lastSampleNs = now;
+    std::map<std::string, std::pair<uint64_t, uint64_t>> byName; // cpu, cpu in the interval
+    for (auto& t : r.threads) {
+        auto cpu = t->cpu();
+        cpu = cpu > t->baseCpuNs ? cpu - t->baseCpuNs : 0;
+        auto& [total, delta] = byName[t->name];
+        total += cpu;
+        delta += cpu > t->lastSampleCpuNs ? cpu - t->lastSampleCpuNs : 0;
+        t->lastSampleCpuNs = cpu;
+    }
+    std::vector<ThreadCpu> out;
+    for (const auto& [name, cpu] : byName)
+        out.push_back({name, cpu.first, static_cast<uint32_t>(cpu.second * 1000 / interval)});
+    return out;
+}
+
+std::string SelfProfiler::folded() {
+    auto& r = registry();
+    std::map<std::string, uint64_t> stacks;
+    std::lock_guard lock(r.mtx);
+    for (auto& t : r.threads) {
+        uint64_t scoped = 0;
+        for (const auto& slot : t->slots) {
+            auto key = slot.path.load(std::memory_order_acquire);
+            if (!key)
+                continue;
+            auto ns = slot.ns.load(std::memory_order_relaxed);
+            std::string frames;
+            for (int shift = 28; shift >= 0; shift -= 4) {
+                if (auto point = (key >> shift) & 0xF)
+                    frames = frames + ";" + profilePointName(static_cast<ProfilePoint>(point));
+            }
+            stacks[t->name + frames] += ns;
+            scoped += ns;
+        }
+        auto cpu = t->cpu();
+        cpu = cpu > t->baseCpuNs ? cpu - t->baseCpuNs : 0;
+        stacks[t->name] += cpu > scoped ? cpu - scoped : 0;
+    }
+    std::string out;
+    for (const auto& [stack, ns] : stacks) {
+        if (ns >= 1000)
+            out += stack + " " + std::to_string(ns / 1000) + "\n";
+    }
+    return out;
+}
+
+bool ProfileScope::enter(ProfilePoint point) {
+    auto& t = self();
+    if (t.depth == MaxFrames)
+        return false;
+    auto& f = t.frames[t.depth];
+    auto p = static_cast<uint32_t>(point);
+    f.merged = (t.path & 0xF) == p || t.levels == MaxLevels;
+    if (!f.merged) {
+        f.prevPath = t.path;
+        f.parent = t.lastTimed;
+        f.child = 0;
+        t.path = (t.path << 4) | p;
+        ++t.levels;
+        t.lastTimed = static_cast<int32_t>(t.depth);
+        f.start = clockNs(CLOCK_THREAD_CPUTIME_ID);
+    }
+    ++t.depth;
+    return true;
+}
+
+void ProfileScope::leave() {
+    auto& t = *current.profile;
+    auto& f = t.frames[--t.depth];
+    if (f.merged)
+        return;
+    auto elapsed = clockNs(CLOCK_THREAD_CPUTIME_ID) - f.start;
+    t.add(t.path, elapsed - std::min(elapsed, f.child));
+    t.path = f.prevPath;
+    --t.levels;
+    t.lastTimed = f.parent;
+    if (f.parent >= 0)
+        t.frames[f.parent].child += elapsed;
+}
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace SudoMonitor {
+// Instrumented functions, the frames of the folded stacks
+enum class ProfilePoint : uint8_t {
+    None = 0,
+    TreePass,     // ProcTreeMonitor syncAll
+    ScanProc,     // /proc scan for the children of the tracked processes
+    SyncNode,     // recursive frames are merged into one
+    ReadProcFile,
+    ParseSudoMsg,
+    ProcEvent,    // a connector event applied to the tracked trees
+    NUM_OF_POINTS
+};
+const char* profilePointName(ProfilePoint point);
+
+// Self-profiling: per-thread CPU time (CLOCK_THREAD_CPUTIME_ID) of the named threads, and the time spent in the
+// ProfileScope frames of each thread. Scope times are CPU time of the owning thread too, so a scope blocked on I/O or
+// on the scan workers counts only what it ran and the folded stacks add up to the thread's CPU time. They are kept
+// in a small per-thread table that only its thread writes. Disabled, a scope costs one relaxed load.
+class SelfProfiler {
+public:
+    struct ThreadCpu {
+        std::string name;
+        uint64_t cpuNs = 0;      // since the profiler was enabled
+        uint32_t permille = 0;   // of one CPU, since the previous sampleThreads()
+    };
+    static void enable();
+    static void disable(); // scopes stop recording, what was recorded is kept
+    static bool enabled() { return _enabled.load(std::memory_order_relaxed); }
+    // Names the calling thread (pthread_setname_np, 15 characters at most) and registers it for the CPU samples.
+    // rename false: registered only, e.g. for the main thread, whose name is the process name.
+    // Does nothing while the profiler is disabled: threads started before enable() register on their first scope.
+    static void nameThread(const char* name, bool rename = true);
+    // Threads with the same name are summed
+    static std::vector<ThreadCpu> sampleThreads();
+    // One "thread;frame;frame microseconds" line per stack (flamegraph.pl, speedscope); the thread frame alone
+    // holds its CPU time outside the scopes
+    static std::string folded();
+
+private:
+    inline static std::atomic_bool _enabled = false;
+};
+
+class ProfileScope {
+public:
+    explicit ProfileScope(ProfilePoint point) {
+        if (SelfProfiler::enabled())
+            _entered = enter(point);
+    }
+    ~ProfileScope() {
+        if (_entered)
+            leave();
+    }
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+    static bool enter(ProfilePoint point);
+    static void leave();
+    bool _entered = false;
+};
+}
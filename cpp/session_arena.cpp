@@ -0,0 +1,98 @@
+#include "session_arena.h"
+#include "common.h"
+
+#include <algorithm>
+#include <new>
+#include <sys/mman.h>
+
+namespace SudoMonitor {
+namespace {
+// Chunks straight from mmap, so releasing the arena returns them to the system instead of the malloc heap
+class MappedResource : public std::pmr::memory_resource {
+public:
+    size_t mapped = 0;
+
+private:
+    void* do_allocate(size_t bytes, size_t) override {
+        void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            throw std::bad_alloc();
+        mapped += bytes;
+        return p;
+    }
+    void do_deallocate(void* p, size_t bytes, size_t) override {
+        munmap(p, bytes);
+        mapped -= bytes;
+    }
+    [[nodiscard]] bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+};
+}
+
+struct SessionArena::Impl {
+    size_t cap;
+    size_t reducedAt;
+    size_t used = 0;
+    size_t peak = 0;
+    size_t charged = 0;
+    // destroyed bottom-up: the pool returns its chunks to the monotonic buffer, which unmaps them
+    MappedResource mapped;
+    std::pmr::monotonic_buffer_resource chunks{Config::SessionArenaInitialBytes, &mapped};
+    std::pmr::unsynchronized_pool_resource pool{{0, 64 << 10}, &chunks};
+
+    explicit Impl(size_t capBytes)
+        : cap(capBytes), reducedAt(capBytes / 100 * Config::SessionReducedPercent) {}
+};
+
+SessionArena::SessionArena(size_t capBytes) : pimpl(std::make_unique<Impl>(capBytes)) {}
+
+SessionArena::~SessionArena() = default;
+
+size_t SessionArena::used() const {
+    return pimpl->used;
+}
+
+size_t SessionArena::peak() const {
+    return pimpl->peak;
+}
+
+size_t SessionArena::mapped() const {
+    return pimpl->mapped.mapped;
+}
+
+SessionArena::Pressure SessionArena::pressure() const {
+    auto held = pimpl->used + pimpl->charged;
+    if (!pimpl->cap || held < pimpl->reducedAt)
+        return Pressure::Normal;
+    return held < pimpl->cap ? Pressure::Reduced : Pressure::Full;
+}
+
+void SessionArena::charge(size_t bytes) {
+    pimpl->charged += bytes;
+}
+
+void SessionArena::uncharge(size_t bytes) {
+    pimpl->charged -= std::min(bytes, pimpl->charged);
+}
+
+size_t SessionArena::charged() const {
+    return pimpl->charged;
+}
+
+void* SessionArena::do_allocate(size_t bytes, size_t alignment) {
+    void* p = pimpl->pool.allocate(bytes, alignment);
+    pimpl->used += bytes;
+    pimpl->peak = std::max(pimpl->peak, pimpl->used);
+    return p;
+}
+
+void SessionArena::do_deallocate(void* p, size_t bytes, size_t alignment) {
+    pimpl->pool.deallocate(p, bytes, alignment);
+    pimpl->used -= bytes;
+}
+
+bool SessionArena::do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+    return this == &other;
+}
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+
+namespace SudoMonitor {
+// Storage of one session's process tree: nodes, child vectors, property maps and their strings.
+// Freed blocks are reused by the pool while the session lives, and every chunk is unmapped in one step
+// when the arena is destroyed with the session, so long sessions with heavy churn do not fragment the daemon heap.
+// Not thread-safe, the tree worker holds the monitor lock.
+class SessionArena : public std::pmr::memory_resource {
+public:
+    enum class Pressure { Normal, Reduced, Full };
+
+    explicit SessionArena(size_t capBytes); // 0: unlimited
+    ~SessionArena() override;
+    SessionArena(const SessionArena&) = delete;
+    SessionArena& operator=(const SessionArena&) = delete;
+
+    [[nodiscard]] size_t used() const;   // bytes allocated and not freed
+    [[nodiscard]] size_t peak() const;   // highest used()
+    [[nodiscard]] size_t mapped() const; // bytes currently obtained from the system
+    [[nodiscard]] Pressure pressure() const; // of used() and charged() together
+    // Memory held outside the arena on the session's behalf (the interned comm/cmdline of its processes), counted
+    // toward the cap
+    void charge(size_t bytes);
+    void uncharge(size_t bytes);
+    [[nodiscard]] size_t charged() const;
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override;
+    [[nodiscard]] bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+
+    struct Impl;
+    std::unique_ptr<Impl> pimpl;
+};
+}
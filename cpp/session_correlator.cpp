@@ -0,0 +1,241 @@
+#include "session_correlator.h"
+#include "common.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+namespace SudoMonitor {
+const char* correlationMatchName(CorrelatedSession::Match match) {
+    switch (match) {
+        case CorrelatedSession::Match::Pid: return "pid";
+        case CorrelatedSession::Match::Parent: return "parent";
+        case CorrelatedSession::Match::Sibling: return "sibling";
+        case CorrelatedSession::Match::UserTty: return "user_tty";
+        default: return "none";
+    }
+}
+
+struct SessionCorrelator::Impl {
+    static constexpr size_t MaxPids = Config::CorrelationMaxPids;
+    static constexpr uint64_t Slots = Config::CorrelationWheelSlots;
+
+    struct Entry {
+        std::string user;
+        std::string tty;
+        uint64_t attempts = 0;
+        uint64_t successes = 0;
+        uint64_t pamSessions = 0;
+        Clock::time_point first;
+        Clock::time_point last;
+        uint64_t expiryTick = 0;
+        std::pair<pid_t, pid_t> pids[MaxPids]{}; // (pid, ppid) ring of the latest senders
+        size_t nextPid = 0;
+    };
+
+    OnRecord _onSession;
+    OnRecord _onExpired;
+    std::chrono::nanoseconds _window;
+    std::chrono::nanoseconds _tickLen;  // a window spans half of the wheel, so no entry needs more than one round
+    Clock::time_point _origin;
+    bool _started = false;
+    uint64_t _tick = 0;                 // next tick to process
+
+    std::unordered_map<uint64_t, Entry> _entries;
+    std::unordered_map<std::string, uint64_t> _byUserTty;
+    std::unordered_map<pid_t, uint64_t> _byPid;
+    std::unordered_map<pid_t, uint64_t> _byParent;
+    std::vector<std::vector<uint64_t>> _wheel = std::vector<std::vector<uint64_t>>(Slots);
+    std::vector<uint64_t> _due;
+    uint64_t _nextId = 1;
+    std::string _key;
+    Metrics _metrics;
+
+    Impl(const OnRecord& onSession, const OnRecord& onExpired, std::chrono::milliseconds window)
+        : _onSession(onSession), _onExpired(onExpired),
+          _window(window.count() > 0 ? window : std::chrono::milliseconds(Config::CorrelationWindowMs)),
+          _tickLen(std::max<std::chrono::nanoseconds>(_window / (Slots / 2), std::chrono::nanoseconds(1))) {}
+
+    void begin(Clock::time_point now) {
+        if (!_started) {
+            _origin = now;
+            _started = true;
+        }
+    }
+    uint64_t tickOf(Clock::time_point t) const {
+        return t <= _origin ? 0 : static_cast<uint64_t>((t - _origin) / _tickLen);
+    }
+    const std::string& key(std::string_view user, std::string_view tty) {
+        _key.assign(user).push_back('\0');
+        _key.append(tty);
+        return _key;
+    }
+    uint64_t find(const std::unordered_map<pid_t, uint64_t>& index, pid_t pid) const {
+        auto it = pid > 0 ? index.find(pid) : index.end();
+        return it == index.end() ? 0 : it->second;
+    }
+    void unindex(std::unordered_map<pid_t, uint64_t>& index, pid_t pid, uint64_t id) {
+        auto it = index.find(pid);
+        if (it != index.end() && it->second == id)
+            index.erase(it);
+    }
+    void rememberPid(uint64_t id, Entry& entry, pid_t pid, pid_t ppid) {
+        if (pid <= 0)
+            return;
+        for (const auto& p : entry.pids) {
+            if (p.first == pid)
+                return;
+        }
+        auto& slot = entry.pids[entry.nextPid++ % MaxPids];
+        if (slot.first) {
+            unindex(_byPid, slot.first, id);
+            unindex(_byParent, slot.second, id);
+        }
+        slot = {pid, ppid};
+        _byPid[pid] = id;
+        if (ppid > 0)
+            _byParent[ppid] = id;
+    }
+    void fill(CorrelatedSession& rec, const Entry& entry, Clock::time_point end) const {
+        rec.attempts = entry.attempts;
+        rec.successes = entry.successes;
+        rec.failures = entry.attempts > entry.successes ? entry.attempts - entry.successes : 0;
+        rec.pamSessions = entry.pamSessions;
+        rec.authMs = entry.attempts ? static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(end - entry.first).count()) : 0;
+    }
+    void erase(std::unordered_map<uint64_t, Entry>::iterator it) {
+        auto& entry = it->second;
+        _byUserTty.erase(key(entry.user, entry.tty));
+        for (const auto& [pid, ppid] : entry.pids) {
+            if (pid) {
+                unindex(_byPid, pid, it->first);
+                unindex(_byParent, ppid, it->first);
+            }
+        }
+        _entries.erase(it);
+    }
+
+    void authEvent(const AuthEvent& event, Clock::time_point now) {
+        begin(now);
+        ++_metrics.events;
+        uint64_t id;
+        auto known = _byUserTty.find(key(event.user, event.tty));
+        if (known != _byUserTty.end()) {
+            id = known->second;
+        } else {
+            if (_entries.size() >= Config::CorrelationMaxEntries) {
+                ++_metrics.dropped;
+                return;
+            }
+            id = _nextId++;
+            _byUserTty.emplace(_key, id);
+            auto& entry = _entries[id];
+            entry.user = event.user;
+            entry.tty = event.tty;
+            entry.first = now;
+            entry.expiryTick = tickOf(now + _window) + 1;
+            _wheel[entry.expiryTick % Slots].push_back(id);
+        }
+        auto& entry = _entries[id];
+        switch (event.type) {
+            case AuthEvent::Type::Attempt: ++entry.attempts; break;
+            case AuthEvent::Type::Success: ++entry.successes; break;
+            case AuthEvent::Type::SessionOpen: ++entry.pamSessions; break;
+            case AuthEvent::Type::SessionClose: break;
+        }
+        // the wheel slot is not moved here: the entry is rescheduled when its old slot comes up
+        entry.last = now;
+        entry.expiryTick = tickOf(now + _window) + 1;
+        rememberPid(id, entry, event.pid, event.ppid);
+    }
+
+    void sessionStarted(const SessionStart& start, Clock::time_point now) {
+        begin(now);
+        ++_metrics.sessions;
+        CorrelatedSession rec;
+        rec.pid = start.pid;
+        rec.user = start.user;
+        rec.tty = start.tty;
+        uint64_t id = 0;
+        if ((id = find(_byPid, start.pid)))
+            rec.match = CorrelatedSession::Match::Pid;
+        else if ((id = find(_byPid, start.ppid)))
+            rec.match = CorrelatedSession::Match::Parent;
+        else if ((id = find(_byParent, start.ppid)))
+            rec.match = CorrelatedSession::Match::Sibling;
+        else if (!start.user.empty()) {
+            auto it = _byUserTty.find(key(start.user, start.tty));
+            if (it != _byUserTty.end()) {
+                id = it->second;
+                rec.match = CorrelatedSession::Match::UserTty;
+            }
+        }
+        auto it = id ? _entries.find(id) : _entries.end();
+        if (it != _entries.end()) {
+            fill(rec, it->second, now);
+            erase(it);
+            ++_metrics.matched;
+        } else {
+            rec.match = CorrelatedSession::Match::None;
+        }
+        if (_onSession)
+            _onSession(rec);
+    }
+
+    void advance(Clock::time_point now) {
+        begin(now);
+        auto nowTick = tickOf(now);
+        for (; _tick <= nowTick; ++_tick) {
+            auto& slot = _wheel[_tick % Slots];
+            if (slot.empty())
+                continue;
+            _due.swap(slot);
+            for (auto id : _due) {
+                auto it = _entries.find(id);
+                if (it == _entries.end())
+                    continue; // consumed by a session
+                auto& entry = it->second;
+                if (entry.expiryTick > _tick) {
+                    _wheel[entry.expiryTick % Slots].push_back(id);
+                    continue;
+                }
+                ++_metrics.expired;
+                if (entry.attempts > entry.successes && _onExpired) {
+                    CorrelatedSession rec;
+                    rec.user = entry.user;
+                    rec.tty = entry.tty;
+                    fill(rec, entry, entry.last);
+                    _onExpired(rec);
+                }
+                erase(it);
+            }
+            _due.clear();
+        }
+    }
+};
+
+SessionCorrelator::SessionCorrelator(const OnRecord& onSession, const OnRecord& onExpired,
+                                     std::chrono::milliseconds window)
+    : pimpl(std::make_unique<Impl>(onSession, onExpired, window)) {}
+
+SessionCorrelator::~SessionCorrelator() = default;
+
+void SessionCorrelator::authEvent(const AuthEvent& event, Clock::time_point now) {
+    pimpl->authEvent(event, now);
+}
+
+void SessionCorrelator::sessionStarted(const SessionStart& start, Clock::time_point now) {
+    pimpl->sessionStarted(start, now);
+}
+
+void SessionCorrelator::advance(Clock::time_point now) {
+    pimpl->advance(now);
+}
+
+SessionCorrelator::Metrics SessionCorrelator::metrics() const {
+    auto metrics = pimpl->_metrics;
+    metrics.entries = pimpl->_entries.size();
+    return metrics;
+}
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+
+namespace SudoMonitor {
+struct AuthEvent {
+    enum class Type { Attempt, Success, SessionOpen, SessionClose };
+    Type type = Type::Attempt;
+    std::string_view user; // invoking user (PAM_RUSER, or PAM_USER when it is not set)
+    std::string_view tty;
+    pid_t pid = 0;
+    pid_t ppid = 0;
+};
+
+struct SessionStart {
+    pid_t pid = 0;
+    pid_t ppid = 0;
+    std::string_view user;
+    std::string_view tty;
+};
+
+struct CorrelatedSession {
+    enum class Match { None, Pid, Parent, Sibling, UserTty };
+    pid_t pid = 0;            // sudo session pid, 0 for an expired history
+    std::string user;
+    std::string tty;
+    Match match = Match::None;
+    uint64_t attempts = 0;
+    uint64_t successes = 0;
+    uint64_t failures = 0;    // attempts that were not followed by a success
+    uint64_t pamSessions = 0; // pam_open_session calls
+    uint64_t authMs = 0;      // from the first attempt to the session start (or to the last event when expired)
+};
+const char* correlationMatchName(CorrelatedSession::Match match);
+
+// Joins PAM activity with the sudo sessions it produced. PAM events are folded into one history per
+// (user, tty), indexed by the pids that sent them and their parents. A session start consumes the history found
+// by its own pid, then by its parent pid (authenticated ancestor), then by a PAM process with the same parent
+// (an earlier sudo from the same shell), then by (user, tty). Histories expire CorrelationWindowMs after their last event
+// through a timer wheel, and those that saw failures are reported on expiry.
+class SessionCorrelator {
+public:
+    using Clock = std::chrono::steady_clock;
+    using OnRecord = std::function<void(const CorrelatedSession&)>;
+    struct Metrics {
+        uint64_t events = 0;
+        uint64_t sessions = 0;
+        uint64_t matched = 0;
+        uint64_t expired = 0;
+        uint64_t dropped = 0; // events not recorded because the history table was full
+        uint64_t entries = 0; // live histories
+    };
+
+    // onSession: every session start; onExpired: histories with failures that never led to a session
+    SessionCorrelator(const OnRecord& onSession, const OnRecord& onExpired,
+                      std::chrono::milliseconds window = std::chrono::milliseconds(0));
+    ~SessionCorrelator();
+    SessionCorrelator(const SessionCorrelator&) = delete;
+    SessionCorrelator& operator=(const SessionCorrelator&) = delete;
+
+    void authEvent(const AuthEvent& event, Clock::time_point now);
+    void sessionStarted(const SessionStart& start, Clock::time_point now);
+    // Expires histories, cheap to call on every loop iteration
+    void advance(Clock::time_point now);
+    [[nodiscard]] Metrics metrics() const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> pimpl;
+};
+}
@@ -1,16 +1,56 @@
 #include "common.h"
+#include "event_pipeline.h"
+#include "event_serializer.h"
+#include "latency_tracer.h"
+#include "monitor_subprocesses.h"
+#include "proc_fs.h"
+#include "proc_trace.h"
+#include "protocol.h"
+#include "self_profiler.h"
+#include "session_correlator.h"
 #include "uds_socket.h"
+#include "upstream_forwarder.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <iomanip>
 #include <iostream>
+#include <dirent.h>
 #include <dlfcn.h>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <functional>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <csignal>
 #include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <vector>
 #include <sudo_plugin.h>
+#include <security/pam_appl.h>
 
+// Heap allocation counter for the benchmarks
+static std::atomic<size_t> allocations{0};
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
 
-// Typical PAM function signature
-typedef int (*pam_func)(void*, int, int, const char**);
 
 void* loadSO(const std::string& path) {
     if (access(path.c_str(), R_OK) != 0) {
@@ -24,16 +64,137 @@ void* loadSO(const std::string& path) {
     return handle;
 }
 
-void simulatePAM() {
-    auto pam_handle = loadSO("./pam_custom_module.so");
-    auto pam_auth = (pam_func)dlsym(pam_handle, "pam_sm_authenticate");
-    if (pam_auth) {
-        std::cout << "-> Simulating PAM Authentication Attempt..." << std::endl;
-        pam_auth(nullptr, 0, 0, nullptr); // Triggers notify_daemon
-    } else {
-        std::cerr << "The method pam_handle is not found" << std::endl;
+// Runs the module through a real libpam stack (pam_set_data only works for modules called by libpam).
+// The service file is written to a private config directory, so /etc/pam.d is not touched.
+class PamStack {
+public:
+    static constexpr auto Service = "sudo_monitor_simulator";
+    static constexpr auto ConfDir = "/tmp/sudo_monitor_pam.d";
+    using Step = std::pair<const char*, int (*)(pam_handle_t*, int)>;
+    static constexpr Step Steps[] = {{"pam_authenticate", pam_authenticate},
+                                     {"pam_setcred", [](pam_handle_t* h, int) { return pam_setcred(h, PAM_ESTABLISH_CRED); }},
+                                     {"pam_open_session", pam_open_session},
+                                     {"pam_close_session", pam_close_session}};
+
+    // moduleArgs == nullptr: a stack of pam_permit only, the baseline to compare with
+    static void configure(const char* moduleArgs) {
+        mkdir(ConfDir, 0755);
+        std::ofstream conf(std::string(ConfDir) + "/" + Service, std::ios::trunc);
+        if (moduleArgs) {
+            std::unique_ptr<char, decltype(&free)> path(realpath("./pam_custom_module.so", nullptr), free);
+            if (!path)
+                throw std::runtime_error("./pam_custom_module.so not found");
+            conf << "auth optional " << path.get() << " " << moduleArgs << std::endl
+                 << "session optional " << path.get() << " " << moduleArgs << std::endl;
+        }
+        conf << "auth required pam_permit.so" << std::endl << "session required pam_permit.so" << std::endl;
+    }
+
+    explicit PamStack(const char* user) {
+        static const pam_conv conv{nullptr, nullptr};
+        if (pam_start_confdir(Service, user, &conv, ConfDir, &_pamh) != PAM_SUCCESS)
+            throw std::runtime_error("pam_start_confdir failed");
+    }
+    ~PamStack() { pam_end(_pamh, PAM_SUCCESS); }
+    PamStack(const PamStack&) = delete;
+    PamStack& operator=(const PamStack&) = delete;
+    pam_handle_t* get() const { return _pamh; }
+private:
+    pam_handle_t* _pamh = nullptr;
+};
+
+// The sudo caller as seen by both the PAM and sudo simulations, so the daemon can join them
+static constexpr auto SimulatedUser = "simulated_user";
+static constexpr auto SimulatedTty = "/dev/pts/simulated";
+
+// pam [N]: N failed authentications first, each from its own handle like repeated sudo invocations
+void simulatePAM(const std::vector<std::string>& args) {
+    int failures = args.empty() ? 0 : std::stoi(args[0]);
+    PamStack::configure("");
+    auto login = [](bool success) {
+        PamStack pamh("root");
+        pam_set_item(pamh.get(), PAM_RUSER, SimulatedUser);
+        pam_set_item(pamh.get(), PAM_TTY, SimulatedTty);
+        for (const auto& [name, step] : PamStack::Steps) { // the module notifies the daemon on each one
+            step(pamh.get(), 0);
+            if (!success)
+                break;
+        }
+    };
+    for (int i = 0; i < failures; ++i) {
+        std::cout << "-> Simulating a failed PAM authentication..." << std::endl;
+        login(false);
+    }
+    std::cout << "-> Simulating a PAM login: authenticate, setcred, open and close session..." << std::endl;
+    login(true);
+}
+
+// Time the notifier adds to each PAM stack call: the same stack with and without the module,
+// with the daemon reading, not running, and stalled (receive queue full)
+void benchPam() {
+    constexpr size_t logins = 20000;
+    constexpr size_t steps = std::size(PamStack::Steps);
+    const std::string path = "/tmp/sudo_monitor_bench_pam.sock";
+    const std::string moduleArgs = "socket=" + path;
+    using Means = std::array<int64_t, steps>;
+
+    auto run = [&](const char* scenario, const char* args, const Means* baseline) {
+        PamStack::configure(args);
+        std::vector<int64_t> ns[steps];
+        for (auto& v : ns)
+            v.reserve(logins);
+        for (size_t i = 0; i < logins; ++i) {
+            PamStack pamh("root");
+            for (size_t s = 0; s < steps; ++s) {
+                auto start = std::chrono::steady_clock::now();
+                PamStack::Steps[s].second(pamh.get(), 0);
+                ns[s].push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count());
+            }
+        }
+        Means means{};
+        std::cout << scenario << " (" << logins << " logins)" << std::endl;
+        for (size_t s = 0; s < steps; ++s) {
+            auto& v = ns[s];
+            std::sort(v.begin(), v.end());
+            for (auto x : v)
+                means[s] += x;
+            means[s] /= static_cast<int64_t>(v.size());
+            std::cout << "  " << std::left << std::setw(18) << PamStack::Steps[s].first
+                      << " mean ns: " << std::setw(8) << means[s]
+                      << " p99 ns: " << std::setw(8) << v[v.size() * 99 / 100]
+                      << " max ns: " << std::setw(10) << v.back();
+            if (baseline)
+                std::cout << " added ns: " << means[s] - (*baseline)[s];
+            std::cout << std::endl;
+        }
+        return means;
+    };
+
+    auto baseline = run("pam_permit only", nullptr, nullptr);
+    unlink(path.c_str());
+    run("daemon not running", moduleArgs.c_str(), &baseline);
+    {
+        std::atomic<size_t> received{0};
+        std::atomic<bool> reading{true};
+        SudoMonitor::UdsSocket server(path, SudoMonitor::UdsSocket::Mode::DGRAM_SERVER,
+                                      [&](int, const std::string&) { ++received; });
+        server.init();
+        std::thread reader([&] {
+            while (reading)
+                server.serverUpdate();
+        });
+        run("daemon reading", moduleArgs.c_str(), &baseline);
+        reading = false;
+        reader.join();
+        server.serverUpdate();
+        std::cout << "  datagrams received: " << received << std::endl;
+    }
+    {
+        SudoMonitor::UdsSocket server(path, SudoMonitor::UdsSocket::Mode::DGRAM_SERVER);
+        server.init();
+        run("daemon stalled", moduleArgs.c_str(), &baseline);
     }
-    dlclose(pam_handle);
 }
 
 // This is your mock implementation of the sudo_printf_t callback
@@ -53,7 +214,9 @@ void simulateSudo() {
         return;
     }
     std::cout << "-> Simulating Sudo Open Event..." << std::endl;
-    char *user_info[] = {(char *) "user=simulated_user", nullptr};
+    std::string user = std::string("user=") + SimulatedUser, tty = std::string("tty=") + SimulatedTty;
+    std::string ppid = "ppid=" + std::to_string(getppid());
+    char *user_info[] = {user.data(), tty.data(), ppid.data(), nullptr};
     char *settings[] = {nullptr};
     char *options[] = {(char*) "console_log=true", (char*) "log_file=/tmp/sudo_plugin.log", (char*) "use_daemon=true", nullptr};
     char *user_env[] = {nullptr};
@@ -80,6 +243,17 @@ void simulateSudo() {
 }
 
 
+// Asks the daemon for a tracked process; it publishes a Queried record with the demand tier attributes
+void simulateQuery(const std::vector<std::string>& args) {
+    if (args.empty())
+        throw std::invalid_argument("query PID");
+    SudoMonitor::UdsSocket client(SudoMonitor::Config::SudoToDaemonSock, SudoMonitor::UdsSocket::Mode::CLIENT);
+    if (!client.init())
+        throw std::runtime_error(std::string("cannot connect to ") + SudoMonitor::Config::SudoToDaemonSock);
+    SudoMonitor::SudoMsg query(SudoMonitor::SudoMsgType::PROCESS_QUERY, static_cast<pid_t>(std::stoi(args[0])));
+    client.clientSend(query.toString() + "\n");
+    SLEEP_MS(100);
+}
 void simulateSendMsg() {
     SudoMonitor::UdsSocket client(SudoMonitor::Config::DaemonToMonitorSock, SudoMonitor::UdsSocket::Mode::CLIENT);
     client.init();
@@ -87,12 +261,1074 @@ void simulateSendMsg() {
     SLEEP_MS(1000);
     // std::cout << "Response: " << client.receiveResponse() << std::endl;
 }
-int main() {
-    std::cout << "Starting Sudo/PAM Plugin Simulator..." << std::endl;
+template <typename F>
+void runBenchmark(const std::string& name, size_t iterations, F&& body) {
+    size_t bytes = 0;
+    auto allocBefore = allocations.load();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i)
+        bytes += body();
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    auto allocs = allocations.load() - allocBefore;
+    std::cout << std::left << std::setw(24) << name
+              << " ns/event: " << std::setw(8) << ns / iterations
+              << " allocs/event: " << std::setw(8) << static_cast<double>(allocs) / iterations
+              << " bytes/event: " << bytes / iterations << std::endl;
+}
+
+// Compares the legacy stringstream/operator<< formatting with EventSerializer
+void benchSerializer() {
+    constexpr size_t iterations = 200000;
+    static constexpr char cmdline[] = "/usr/lib/gcc/x86_64-linux-gnu/12/cc1plus\0-quiet\0main.cpp"; // NUL separated as in /proc
+    SudoMonitor::ProcessData pd(getpid(), getppid());
+    const std::pair<const char*, std::string> props[] = {
+        {"pid", std::to_string(pd.pid)}, {"comm", "(cc1plus)"}, {"state", "R"},
+        {"ppid", std::to_string(pd.ppid)}, {"utime", "1234"}, {"stime", "56"},
+        {"vsize", "104857600"}, {"rss", "25600"}, {"num_threads", "1"},
+        {"cmdline", std::string(cmdline, sizeof(cmdline))}};
+    for (const auto& [name, value] : props)
+        pd.set(name, value);
+
+    std::cout << "Serializer benchmark, " << iterations << " events" << std::endl;
+    runBenchmark("stringstream", iterations, [&] {
+        std::stringstream ss;
+        SudoMonitor::logPrefix(ss) << "Process: " << pd.pid << "; Event: " << SudoMonitor::Created
+                                   << "; Props: " << pd << std::endl;
+        return ss.str().size();
+    });
+    SudoMonitor::EventSerializer json;
+    runBenchmark("EventSerializer NDJSON", iterations, [&] {
+        return json.serialize(pd, SudoMonitor::Created).size();
+    });
+    SudoMonitor::EventSerializer binary(SudoMonitor::EventSerializer::Format::BINARY);
+    runBenchmark("EventSerializer BINARY", iterations, [&] {
+        return binary.serialize(pd, SudoMonitor::Created).size();
+    });
+}
+
+// Brute force burst: failed attempts from many (user, tty) sources at 10k events per simulated second,
+// with a successful sudo every 1000 events, in a 2s correlation window
+void benchCorrelation() {
+    constexpr size_t iterations = 1000000;
+    constexpr size_t sources = 50000;
+    size_t sessions = 0, expired = 0;
+    SudoMonitor::SessionCorrelator correlator([&](const auto&) { ++sessions; }, [&](const auto&) { ++expired; },
+                                              std::chrono::milliseconds(2000));
+    std::vector<std::string> users, ttys;
+    for (size_t i = 0; i < sources; ++i) {
+        users.push_back("user" + std::to_string(i % 500));
+        ttys.push_back("/dev/pts/" + std::to_string(i));
+    }
+    auto now = std::chrono::steady_clock::now();
+    size_t i = 0;
+    std::cout << "Correlation benchmark, " << iterations << " PAM events from " << sources << " sources" << std::endl;
+    runBenchmark("SessionCorrelator", iterations, [&] {
+        auto source = (i * 7919) % sources;
+        auto pid = static_cast<pid_t>(100000 + i % 30000);
+        now += std::chrono::microseconds(100);
+        SudoMonitor::AuthEvent event;
+        event.type = i % 1000 == 999 ? SudoMonitor::AuthEvent::Type::Success : SudoMonitor::AuthEvent::Type::Attempt;
+        event.user = users[source];
+        event.tty = ttys[source];
+        event.pid = pid;
+        event.ppid = static_cast<pid_t>(source + 2);
+        correlator.authEvent(event, now);
+        if (event.type == SudoMonitor::AuthEvent::Type::Success)
+            correlator.sessionStarted({pid, event.ppid, event.user, event.tty}, now);
+        correlator.advance(now);
+        ++i;
+        return size_t(0);
+    });
+    auto m = correlator.metrics();
+    std::cout << "sessions: " << sessions << " matched: " << m.matched << " expired with failures: " << expired
+              << " live histories: " << m.entries << " dropped: " << m.dropped << std::endl;
+}
+
+// An in-memory process table standing in for /proc, so the monitor can be driven through many more
+// processes than the sandbox could fork. Time only moves through advance().
+class ChurnProcSource : public SudoMonitor::ProcSource {
+public:
+    void advance(std::chrono::milliseconds ms) { _now += ms; }
+    Clock::time_point now() override { return _now; }
+    pid_t spawn(pid_t ppid, const char* comm) {
+        auto pid = _nextPid++;
+        load(pid, ppid, comm);
+        return pid;
+    }
+    void exec(pid_t pid, const char* comm) { load(pid, _procs.at(pid).ppid, comm); }
+    void exit(pid_t pid) { _procs.erase(pid); }
+
+    std::string readFile(pid_t pid, const char* name) override {
+        auto it = _procs.find(pid);
+        if (it == _procs.end())
+            return {};
+        if (!strcmp(name, "stat"))
+            return it->second.stat;
+        if (!strcmp(name, "cmdline"))
+            return it->second.cmdline;
+        if (!strcmp(name, "status"))
+            return "Uid:\t1000\t1000\t1000\t1000\nGid:\t1000\t1000\t1000\t1000\nCapPrm:\t0000000000000000\n";
+        if (!strcmp(name, "io"))
+            return "rchar: 4096\nwchar: 512\nread_bytes: 0\nwrite_bytes: 4096\n";
+        if (!strcmp(name, "cgroup"))
+            return "0::/user.slice/user-1000.slice\n";
+        return {};
+    }
+    std::string readLink(pid_t pid, const char* name) override {
+        return _procs.count(pid) ? (strcmp(name, "exe") ? "/home/user/src" : "/usr/bin/cc1plus") : "";
+    }
+    int countDirEntries(pid_t pid, const char*) override { return _procs.count(pid) ? 8 : -1; }
+    std::vector<pid_t> listPids() override {
+        std::vector<pid_t> pids;
+        pids.reserve(_procs.size());
+        for (const auto& proc : _procs)
+            pids.push_back(proc.first);
+        return pids;
+    }
+    bool isAlive(pid_t pid) override { return _procs.count(pid) > 0; }
+
+private:
+    void load(pid_t pid, pid_t ppid, const char* comm) {
+        char stat[256];
+        snprintf(stat, sizeof(stat), "%d (%s) R %d %d %d 0 -1 4194304 120 0 0 0 12 3 0 0 20 0 1 0 5000 104857600 2560",
+                 pid, comm, ppid, ppid, ppid);
+        _procs[pid] = {ppid, stat, std::string("/usr/bin/") + comm + std::string("\0-c\0main.cpp", 12)};
+    }
+
+    struct Proc {
+        pid_t ppid;
+        std::string stat, cmdline;
+    };
+    std::map<pid_t, Proc> _procs;
+    pid_t _nextPid = 1000;
+    Clock::time_point _now = Clock::now();
+};
+
+long rssKb() {
+    long pages = 0, resident = 0;
+    std::ifstream("/proc/self/statm") >> pages >> resident;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Daemon RSS through 1M (or N) short-lived processes: sessions of a make spawning one-tick compiler waves,
+// then a wide session held at once, with the default memory cap and with a small one
+void benchArena(const std::vector<std::string>& args) {
+    size_t total = args.empty() ? 1000000 : std::stoul(args[0]);
+    constexpr size_t perSession = 10000;
+    constexpr size_t wave = 8;
+    constexpr size_t wide = 2000;
+    auto source = std::make_shared<ChurnProcSource>();
+    size_t events = 0;
+    SudoMonitor::SessionTotals last;
+    auto onEvent = [&](const SudoMonitor::ProcessData& pd, SudoMonitor::ProcStatEvent) {
+        ++events;
+        if (pd.session)
+            last = *pd.session;
+    };
+    auto runSession = [&](SudoMonitor::ProcTreeMonitor& monitor, size_t processes, size_t width) {
+        auto root = source->spawn(1, "sudo");
+        monitor.addRootProc(root);
+        auto make = source->spawn(root, "make");
+        std::vector<pid_t> live;
+        for (size_t n = 0; n < processes; n += width) {
+            for (auto pid : live)
+                source->exit(pid);
+            live.clear();
+            for (size_t i = 0; i < width; ++i)
+                live.push_back(source->spawn(make, "cc1plus"));
+            source->advance(std::chrono::milliseconds(10));
+            monitor.syncOnce();
+        }
+        for (auto pid : live)
+            source->exit(pid);
+        source->exit(make);
+        source->exit(root);
+        monitor.rootProcDied(root);
+        monitor.syncOnce();
+        monitor.syncOnce();
+    };
+    auto report = [&](const char* name, long before, long peak, double seconds) {
+        std::cout << std::left << std::setw(22) << name << std::right
+                  << " rss before: " << std::setw(7) << before << " KiB, peak: " << std::setw(7) << peak
+                  << " KiB, after: " << std::setw(7) << rssKb() << " KiB, arena peak: " << std::setw(8)
+                  << last.arenaPeakBytes << " B, untracked: " << last.untracked << ", degraded: " << last.degraded
+                  << ", " << seconds << " s" << std::endl;
+    };
+
+    SudoMonitor::MonitorOptions options;
+    options.source = source;
+    SudoMonitor::ProcTreeMonitor monitor(onEvent, options);
+    runSession(monitor, wave, wave); // warm-up, the scan buffers and the allocator settle
+    auto baseline = rssKb();
+    long peak = baseline;
+    auto start = std::chrono::steady_clock::now();
+    std::cout << "Arena benchmark, " << total << " short-lived processes in sessions of " << perSession << std::endl;
+    for (size_t done = 0; done < total; done += perSession) {
+        runSession(monitor, std::min(perSession, total - done), wave);
+        peak = std::max(peak, rssKb());
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "events: " << events << std::endl;
+    report("churn", baseline, peak, elapsed.count());
+
+    auto runWide = [&](const char* name, SudoMonitor::ProcTreeMonitor& wideMonitor) {
+        auto before = rssKb();
+        auto t0 = std::chrono::steady_clock::now();
+        auto root = source->spawn(1, "sudo");
+        wideMonitor.addRootProc(root);
+        auto make = source->spawn(root, "make");
+        std::vector<pid_t> live;
+        for (size_t i = 0; i < wide; ++i)
+            live.push_back(source->spawn(make, "cc1plus"));
+        wideMonitor.syncOnce();
+        auto held = rssKb();
+        for (auto pid : live)
+            source->exit(pid);
+        source->exit(make);
+        source->exit(root);
+        wideMonitor.rootProcDied(root);
+        wideMonitor.syncOnce();
+        wideMonitor.syncOnce();
+        report(name, before, held, std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+    };
+    runWide("wide (2000 live)", monitor);
+    runWide("wide, again", monitor); // what stays after the first one is malloc keeping the scan buffers
+    options.sessionMemoryCap = 256 << 10;
+    SudoMonitor::ProcTreeMonitor capped(onEvent, options);
+    runWide("wide, 256 KiB cap", capped);
+}
+
+// Scenario check: a mismatch fails the mode, so the simulator exits non-zero
+void expectCount(const std::string& what, uint64_t got, uint64_t want) {
+    if (got != want)
+        throw std::runtime_error(what + ": " + std::to_string(got) + ", expected " + std::to_string(want));
+}
+
+// A make -j12 session: 12 s of compiler waves (4 new cc1plus every 10 ms, each living 30 ms, an `as` every 100 ms),
+// then one child every 500 ms. connector: the children are also reported as connector Fork/Exec/Exit events, forked
+// as make and exec'ing their compiler, as the kernel does. Returns the bursts.
+uint64_t runBurst(const char* name, const SudoMonitor::BurstPolicy& policy, bool print, bool connector) {
+    // sudo, make, 4 cc1plus per tick for 1200 ticks with an `as` every 10th, then one child every 50 ticks for 300
+    constexpr uint64_t processes = 2 + 1200 * 4 + 120 + 6;
+    auto source = std::make_shared<ChurnProcSource>();
+    std::map<std::string, size_t> counts;
+    uint64_t spawned = 0, exited = 0, execs = 0;
+    std::map<std::string, std::string> lastState; // burst_comm -> burst_state of its last summary
+    SudoMonitor::EventSerializer serializer;
+    SudoMonitor::MonitorOptions options;
+    options.source = source;
+    options.bursts = policy;
+    SudoMonitor::ProcTreeMonitor monitor([&](const SudoMonitor::ProcessData& pd, SudoMonitor::ProcStatEvent event) {
+        ++counts[SudoMonitor::procStatEventName(event)];
+        execs += event == SudoMonitor::ProcStatEvent::Exec;
+        if (event != SudoMonitor::ProcStatEvent::Summary)
+            return;
+        std::string comm;
+        pd.forEachProp([&](std::string_view prop, std::string_view value) {
+            if (prop == "burst_children")
+                spawned += std::stoull(std::string(value));
+            else if (prop == "burst_exited")
+                exited += std::stoull(std::string(value));
+            else if (prop == "burst_comm")
+                comm = value;
+            else if (prop == "burst_state")
+                lastState[comm] = value;
+        });
+        if (print) {
+            auto record = serializer.serialize(pd, event);
+            std::cout << "  " << record;
+        }
+    }, options);
+    auto root = source->spawn(1, "sudo");
+    monitor.addRootProc(root);
+    auto make = source->spawn(root, "make");
+    monitor.syncOnce(); // make is tracked before the connector reports its children
+    auto inject = [&](SudoMonitor::ProcEvent::Type type, pid_t pid) {
+        SudoMonitor::ProcEvent event;
+        event.type = type;
+        event.pid = pid;
+        event.ppid = make;
+        monitor.injectProcEvent(event);
+    };
+    auto spawn = [&](const char* comm) {
+        if (!connector)
+            return source->spawn(make, comm);
+        auto pid = source->spawn(make, "make");
+        inject(SudoMonitor::ProcEvent::Fork, pid);
+        source->exec(pid, comm);
+        inject(SudoMonitor::ProcEvent::Exec, pid);
+        return pid;
+    };
+    auto exit = [&](pid_t pid) {
+        if (connector)
+            inject(SudoMonitor::ProcEvent::Exit, pid);
+        source->exit(pid);
+    };
+    std::vector<std::vector<pid_t>> waves(3);
+    auto tick = [&](size_t i, size_t compilers, bool as) {
+        auto& wave = waves[i % waves.size()];
+        for (auto pid : wave)
+            exit(pid);
+        wave.clear();
+        for (size_t c = 0; c < compilers; ++c)
+            wave.push_back(spawn("cc1plus"));
+        if (as)
+            wave.push_back(spawn("as"));
+        source->advance(std::chrono::milliseconds(10));
+        monitor.syncOnce();
+    };
+    size_t i = 0;
+    for (; i < 1200; ++i)
+        tick(i, 4, i % 10 == 0);
+    for (size_t end = i + 300; i < end; ++i)
+        tick(i, i % 50 == 0, false);
+    for (auto& wave : waves) {
+        for (auto pid : wave)
+            exit(pid);
+    }
+    source->exit(make);
+    source->exit(root);
+    monitor.rootProcDied(root);
+    monitor.syncOnce();
+    monitor.syncOnce();
+    auto m = monitor.burstMetrics();
+    std::cout << name << ":";
+    for (const auto& [event, count] : counts)
+        std::cout << " " << event << "=" << count;
+    std::cout << " (bursts: " << m.bursts << ", folded events: " << m.folded << ")" << std::endl;
+
+    // every process is reported once, on its own or in a summary, and every burst has ended
+    std::string prefix = std::string(name) + ": ";
+    expectCount(prefix + "Died", counts["Died"], counts["Created"]);
+    expectCount(prefix + "Removed", counts["Removed"], counts["Created"]);
+    expectCount(prefix + "processes", counts["Created"] + spawned, processes);
+    expectCount(prefix + "exits", counts["Died"] + exited, processes);
+    expectCount(prefix + "active bursts", m.active, 0);
+    for (const auto& [comm, state] : lastState)
+        expectCount(prefix + comm + " summaries not ended", state != "ended", 0);
+    if (connector) { // every exec is reported, folded or not, and the summaries name the exec'd comm
+        expectCount(prefix + "compiler execs", execs, processes - 2);
+        expectCount(prefix + "summaries of (make)", lastState.count("(make)"), 0);
+    }
+    return m.bursts;
+}
+
+void simulateBurst(bool connector) {
+    SudoMonitor::BurstPolicy off;
+    off.enterChildren = 0;
+    expectCount("aggregation off: bursts", runBurst("aggregation off", off, false, connector), 0);
+    expectCount("aggregation on: bursts", runBurst("aggregation on", SudoMonitor::BurstPolicy(), true, connector), 1);
+}
 
-    // simulatePAM();
-    // simulateSudo();
-    simulateSendMsg();
+// shortlived [N] [GAP_MS]: N children of this process, each exec'ing /bin/true and reaped at once, so most live
+// less than a tree pass, GAP_MS apart (0: back to back). Run with the connector events and with the tree passes
+// only, and report the kernel to callback latency of each event (the proc connector needs root).
+void simulateShortLived(const std::vector<std::string>& args) {
+    size_t count = args.empty() ? 200 : std::stoul(args[0]);
+    int gapMs = args.size() > 1 ? std::stoi(args[1]) : 2;
+    auto run = [count, gapMs](const char* name, bool procEvents) {
+        std::mutex mtx;
+        std::map<std::string, size_t> counts;
+        size_t execCmdline = 0, exitCode = 0;
+        std::array<SudoMonitor::LatencyHistogram, 3> latency; // fork, exec, exit
+        SudoMonitor::MonitorOptions options;
+        options.procEvents = procEvents;
+        options.bursts.enterChildren = 0;
+        options.spans.kernel = [&](pid_t, SudoMonitor::ProcStatEvent event, uint64_t kernelNs) {
+            auto now = SudoMonitor::LatencyTracer::nowNs();
+            std::lock_guard<std::mutex> lock(mtx);
+            latency[event == SudoMonitor::Created ? 0 : event == SudoMonitor::Exec ? 1 : 2].record(now - kernelNs);
+        };
+        {
+            SudoMonitor::ProcTreeMonitor monitor([&](const SudoMonitor::ProcessData& pd, SudoMonitor::ProcStatEvent event) {
+                if (pd.ppid != getpid())
+                    return;
+                std::lock_guard<std::mutex> lock(mtx);
+                ++counts[SudoMonitor::procStatEventName(event)];
+                if (event == SudoMonitor::Exec && pd.cmdline.view().rfind("/bin/true", 0) == 0)
+                    ++execCmdline;
+                if (event == SudoMonitor::Died && pd.props.count("exit_code"))
+                    ++exitCode;
+            }, options);
+            monitor.run();
+            monitor.addRootProc(getpid());
+            SLEEP_MS(100); // connector subscription
+            for (size_t i = 0; i < count; ++i) {
+                pid_t pid = fork();
+                if (pid == 0) {
+                    execl("/bin/true", "/bin/true", nullptr);
+                    _exit(127);
+                }
+                waitpid(pid, nullptr, 0);
+                SLEEP_MS(gapMs);
+            }
+            SLEEP_MS(100);
+        }
+        std::cout << name << ":";
+        for (const auto& [event, n] : counts)
+            std::cout << " " << event << "=" << n;
+        std::cout << " (exec cmdline: " << execCmdline << ", exit_code: " << exitCode << ")" << std::endl;
+        const char* stages[] = {"fork", "exec", "exit"};
+        for (size_t i = 0; i < latency.size(); ++i) {
+            if (latency[i].count())
+                std::cout << "  kernel " << stages[i] << " -> callback: p50 " << latency[i].quantile(0.5) / 1000
+                          << " us, p99 " << latency[i].quantile(0.99) / 1000 << " us, max " << latency[i].max() / 1000
+                          << " us (" << latency[i].count() << ")" << std::endl;
+        }
+        // the tree passes miss some of these children but must keep the events they see paired; the connector must
+        // see all of them with their exit code (the cmdline is only reported: /bin/true may be gone before it is read)
+        std::string prefix = std::string(name) + ": ";
+        expectCount(prefix + "Removed", counts["Removed"], counts["Created"]);
+        expectCount(prefix + "Died", counts["Died"], counts["Created"]);
+        if (procEvents) {
+            expectCount(prefix + "Created", counts["Created"], count);
+            expectCount(prefix + "Exec", counts["Exec"], count);
+            expectCount(prefix + "exit_code", exitCode, count);
+        }
+    };
+    std::cout << count << " children exec'ing /bin/true, " << gapMs << " ms apart" << std::endl;
+    run("tree passes only", false);
+    run("connector events", true);
+}
+
+// cgroup [BASE]: a session whose child double-forks, the middle process exiting at once, so the grandchild is
+// reparented out of the session's process tree. With the connector events off only the cgroup leaf (under BASE, default
+// /sys/fs/cgroup/unified/sudo_monitor_sim) can find it: it must be reported, marked reparented. Needs root and cgroup v2.
+void simulateCgroup(const std::vector<std::string>& args) {
+    std::string base = args.empty() ? "/sys/fs/cgroup/unified/sudo_monitor_sim" : args[0];
+    int go[2], info[2];
+    if (pipe(go) < 0 || pipe(info) < 0)
+        throw std::runtime_error("pipe failed");
+    char byte = 0;
+    pid_t root = fork();
+    if (root == 0) {
+        if (read(go[0], &byte, 1) != 1)
+            _exit(1);
+        pid_t middle = fork();
+        if (middle == 0) {
+            pid_t grandchild = fork();
+            if (grandchild == 0) {
+                execl("/bin/sleep", "sleep", "5", nullptr);
+                _exit(127);
+            }
+            _exit(write(info[1], &grandchild, sizeof(grandchild)) == sizeof(grandchild) ? 0 : 1);
+        }
+        waitpid(middle, nullptr, 0);
+        _exit(read(go[0], &byte, 1) == 1 ? 0 : 1);
+    }
+
+    std::mutex mtx;
+    std::map<pid_t, bool> created; // pid -> reparented
+    SudoMonitor::MonitorOptions options;
+    options.cgroups = true;
+    options.cgroupBase = base;
+    options.procEvents = false;
+    options.bursts.enterChildren = 0;
+    pid_t grandchild = 0;
+    std::string error;
+    {
+        SudoMonitor::ProcTreeMonitor monitor([&](const SudoMonitor::ProcessData& pd, SudoMonitor::ProcStatEvent event) {
+            if (event != SudoMonitor::Created)
+                return;
+            std::lock_guard<std::mutex> lock(mtx);
+            created[pd.pid] = pd.props.count("reparented") > 0;
+        }, options);
+        monitor.run();
+        monitor.addRootProc(root);
+        SLEEP_MS(100);
+        auto leaf = "session-" + std::to_string(root);
+        if (SudoMonitor::readProcFile(root, "cgroup").find(leaf) == std::string::npos)
+            error = "cgroup: session not moved into " + base + "/" + leaf + " (needs root and cgroup v2)";
+        if (write(go[1], &byte, 1) != 1 || read(info[0], &grandchild, sizeof(grandchild)) != sizeof(grandchild))
+            error = "cgroup: the session did not fork";
+        SLEEP_MS(300);
+        if (write(go[1], &byte, 1) != 1)
+            error = "cgroup: the session did not end";
+        waitpid(root, nullptr, 0);
+        if (grandchild > 0)
+            kill(grandchild, SIGKILL);
+        monitor.rootProcDied(root);
+        SLEEP_MS(300);
+    }
+    for (int fd : {go[0], go[1], info[0], info[1]})
+        close(fd);
+    if (!error.empty())
+        throw std::runtime_error(error);
+    std::cout << "session " << root << ", double-forked " << grandchild << ":";
+    auto found = created.find(grandchild);
+    std::cout << (found == created.end() ? " not reported" : found->second ? " reported, reparented" : " reported")
+              << std::endl;
+    expectCount("cgroup: double-forked child reported", found != created.end(), 1);
+    expectCount("cgroup: double-forked child reparented", found != created.end() && found->second, 1);
+}
+
+// Full /proc scan for the children of one parent: the former path (readdir, one stat read, istringstream split and
+// std::to_string compare per process) against listPids (getdents64) + readStats (ppid rejected early, worker pool).
+// Runs on a synthetic tree of N processes (default 100k) in /dev/shm, then on the live /proc.
+void benchScan(const std::vector<std::string>& args) {
+    size_t count = args.empty() ? 100000 : std::stoul(args[0]);
+    const std::string root = "/dev/shm/sudo_monitor_scan";
+    constexpr pid_t target = 2;
+    std::cout << "Building " << count << " synthetic processes under " << root << std::endl;
+    mkdir(root.c_str(), 0755);
+    for (pid_t pid = 2; pid < static_cast<pid_t>(count) + 2; ++pid) {
+        auto dir = root + "/" + std::to_string(pid);
+        mkdir(dir.c_str(), 0755);
+        std::ofstream(dir + "/stat") << pid << " (cc1plus) S " << (pid % 1000 ? 1 : target)
+                                     << " 1 1 0 -1 4194304 120 0 0 0 12 3 0 0 20 0 1 0 5000 104857600 2560 "
+                                        "18446744073709551615 1 1 0 0 0 0 0 0 0 0 0 0 17 0 0 0 0 0 0\n";
+    }
+    auto legacy = [](const char* procRoot, pid_t ppid) {
+        size_t matches = 0;
+        DIR* dir = opendir(procRoot);
+        std::vector<pid_t> pids;
+        while (auto entry = readdir(dir)) {
+            if (isdigit(entry->d_name[0]))
+                pids.push_back(static_cast<pid_t>(atoi(entry->d_name)));
+        }
+        closedir(dir);
+        for (auto pid : pids) {
+            std::istringstream tokens(SudoMonitor::readProcFile(pid, "stat", procRoot));
+            std::vector<std::string> props;
+            std::string token;
+            bool match = true;
+            while (std::getline(tokens, token, ' ')) {
+                if (props.size() == 3 && token != std::to_string(ppid)) {
+                    match = false;
+                    break;
+                }
+                props.push_back(token);
+            }
+            matches += match && props.size() > 3;
+        }
+        return matches;
+    };
+    auto bulk = [](SudoMonitor::ProcSource& source, pid_t ppid) {
+        static std::vector<pid_t> ppids;
+        static std::vector<std::string> lines;
+        auto pids = source.listPids();
+        source.readStats(pids, {ppid}, ppids, lines);
+        return static_cast<size_t>(std::count_if(lines.begin(), lines.end(), [](auto& l) { return !l.empty(); }));
+    };
+    auto time = [](const char* name, size_t processes, auto&& scan) {
+        std::vector<double> ms;
+        size_t matches = 0;
+        for (int i = 0; i < 7; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            matches = scan();
+            ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        }
+        std::sort(ms.begin(), ms.end());
+        std::cout << "  " << std::left << std::setw(34) << name << std::right << " processes: " << std::setw(7)
+                  << processes << " matches: " << std::setw(4) << matches << " median ms: " << std::setw(8)
+                  << ms[ms.size() / 2] << " min ms: " << ms.front() << std::endl;
+    };
+    std::cout << "Full scan benchmark (" << std::thread::hardware_concurrency() << " cpus, up to "
+              << SudoMonitor::Config::ProcScanThreads << " helper threads)" << std::endl;
+    auto synthetic = SudoMonitor::procFsSource(root);
+    time("readdir + stat + split (synthetic)", count, [&] { return legacy(root.c_str(), target); });
+    time("getdents64 + readStats (synthetic)", count, [&] { return bulk(*synthetic, target); });
+    auto live = SudoMonitor::liveProcSource();
+    auto liveCount = live->listPids().size();
+    time("readdir + stat + split (/proc)", liveCount, [&] { return legacy("/proc", 1); });
+    time("getdents64 + readStats (/proc)", liveCount, [&] { return bulk(*live, 1); });
+    std::error_code ec;
+    std::filesystem::remove_all(root, ec);
+}
+
+// Stream client under load: RATE records/s (default 100k) of 200 bytes for SECONDS (default 2) against a SERVER
+// read by another thread, with the reader running, stalled for 100 ms, and the server restarted (down for 100 ms).
+// CLIENT is the former fire-and-forget send, QUEUED_CLIENT the ring + writev + reconnect one.
+void benchUds(const std::vector<std::string>& args) {
+    using SudoMonitor::UdsSocket;
+    size_t rate = args.empty() ? 100000 : std::stoul(args[0]);
+    size_t seconds = args.size() > 1 ? std::stoul(args[1]) : 2;
+    const std::string path = "/tmp/sudo_monitor_bench_uds.sock";
+    const std::string record = std::string(199, 'x') + "\n";
+    signal(SIGPIPE, SIG_IGN);
+    auto run = [&](const char* name, UdsSocket::Mode mode, bool stall, bool restart) {
+        std::atomic<size_t> received{0}, torn{0};
+        std::atomic<bool> reading{true}, paused{false};
+        std::mutex serverMtx;
+        std::unique_ptr<UdsSocket> server;
+        auto startServer = [&] {
+            auto s = std::make_unique<UdsSocket>(path, UdsSocket::Mode::SERVER, [&](int, const std::string& msg) {
+                ++(msg.size() == record.size() - 1 ? received : torn);
+            });
+            s->init();
+            std::lock_guard<std::mutex> lock(serverMtx);
+            server = std::move(s);
+        };
+        startServer();
+        std::thread reader([&] {
+            while (reading) {
+                {
+                    std::lock_guard<std::mutex> lock(serverMtx);
+                    if (server && !paused)
+                        server->serverUpdate();
+                }
+                std::this_thread::yield();
+            }
+        });
+        UdsSocket client(path, mode);
+        client.init();
+        const size_t total = rate * seconds, perMs = std::max<size_t>(1, rate / 1000), gap = rate / 10;
+        size_t failed = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < total; ++i) {
+            if (i % perMs == 0) {
+                std::this_thread::sleep_until(start + std::chrono::nanoseconds(i * 1000000000 / rate));
+                client.clientUpdate();
+            }
+            if (stall && (i == total / 2 || i == total / 2 + gap))
+                paused = i == total / 2;
+            if (restart && i == total / 2) {
+                std::lock_guard<std::mutex> lock(serverMtx);
+                server.reset();
+            }
+            if (restart && i == total / 2 + gap)
+                startServer();
+            failed += !client.clientSend(record);
+        }
+        auto sendSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        client.clientFlush(std::chrono::milliseconds(2000));
+        SLEEP_MS(200);
+        reading = false;
+        reader.join();
+        server.reset();
+        std::cout << "  " << std::left << std::setw(28) << name << std::right << " send failed: " << std::setw(7) << failed
+                  << " received: " << std::setw(7) << received << " torn: " << std::setw(4) << torn << " lost: "
+                  << std::setw(7) << total - received << " (" << std::fixed << std::setprecision(2) << sendSeconds
+                  << " s)" << std::defaultfloat << std::endl;
+        if (mode == UdsSocket::Mode::QUEUED_CLIENT) {
+            auto stats = client.clientStats();
+            // every accepted message is sent, cut by a disconnect or still queued
+            bool accounted = stats.queued + failed == total &&
+                             (stats.queueBytes > 0 || stats.queued == stats.sent + stats.dropped - failed);
+            std::cout << "      queued: " << stats.queued << " sent: " << stats.sent << " dropped: " << stats.dropped
+                      << " writes: " << stats.writes << " (" << (stats.writes ? stats.sent / stats.writes : 0)
+                      << " msgs/write) partial: " << stats.partialWrites << " would block: " << stats.wouldBlock
+                      << " connects: " << stats.connects << " left: " << stats.queueBytes << " bytes, counters "
+                      << (accounted ? "consistent" : "INCONSISTENT") << std::endl;
+        }
+    };
+    std::cout << rate << " records/s of " << record.size() << " bytes for " << seconds << " s" << std::endl;
+    for (auto [scenario, stall, restart] : {std::tuple{"reader running", false, false},
+                                            std::tuple{"reader stalled 100 ms", true, false},
+                                            std::tuple{"server restarted", false, true}}) {
+        std::cout << scenario << std::endl;
+        run("CLIENT", UdsSocket::Mode::CLIENT, stall, restart);
+        run("QUEUED_CLIENT", UdsSocket::Mode::QUEUED_CLIENT, stall, restart);
+    }
+    unlink(path.c_str());
+}
+
+// Forwarding path on one machine: N records (default 200k) at RATE/s (default 50k) through an UpstreamForwarder to a
+// ./sudo_collector child, which is killed (SIGKILL) at a third of the run and started again at two thirds.
+// Checks that every record reaches the collector output once the spool drained.
+void simulateUpstream(const std::vector<std::string>& args) {
+    size_t count = args.empty() ? 200000 : std::stoul(args[0]);
+    size_t rate = args.size() > 1 ? std::stoul(args[1]) : 50000;
+    const std::string port = "17514", out = "/tmp/sudo_collector_sim.ndjson", spool = "/tmp/sudo_monitor_sim_spool";
+    unlink(out.c_str());
+    std::error_code ec;
+    std::filesystem::remove_all(spool, ec);
+    auto startCollector = [&] {
+        pid_t pid = fork();
+        if (pid == 0) {
+            execl("./sudo_collector", "./sudo_collector", "--port", port.c_str(), "--bind", "127.0.0.1",
+                  "--out", out.c_str(), nullptr);
+            _exit(127);
+        }
+        return pid;
+    };
+    auto collector = startCollector();
+    SudoMonitor::UpstreamOptions options;
+    options.host = "127.0.0.1";
+    options.port = port;
+    options.spoolDir = spool;
+    options.hostName = "simulated-host";
+    SudoMonitor::UpstreamForwarder forwarder(options);
+    if (!forwarder.init())
+        throw std::runtime_error("upstream: cannot create the spool " + spool);
+
+    static constexpr char cmdline[] = "/usr/lib/gcc/x86_64-linux-gnu/12/cc1plus\0-quiet\0main.cpp";
+    SudoMonitor::ProcessData pd(0, getpid());
+    for (const auto& [name, value] : {std::pair<const char*, std::string>{"comm", "(cc1plus)"}, {"state", "R"},
+                                      {"utime", "1234"}, {"stime", "56"}, {"vsize", "104857600"}, {"rss", "25600"},
+                                      {"cmdline", std::string(cmdline, sizeof(cmdline))}})
+        pd.set(name, value);
+    SudoMonitor::EventSerializer serializer;
+    size_t peakSpool = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        if (i % 1000 == 0) {
+            std::this_thread::sleep_until(start + std::chrono::nanoseconds(i * 1000000000 / rate));
+            peakSpool = std::max<size_t>(peakSpool, forwarder.metrics().spoolBytes);
+        }
+        if (i == count / 3) {
+            kill(collector, SIGKILL);
+            waitpid(collector, nullptr, 0);
+            std::cout << "-> collector killed at record " << i << std::endl;
+        }
+        if (i == 2 * count / 3) {
+            collector = startCollector();
+            std::cout << "-> collector restarted at record " << i << std::endl;
+        }
+        pd.pid = static_cast<pid_t>(i + 1);
+        forwarder.publish(serializer.serialize(pd, SudoMonitor::Created));
+    }
+    // the last batch is sealed by age, then the spool drains
+    SLEEP_MS(SudoMonitor::Config::UpstreamBatchMs + 100);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+    auto m = forwarder.metrics();
+    while (m.spooled > 0 && std::chrono::steady_clock::now() < deadline) {
+        SLEEP_MS(100);
+        m = forwarder.metrics();
+    }
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    kill(collector, SIGTERM);
+    waitpid(collector, nullptr, 0);
+
+    std::ifstream in(out);
+    std::string line;
+    size_t lines = 0;
+    std::vector<bool> seen(count + 1);
+    size_t distinct = 0;
+    while (std::getline(in, line)) {
+        ++lines;
+        auto at = line.find("\"pid\":");
+        size_t pid = at == std::string::npos ? 0 : std::stoul(line.substr(at + 6));
+        if (pid > 0 && pid <= count && !seen[pid]) {
+            seen[pid] = true;
+            ++distinct;
+        }
+    }
+    std::cout << "Published " << m.events << " records in " << m.batches << " batches, " << m.rawBytes << " bytes -> "
+              << m.compressedBytes << " compressed (" << std::fixed << std::setprecision(1)
+              << (m.compressedBytes ? static_cast<double>(m.rawBytes) / m.compressedBytes : 0) << "x)"
+              << std::defaultfloat << std::endl
+              << "Acked " << m.acked << " batches over " << m.connects << " connections, spool peak " << peakSpool
+              << " bytes, dropped " << m.droppedEvents << " records, drained after " << seconds << " s" << std::endl
+              << "Collector wrote " << lines << " records, " << distinct << " distinct, " << count - distinct
+              << " missing" << std::endl;
+    std::filesystem::remove_all(spool, ec);
+}
+
+// Self-profiling overhead: tree passes over a synthetic /proc tree of N processes (default 5000, 4 children per
+// parent, in /dev/shm), alternating single passes with the profiler disabled and enabled, plus the cost of one scope.
+// Prints the folded stacks.
+void benchProfile(const std::vector<std::string>& args) {
+    size_t count = args.empty() ? 5000 : std::stoul(args[0]);
+    constexpr size_t passes = 100;
+    const std::string root = "/dev/shm/sudo_monitor_profile";
+    mkdir(root.c_str(), 0755);
+    for (pid_t pid = 2; pid < static_cast<pid_t>(count) + 2; ++pid) {
+        auto dir = root + "/" + std::to_string(pid);
+        mkdir(dir.c_str(), 0755);
+        std::ofstream(dir + "/stat") << pid << " (cc1plus) S " << (pid == 2 ? 1 : 2 + (pid - 3) / 4)
+                                     << " 1 1 0 -1 4194304 120 0 0 0 12 3 0 0 20 0 1 0 5000 104857600 2560 "
+                                        "18446744073709551615 1 1 0 0 0 0 0 0 0 0 0 0 17 0 0 0 0 0 0\n";
+        std::ofstream(dir + "/cmdline") << "cc1plus" << '\0' << "-quiet" << '\0';
+    }
+    SudoMonitor::MonitorOptions options;
+    options.source = SudoMonitor::procFsSource(root);
+    size_t events = 0;
+    SudoMonitor::ProcTreeMonitor monitor([&](const SudoMonitor::ProcessData&, SudoMonitor::ProcStatEvent) { ++events; },
+                                         options);
+    monitor.addRootProc(2);
+    monitor.syncOnce();
+    auto cpuMs = [] {
+        timespec ts{};
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+    };
+    auto pass = [&] { // thread CPU time, less exposed to the other load of the machine than wall time
+        auto start = cpuMs();
+        monitor.syncOnce();
+        return cpuMs() - start;
+    };
+    std::cout << "Self-profiling overhead, " << count << " processes (" << events << " events), " << passes
+              << " passes each" << std::endl;
+    SudoMonitor::SelfProfiler::enable();
+    SudoMonitor::SelfProfiler::nameThread("bench", false);
+    double disabled = 0, enabled = 0;
+    for (size_t i = 0; i < 2 * passes; ++i) {
+        // the order alternates, the pass after another one is not the same pass
+        bool on = i % 4 == 0 || i % 4 == 3;
+        on ? SudoMonitor::SelfProfiler::enable() : SudoMonitor::SelfProfiler::disable();
+        (on ? enabled : disabled) += pass() / passes;
+    }
+    SudoMonitor::SelfProfiler::enable();
+    std::cout << "  pass CPU ms, disabled: " << disabled << " enabled: " << enabled << " overhead: " << std::fixed
+              << std::setprecision(2) << (enabled - disabled) * 100 / disabled << "%" << std::defaultfloat << std::endl;
+    constexpr size_t scopes = 1000000;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < scopes; ++i) {
+        SudoMonitor::ProfileScope outer(SudoMonitor::ProfilePoint::ParseSudoMsg);
+        asm volatile("" ::: "memory");
+    }
+    auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / scopes;
+    start = std::chrono::steady_clock::now();
+    {
+        SudoMonitor::ProfileScope outer(SudoMonitor::ProfilePoint::SyncNode);
+        for (size_t i = 0; i < scopes; ++i) {
+            SudoMonitor::ProfileScope recursive(SudoMonitor::ProfilePoint::SyncNode);
+            asm volatile("" ::: "memory");
+        }
+    }
+    auto mergedNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / scopes;
+    std::cout << "  one enabled scope: " << ns << " ns, recursive (merged) scope: " << mergedNs << " ns" << std::endl
+              << "Folded stacks (us):" << std::endl
+              << SudoMonitor::SelfProfiler::folded();
+    std::error_code ec;
+    std::filesystem::remove_all(root, ec);
+}
+
+static const SudoMonitor::TraceReplayer* replayer = nullptr;
+
+// Runs a trace recorded with `sudo_daemon --record` through a fresh monitor.
+// Record timestamps come from the trace, so two replays of the same trace produce identical output.
+void replayTrace(const std::vector<std::string>& args) {
+    if (args.empty())
+        throw std::runtime_error("replay: usage: replay TRACE [--realtime] [--out FILE]");
+    bool realtime = false;
+    std::ofstream out;
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i] == "--realtime")
+            realtime = true;
+        else if (args[i] == "--out" && i + 1 < args.size())
+            out.open(args[++i], std::ios::binary);
+    }
+    SudoMonitor::TraceReader reader(args[0]);
+    if (!reader.init())
+        throw std::runtime_error("replay: cannot read trace " + args[0]);
+    auto source = std::make_shared<SudoMonitor::ReplayProcSource>();
+    SudoMonitor::TraceReplayer trace(reader, *source);
+    replayer = &trace;
+
+    SudoMonitor::EventSerializer serializer;
+    serializer.setClock([](timespec& ts) {
+        auto ns = replayer->currentRealtimeNs();
+        ts.tv_sec = ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+    });
+    size_t events = 0;
+    SudoMonitor::MonitorOptions options;
+    options.source = source;
+    SudoMonitor::ProcTreeMonitor monitor([&](const SudoMonitor::ProcessData& pd, SudoMonitor::ProcStatEvent event) {
+        auto record = serializer.serialize(pd, event);
+        if (out.is_open())
+            out.write(record.data(), static_cast<std::streamsize>(record.size()));
+        ++events;
+    }, options);
+    auto stats = trace.run(monitor, realtime);
+    replayer = nullptr;
+
+    auto seconds = std::chrono::duration<double>(stats.elapsed).count();
+    std::cout << "Replayed " << stats.records << " records (" << stats.ticks << " tree passes, "
+              << stats.events << " connector events) in " << seconds * 1000 << " ms" << std::endl
+              << "Monitor events: " << events << ", " << (seconds > 0 ? events / seconds : 0) << " events/s" << std::endl;
+}
+
+// Interning of comm/cmdline on a recorded workload: SESSIONS concurrent sessions (default 40) running the same few
+// commands are recorded into TRACE (default /tmp/sudo_monitor_intern.trace, reused when it exists), then replayed.
+// Reports the session arena peaks, the heap allocations of the replay and the bytes of the serialized records.
+void benchIntern(const std::vector<std::string>& args) {
+    std::string path = args.empty() ? "/tmp/sudo_monitor_intern.trace" : args[0];
+    size_t sessions = args.size() > 1 ? std::stoul(args[1]) : 40;
+    if (!std::filesystem::exists(path)) {
+        std::cout << "Recording " << sessions << " sessions into " << path << std::endl;
+        SudoMonitor::MonitorOptions options;
+        options.recordPath = path;
+        options.bursts.enterChildren = 0;
+        SudoMonitor::ProcTreeMonitor monitor([](const SudoMonitor::ProcessData&, SudoMonitor::ProcStatEvent) {},
+                                             options);
+        monitor.run();
+        SLEEP_MS(100);
+        // compiler-like command lines: "sh -c CMD NAME ARGS..." shows NAME ARGS in the child's cmdline
+        const char* script = "cc='/bin/sh -c \"sleep 0.4\" /usr/lib/gcc/x86_64-linux-gnu/12/cc1plus -quiet "
+                             "-I/usr/include/c++/12 -D_GNU_SOURCE -O2 -fPIC main.cpp -o /tmp/main.s'; "
+                             "for i in 1 2 3 4 5 6; do eval \"$cc &\"; eval \"$cc &\"; eval \"$cc &\"; "
+                             "cat /dev/null; wait; done";
+        std::vector<pid_t> roots;
+        for (size_t i = 0; i < sessions; ++i) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                execl("/bin/sh", "sh", "-c", script, nullptr);
+                _exit(127);
+            }
+            monitor.addRootProc(pid);
+            roots.push_back(pid);
+        }
+        for (auto pid : roots)
+            waitpid(pid, nullptr, 0);
+        for (auto pid : roots)
+            monitor.rootProcDied(pid);
+        SLEEP_MS(500);
+    }
+    SudoMonitor::TraceReader reader(path);
+    if (!reader.init())
+        throw std::runtime_error("bench_intern: cannot read trace " + path);
+    auto source = std::make_shared<SudoMonitor::ReplayProcSource>();
+    SudoMonitor::TraceReplayer trace(reader, *source);
+    replayer = &trace;
+    SudoMonitor::EventSerializer serializer;
+    serializer.setClock([](timespec& ts) {
+        auto ns = replayer->currentRealtimeNs();
+        ts.tv_sec = ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+    });
+    size_t events = 0, recordBytes = 0, removedSessions = 0;
+    uint64_t arenaPeaks = 0;
+    SudoMonitor::MonitorOptions options;
+    options.source = source;
+    options.bursts.enterChildren = 0;
+    SudoMonitor::ProcTreeMonitor monitor([&](const SudoMonitor::ProcessData& pd, SudoMonitor::ProcStatEvent event) {
+        recordBytes += serializer.serialize(pd, event).size();
+        ++events;
+        if (pd.session) {
+            arenaPeaks += pd.session->arenaPeakBytes;
+            ++removedSessions;
+        }
+    }, options);
+    auto before = allocations.load();
+    auto stats = trace.run(monitor, false);
+    auto heapAllocations = allocations.load() - before;
+    replayer = nullptr;
+
+    std::cout << "Replayed " << stats.ticks << " tree passes, " << stats.events << " connector events: " << events
+              << " records, " << recordBytes << " bytes serialized" << std::endl
+              << "session arena peak: " << (removedSessions ? arenaPeaks / removedSessions : 0) << " bytes per session ("
+              << removedSessions << " sessions), heap allocations: " << heapAllocations << " ("
+              << (events ? heapAllocations / events : 0) << " per record)" << std::endl;
+    auto pool = SudoMonitor::InternPool::instance().metrics();
+    std::cout << "comm/cmdline pool: " << pool.entries << " strings, " << pool.bytes << " bytes; " << pool.lookups
+              << " lookups, " << pool.hits << " hits (" << std::fixed << std::setprecision(1)
+              << (pool.lookups ? 100.0 * pool.hits / pool.lookups : 0) << "%), " << pool.sharedBytes
+              << " bytes shared instead of copied" << std::endl;
+}
+
+// Per-event cost of the monitor callback: the std::function callback doing every step inline, the same steps as a
+// chain of std::function stages composed at run time, and EventPipeline, called directly and behind the single
+// std::function edge the monitor takes. First dispatch only (filter, rate limiter, a counting sink), then with
+// serialization and a record sink, as in the daemon.
+struct BenchSink {
+    uint64_t* bytes;
+    void operator()(std::string_view record) const { *bytes += record.size() + 1; }
+};
+void benchPipeline(const std::vector<std::string>& args) {
+    using namespace SudoMonitor;
+    size_t iterations = args.empty() ? 2000000 : std::stoul(args[0]);
+    ProcessData pd(getpid(), getppid());
+    for (const auto& [name, value] : std::initializer_list<std::pair<const char*, const char*>>{
+             {"comm", "(cc1plus)"}, {"state", "R"}, {"utime", "1234"}, {"stime", "56"}, {"rss", "25600"},
+             {"cmdline", "/usr/lib/gcc/x86_64-linux-gnu/12/cc1plus"}})
+        pd.set(name, value);
+    static constexpr ProcStatEvent events[] = {Created, Exec, Died, Removed}; // Removed filtered out below
+    const uint32_t mask = EventFilter::All & ~EventFilter::bit(Removed);
+    using Callback = ProcTreeMonitor::OnProcStatChange;
+
+    for (bool serialize : {false, true}) {
+        uint64_t bytes = 0; // what the sinks saw, one per event without serialization
+        EventSerializer serializer;
+        auto record = [&](ProcStatEvent event) {
+            return serialize ? serializer.serialize(pd, event) : std::string_view();
+        };
+        auto bench = [&](const char* name, auto&& dispatch) {
+            size_t n = 0;
+            runBenchmark(name, iterations, [&] {
+                auto before = bytes;
+                dispatch(pd, events[n++ & 3]);
+                return bytes - before;
+            });
+        };
+        std::cout << "Pipeline benchmark, " << iterations << " events, "
+                  << (serialize ? "filter, rate limiter, NDJSON, sink" : "filter, rate limiter, counting sink")
+                  << std::endl;
+
+        EventFilter inlineFilter(mask);
+        RateLimiter inlineLimiter(0);
+        Callback callback = [&](const ProcessData& data, ProcStatEvent event) {
+            PipelineEvent e{data, event, {}};
+            inlineFilter(e, [&](PipelineEvent& f) {
+                inlineLimiter(f, [&](PipelineEvent& l) { bytes += record(l.event).size() + 1; });
+            });
+        };
+        bench("std::function callback", callback);
+
+        EventFilter chainFilter(mask);
+        RateLimiter chainLimiter(0);
+        using ChainStage = std::function<bool(PipelineEvent&)>; // false: drop the event
+        std::vector<ChainStage> chain = {
+            [&](PipelineEvent& e) { bool pass = false; chainFilter(e, [&](PipelineEvent&) { pass = true; }); return pass; },
+            [&](PipelineEvent& e) { bool pass = false; chainLimiter(e, [&](PipelineEvent&) { pass = true; }); return pass; },
+            [&](PipelineEvent& e) { e.record = record(e.event); return true; },
+            [&](PipelineEvent& e) { bytes += e.record.size() + 1; return true; }};
+        Callback chained = [&](const ProcessData& data, ProcStatEvent event) {
+            PipelineEvent e{data, event, {}};
+            for (const auto& stage : chain) {
+                if (!stage(e))
+                    break;
+            }
+        };
+        bench("std::function stages", chained);
+
+        auto benchStatic = [&](auto& pipeline) {
+            bench("EventPipeline", [&](const ProcessData& data, ProcStatEvent event) { pipeline(data, event); });
+            Callback edge = [&](const ProcessData& data, ProcStatEvent event) { pipeline(data, event); };
+            bench("EventPipeline, edge", edge);
+        };
+        if (serialize) {
+            EventPipeline<RateLimiter, EventFilter, Serialize, WriteRecord<BenchSink>> pipeline(
+                0u, mask, serializer, BenchSink{&bytes});
+            benchStatic(pipeline);
+        } else {
+            EventPipeline<RateLimiter, EventFilter, WriteRecord<BenchSink>> pipeline(0u, mask, BenchSink{&bytes});
+            benchStatic(pipeline);
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    using Mode = std::function<void(const std::vector<std::string>&)>;
+    static const std::map<std::string, Mode> modes = {
+        {"pam", simulatePAM},
+        {"query", simulateQuery},
+        {"sudo", [](auto&) { simulateSudo(); }},
+        {"send", [](auto&) { simulateSendMsg(); }},
+        {"bench_serializer", [](auto&) { benchSerializer(); }},
+        {"bench_pam", [](auto&) { benchPam(); }},
+        {"bench_pipeline", benchPipeline},
+        {"bench_profile", benchProfile},
+        {"bench_scan", benchScan},
+        {"bench_correlation", [](auto&) { benchCorrelation(); }},
+        {"bench_arena", benchArena},
+        {"bench_intern", benchIntern},
+        {"bench_uds", benchUds},
+        {"burst", [](auto&) { simulateBurst(false); }},
+        {"burst_events", [](auto&) { simulateBurst(true); }},
+        {"shortlived", simulateShortLived},
+        {"cgroup", simulateCgroup},
+        {"upstream", simulateUpstream},
+        {"replay", replayTrace},
+    };
+    std::string mode = argc > 1 ? argv[1] : "send";
+    auto it = modes.find(mode);
+    if (it == modes.end()) {
+        std::cerr << "Usage: " << argv[0] << " [";
+        for (const auto& m : modes)
+            std::cerr << m.first << (m.first == modes.rbegin()->first ? "]" : "|");
+        std::cerr << std::endl;
+        return 1;
+    }
+    std::cout << "Starting Sudo/PAM Plugin Simulator..." << std::endl;
+    try {
+        it->second(std::vector<std::string>(argv + std::min(argc, 2), argv + argc));
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
     std::cout << "Simulation complete." << std::endl;
 
     return 0;
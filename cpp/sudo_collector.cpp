@@ -0,0 +1,221 @@
+// Stand-in central collector: accepts the forwarders of sudo_daemon --upstream HOST:PORT, writes their records as
+// NDJSON with a "host" member and acknowledges each batch once it is written.
+#include "common.h"
+#include "upstream_forwarder.h"
+
+#include <cctype>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <endian.h>
+#include <iostream>
+#include <netdb.h>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+using namespace SudoMonitor;
+
+namespace {
+volatile sig_atomic_t stopping = 0;
+
+struct Connection {
+    int fd;
+    std::string host; // empty until the hello
+    std::string in;
+};
+
+struct Totals {
+    uint64_t connections = 0;
+    uint64_t batches = 0;
+    uint64_t events = 0;
+    uint64_t duplicates = 0; // batches sent again after a lost ack, not written twice
+    uint64_t rawBytes = 0;
+    uint64_t compressedBytes = 0;
+};
+
+int listenOn(const char* bind, const char* port) {
+    struct addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    struct addrinfo* addrs = nullptr;
+    if (getaddrinfo(bind, port, &hints, &addrs) != 0)
+        return -1;
+    int fd = -1;
+    for (auto* ai = addrs; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        int one = 1;
+        if (fd >= 0 && (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+                        ::bind(fd, ai->ai_addr, ai->ai_addrlen) != 0 || listen(fd, SOMAXCONN) != 0)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addrs);
+    return fd;
+}
+
+class Collector {
+public:
+    explicit Collector(FILE* out) : _out(out) {}
+
+    // false: protocol error, the connection is closed
+    bool process(Connection& c) {
+        size_t used = 0;
+        bool ok = true;
+        while (ok) {
+            const char* p = c.in.data() + used;
+            size_t left = c.in.size() - used;
+            if (c.host.empty()) {
+                if (left < UpstreamWire::HelloHeaderBytes)
+                    break;
+                uint32_t magic, len;
+                memcpy(&magic, p, 4);
+                memcpy(&len, p + 4, 4);
+                len = be32toh(len);
+                ok = be32toh(magic) == UpstreamWire::HelloMagic && len > 0 && len < 256;
+                if (!ok || left < UpstreamWire::HelloHeaderBytes + len)
+                    break;
+                for (char ch : std::string_view(p + UpstreamWire::HelloHeaderBytes, len))
+                    c.host += isalnum(static_cast<unsigned char>(ch)) || ch == '.' || ch == '-' || ch == '_' ? ch : '_';
+                used += UpstreamWire::HelloHeaderBytes + len;
+                continue;
+            }
+            UpstreamWire::BatchHeader header;
+            if (left < UpstreamWire::BatchHeader::Bytes)
+                break;
+            ok = header.decode(p);
+            if (!ok || left < UpstreamWire::BatchHeader::Bytes + header.payloadBytes)
+                break;
+            ok = batch(c.host, header, p + UpstreamWire::BatchHeader::Bytes) && ack(c.fd, header.seq);
+            used += UpstreamWire::BatchHeader::Bytes + header.payloadBytes;
+        }
+        c.in.erase(0, used);
+        return ok;
+    }
+    void accepted() { ++_totals.connections; }
+    [[nodiscard]] const Totals& totals() const { return _totals; }
+
+private:
+    bool batch(const std::string& host, const UpstreamWire::BatchHeader& header, const char* payload) {
+        // the forwarder sends a host's batches in sequence order, older ones were already written
+        auto& last = _lastSeq[host];
+        if (header.seq <= last) {
+            ++_totals.duplicates;
+            return true;
+        }
+        if (!UpstreamWire::inflate(payload, header.payloadBytes, header.rawBytes, _raw))
+            return false;
+        size_t begin = 0, end;
+        while ((end = _raw.find('\n', begin)) != std::string::npos) {
+            if (_raw[begin] == '{' && end > begin + 1) {
+                fprintf(_out, "{\"host\":\"%s\",", host.c_str());
+                fwrite(_raw.data() + begin + 1, 1, end - begin, _out);
+            }
+            begin = end + 1;
+        }
+        if (fflush(_out) != 0)
+            return false;
+        last = header.seq;
+        ++_totals.batches;
+        _totals.events += header.events;
+        _totals.rawBytes += header.rawBytes;
+        _totals.compressedBytes += header.payloadBytes;
+        return true;
+    }
+    static bool ack(int fd, uint64_t seq) {
+        char buf[UpstreamWire::AckBytes];
+        UpstreamWire::encodeAck(buf, seq);
+        return send(fd, buf, sizeof(buf), MSG_NOSIGNAL) == sizeof(buf);
+    }
+
+    FILE* _out;
+    std::string _raw;
+    std::unordered_map<std::string, uint64_t> _lastSeq;
+    Totals _totals;
+};
+}
+
+int main(int argc, char* argv[]) {
+    const char* port = Config::UpstreamPort;
+    const char* bind = nullptr;
+    const char* outPath = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (arg == "--port" && value) {
+            port = value;
+            ++i;
+        } else if (arg == "--bind" && value) {
+            bind = value;
+            ++i;
+        } else if (arg == "--out" && value) {
+            outPath = value;
+            ++i;
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--port N] [--bind ADDR] [--out FILE]" << std::endl
+                      << "  default: port " << Config::UpstreamPort << " on every address, records to stdout" << std::endl;
+            return 1;
+        }
+    }
+    FILE* out = outPath ? fopen(outPath, "a") : stdout;
+    if (!out) {
+        perror(outPath);
+        return 1;
+    }
+    int listener = listenOn(bind, port);
+    if (listener < 0) {
+        perror("listen");
+        return 1;
+    }
+    struct sigaction sa{};
+    sa.sa_handler = [](int) { stopping = 1; };
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    Collector collector(out);
+    std::vector<Connection> connections;
+    std::vector<struct pollfd> fds;
+    while (!stopping) {
+        fds.assign(1, {listener, POLLIN, 0});
+        for (const auto& c : connections)
+            fds.push_back({c.fd, POLLIN, 0});
+        if (poll(fds.data(), fds.size(), 1000) <= 0)
+            continue;
+        if (fds[0].revents & POLLIN) {
+            int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                connections.push_back({fd, "", ""});
+                collector.accepted();
+            }
+        }
+        for (size_t i = fds.size() - 1; i > 0; --i) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            auto& c = connections[i - 1];
+            char buf[64 << 10];
+            ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+            if (n > 0)
+                c.in.append(buf, static_cast<size_t>(n));
+            if (n <= 0 || !collector.process(c)) {
+                close(c.fd);
+                connections.erase(connections.begin() + static_cast<ptrdiff_t>(i - 1));
+            }
+        }
+    }
+    const auto& t = collector.totals();
+    std::cerr << "collector: " << t.connections << " connections, " << t.batches << " batches, " << t.events
+              << " events, " << t.duplicates << " duplicate batches, " << t.rawBytes << " bytes in "
+              << t.compressedBytes << " compressed" << std::endl;
+    for (const auto& c : connections)
+        close(c.fd);
+    close(listener);
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
@@ -2,11 +2,26 @@
 #include <csignal>
 
 #include "common.h"
+#include "event_pipeline.h"
+#include "event_serializer.h"
+#include "intern_pool.h"
+#include "latency_tracer.h"
 #include "monitor_subprocesses.h"
+#include "private_file.h"
 #include "uds_socket.h"
 #include "protocol.h"
+#include "self_profiler.h"
+#include "session_correlator.h"
+#include "upstream_forwarder.h"
 
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
 #include <string>
 #include <unistd.h>
@@ -15,20 +30,55 @@
 namespace SudoMonitor {
 int in_fd, out_fd;
 std::vector<int> clients;
+std::atomic_bool profileDumpRequested = false; // SIGUSR1
+std::atomic_bool stopRequested = false;        // SIGINT
+// Fan-out of the process records: stdout, the UI socket and the upstream collector
+struct StdoutWriter {
+    void operator()(std::string_view record) const {
+        std::cout.write(record.data(), static_cast<std::streamsize>(record.size())).flush();
+    }
+};
+struct UiWriter {
+    UdsSocket& client;
+    void operator()(std::string_view record) const { client.clientSend(record); }
+};
+struct UpstreamWriter {
+    UpstreamForwarder* upstream; // null: no --upstream collector
+    void operator()(std::string_view record) const {
+        if (upstream)
+            upstream->publish(record);
+    }
+};
+using ProcPipeline = EventPipeline<RateLimiter, EventFilter, Serialize, WriteRecord<StdoutWriter>,
+                                   WriteRecord<UiWriter>, WriteRecord<UpstreamWriter>>;
 class Daemon {
 public:
-    Daemon() :
+    Daemon(const MonitorOptions& options, const PipelineOptions& pipeline, std::unique_ptr<LatencyTracer> latency,
+           std::unique_ptr<UpstreamForwarder> upstream) :
+    _latency(std::move(latency)),
+    _upstream(std::move(upstream)),
     _server(Config::SudoToDaemonSock, UdsSocket::Mode::SERVER,
         [this](int fd, const std::string& data)->void {
         onNewData(fd, data);
     }),
-    _client(Config::DaemonToMonitorSock, UdsSocket::Mode::CLIENT),
+    _pamServer(Config::PamToDaemonSock, UdsSocket::Mode::DGRAM_SERVER,
+        [this](int fd, const std::string& data)->void {
+        onNewData(fd, data);
+    }),
+    _client(Config::DaemonToMonitorSock, UdsSocket::Mode::QUEUED_CLIENT),
+    _procPipeline(pipeline.maxEventRate, pipeline.eventMask, _procSerializer, StdoutWriter{}, UiWriter{_client},
+                  UpstreamWriter{_upstream.get()}),
     _procTreeMonitor([this](const ProcessData& data, ProcStatEvent stat)->void {
-        std::stringstream ss;
-        logPrefix(ss) << "Process: " << data.pid << "; Event: " << stat << "; Props: " << data << std::endl;
-        std::cout << ss.str() << std::endl;
-        _client.clientSend(ss.str());
-    })
+        // called under the monitor lock, so the pipeline's serializer buffer and rate limiter are safe to use
+        bool rootEvent = !data.ppid && (stat == ProcStatEvent::Created || stat == ProcStatEvent::Died ||
+                                        stat == ProcStatEvent::Removed);
+        auto callbackNs = _latency && rootEvent ? LatencyTracer::nowNs() : 0;
+        _procPipeline(data, stat);
+        if (callbackNs)
+            traceDelivered(data.pid, stat, callbackNs);
+    }, traced(options)),
+    _correlator([this](const CorrelatedSession& s) { publishCorrelation("session_auth", s); },
+                [this](const CorrelatedSession& s) { publishCorrelation("auth_failures", s); })
     {}
     ~Daemon() {
         _running = false;
@@ -39,50 +89,430 @@ public:
         // unlink(Config::DaemonToMonitorSock);
     }
     void onNewData(int fd, const std::string& data) {
-        auto msg = parseSudoMsg(data);
+        auto receivedNs = _latency ? LatencyTracer::nowNs() : 0;
+        auto msg = [&] {
+            ProfileScope profile(ProfilePoint::ParseSudoMsg);
+            return parseSudoMsg(data);
+        }();
+        auto now = std::chrono::steady_clock::now();
         switch (msg.type) {
             case SudoMsgType::START_SESSION:
+                traceReceived(msg, receivedNs);
                 _procTreeMonitor.addRootProc(msg.pid());
+                traceAdded(msg.pid());
+                _correlator.sessionStarted({msg.pid(), fieldPid(msg, "ppid"), msg.field("user"), msg.field("tty")}, now);
                 break;
             case SudoMsgType::END_SESSION:
+                traceReceived(msg, receivedNs);
                 _procTreeMonitor.rootProcDied(msg.pid());
                 break;
-            default:  //TODO: add actions for PAM messages
-            {
-                std::stringstream ss;
-                logPrefix(ss) << "Got message: " << data << std::endl;
-                std::cout << ss.str() << std::endl;
-                _client.clientSend(ss.str());
+            case SudoMsgType::PAM_AUTH_ATTEMPT:
+            case SudoMsgType::PAM_AUTH_SUCCESS:
+            case SudoMsgType::PAM_AUTH_START_SESSION:
+            case SudoMsgType::PAM_AUTH_END_SESSION: {
+                static constexpr AuthEvent::Type types[] = {AuthEvent::Type::Attempt, AuthEvent::Type::Success,
+                                                            AuthEvent::Type::SessionOpen, AuthEvent::Type::SessionClose};
+                AuthEvent event;
+                event.type = types[static_cast<int>(msg.type) - static_cast<int>(SudoMsgType::PAM_AUTH_ATTEMPT)];
+                event.user = msg.field("ruser").empty() ? msg.subject() : msg.field("ruser");
+                event.tty = msg.field("tty");
+                event.pid = fieldPid(msg, "pid");
+                event.ppid = fieldPid(msg, "ppid");
+                _correlator.authEvent(event, now);
+                break;
+            }
+            case SudoMsgType::PROCESS_QUERY: {
+                auto subject = msg.subject();
+                pid_t pid = 0;
+                std::from_chars(subject.data(), subject.data() + subject.size(), pid);
+                ProcessData pd(pid, 0);
+                if (pid > 0 && _procTreeMonitor.queryProcess(pid, pd))
+                    publish(_msgSerializer.serialize(pd, ProcStatEvent::Queried));
+                else
+                    publish(_msgSerializer.serializeMessage("query", "process not tracked: " + std::string(subject)));
+                break;
             }
+            default:
+                publish(_msgSerializer.serializeMessage("message", data));
                 break;
         }
 
     }
+    static pid_t fieldPid(const SudoMsg& msg, std::string_view key) {
+        auto value = msg.field(key);
+        pid_t pid = 0;
+        std::from_chars(value.data(), value.data() + value.size(), pid);
+        return pid;
+    }
+    // Latency spans of a session message: START creates the session trace, END reuses it
+    void traceReceived(const SudoMsg& msg, uint64_t receivedNs) {
+        if (!_latency)
+            return;
+        auto parsedNs = LatencyTracer::nowNs();
+        auto pid = msg.pid();
+        auto mono = msg.field("mono_ns");
+        uint64_t sentNs = 0;
+        std::from_chars(mono.data(), mono.data() + mono.size(), sentNs);
+        std::string trace;
+        {
+            std::lock_guard<std::mutex> lock(_tracesMtx);
+            auto it = _traces.find(pid);
+            if (it == _traces.end()) {
+                if (msg.type != SudoMsgType::START_SESSION)
+                    return;
+                it = _traces.emplace(pid, SessionTrace{}).first;
+            }
+            auto& t = it->second;
+            if (msg.type == SudoMsgType::START_SESSION)
+                t.id = msg.field("trace");
+            t.sentNs = sentNs;
+            t.parsedNs = parsedNs;
+            t.pending = true;
+            trace = t.id;
+        }
+        if (sentNs)
+            _latency->span(LatencyStage::Transport, trace, pid, sentNs, receivedNs);
+        _latency->span(LatencyStage::Parse, trace, pid, receivedNs, parsedNs);
+    }
+    void traceAdded(pid_t pid) {
+        if (!_latency)
+            return;
+        auto addedNs = LatencyTracer::nowNs();
+        SessionTrace t;
+        {
+            std::lock_guard<std::mutex> lock(_tracesMtx);
+            auto it = _traces.find(pid);
+            if (it == _traces.end())
+                return;
+            t = it->second;
+        }
+        _latency->span(LatencyStage::AddRoot, t.id, pid, t.parsedNs, addedNs);
+    }
+    void traceFirstSync(pid_t pid) {
+        auto syncNs = LatencyTracer::nowNs();
+        SessionTrace t;
+        {
+            std::lock_guard<std::mutex> lock(_tracesMtx);
+            auto it = _traces.find(pid);
+            if (it == _traces.end() || !it->second.createdNs)
+                return;
+            t = it->second;
+        }
+        _latency->span(LatencyStage::FirstSync, t.id, pid, t.createdNs, syncNs);
+    }
+    // The root's Created (START) or Died (END) reached the UI socket
+    void traceDelivered(pid_t pid, ProcStatEvent stat, uint64_t callbackNs) {
+        auto sentUiNs = LatencyTracer::nowNs();
+        SessionTrace t;
+        {
+            std::lock_guard<std::mutex> lock(_tracesMtx);
+            auto it = _traces.find(pid);
+            if (it == _traces.end())
+                return;
+            if (stat == ProcStatEvent::Removed) {
+                _traces.erase(it);
+                return;
+            }
+            if (!it->second.pending)
+                return; // not caused by a session message, e.g. the root died before END
+            it->second.pending = false;
+            if (stat == ProcStatEvent::Created)
+                it->second.createdNs = callbackNs;
+            t = it->second;
+        }
+        _latency->span(LatencyStage::Monitor, t.id, pid, t.parsedNs, callbackNs);
+        _latency->span(LatencyStage::UiSend, t.id, pid, callbackNs, sentUiNs);
+        if (t.sentNs)
+            _latency->span(LatencyStage::EndToEnd, t.id, pid, t.sentNs, sentUiNs);
+    }
+    MonitorOptions traced(MonitorOptions options) {
+        if (!_latency)
+            return options;
+        options.spans.firstSync = [this](pid_t root) { traceFirstSync(root); };
+        options.spans.kernel = [this](pid_t pid, ProcStatEvent event, uint64_t kernelNs) {
+            auto stage = event == ProcStatEvent::Created ? LatencyStage::KernelFork
+                         : event == ProcStatEvent::Exec  ? LatencyStage::KernelExec
+                                                         : LatencyStage::KernelExit;
+            _latency->span(stage, "", pid, kernelNs, LatencyTracer::nowNs());
+        };
+        return options;
+    }
+    void publishCorrelation(std::string_view kind, const CorrelatedSession& s) {
+        const EventSerializer::Field fields[] = {{"user", s.user}, {"tty", s.tty}, {"match", correlationMatchName(s.match)}};
+        const EventSerializer::Counter counters[] = {{"pid", static_cast<uint64_t>(s.pid)}, {"attempts", s.attempts},
+                                                     {"successes", s.successes}, {"failures", s.failures},
+                                                     {"pam_sessions", s.pamSessions}, {"auth_ms", s.authMs}};
+        publish(_msgSerializer.serializeRecord(kind, fields, std::size(fields), counters, std::size(counters)));
+    }
+    // The daemon's own records, to the writers of the process pipeline
+    void publish(std::string_view record) {
+        StdoutWriter{}(record);
+        UiWriter{_client}(record);
+        UpstreamWriter{_upstream.get()}(record);
+    }
+    void publishMetrics() {
+        static const auto names = [] {
+            std::vector<std::string> n;
+            for (size_t t = 1; t < static_cast<size_t>(AttrTier::NUM_OF_TIERS); ++t) {
+                std::string prefix = std::string("attr_") + attrTierName(static_cast<AttrTier>(t)) + "_";
+                for (auto field : {"reads", "failures", "bytes", "ns"})
+                    n.push_back(prefix + field);
+            }
+            for (auto field : {"exit_records", "exit_overruns", "exit_attached", "exit_short_lived",
+                               "auth_events", "auth_sessions", "auth_matched", "auth_expired", "auth_dropped", "auth_entries",
+                               "pam_rejected",
+                               "burst_parents", "burst_active", "burst_folded", "burst_summaries",
+                               "events_fork", "events_exec", "events_exit", "events_dropped",
+                               "ui_queued", "ui_sent", "ui_dropped", "ui_partial_writes", "ui_would_block", "ui_connects",
+                               "ui_queue_bytes",
+                               "up_events", "up_batches", "up_acked", "up_spooled", "up_spool_bytes", "up_dropped_events",
+                               "up_raw_bytes", "up_compressed_bytes", "up_connects",
+                               "intern_strings", "intern_bytes", "intern_lookups", "intern_hits", "intern_shared_bytes",
+                               "intern_evicted", "events_filtered", "events_rate_limited"})
+                n.emplace_back(field);
+            for (size_t s = 0; s < static_cast<size_t>(LatencyStage::NUM_OF_STAGES); ++s) {
+                std::string prefix = std::string("lat_") + latencyStageName(static_cast<LatencyStage>(s)) + "_";
+                for (auto field : {"count", "p50_us", "p99_us", "max_us"})
+                    n.push_back(prefix + field);
+            }
+            return n;
+        }();
+        std::vector<EventSerializer::Counter> counters;
+        counters.reserve(names.size());
+        auto attrs = _procTreeMonitor.attrMetrics();
+        for (size_t t = 1; t < attrs.size(); ++t) {
+            const auto& m = attrs[t];
+            for (auto value : {m.reads, m.failures, m.bytes, m.nanos})
+                counters.push_back({names[counters.size()], value});
+        }
+        auto exits = _procTreeMonitor.exitMetrics();
+        for (auto value : {exits.records, exits.overruns, exits.attached, exits.shortLived})
+            counters.push_back({names[counters.size()], value});
+        auto auth = _correlator.metrics();
+        for (auto value : {auth.events, auth.sessions, auth.matched, auth.expired, auth.dropped, auth.entries})
+            counters.push_back({names[counters.size()], value});
+        counters.push_back({names[counters.size()], _pamServer.rejectedDatagrams()});
+        auto bursts = _procTreeMonitor.burstMetrics();
+        for (auto value : {bursts.bursts, bursts.active, bursts.folded, bursts.summaries})
+            counters.push_back({names[counters.size()], value});
+        auto events = _procTreeMonitor.procEventMetrics();
+        for (auto value : {events.forks, events.execs, events.exits, events.dropped})
+            counters.push_back({names[counters.size()], value});
+        auto ui = _client.clientStats();
+        for (auto value : {ui.queued, ui.sent, ui.dropped, ui.partialWrites, ui.wouldBlock, ui.connects, ui.queueBytes})
+            counters.push_back({names[counters.size()], value});
+        auto up = _upstream ? _upstream->metrics() : UpstreamMetrics{};
+        for (auto value : {up.events, up.batches, up.acked, up.spooled, up.spoolBytes, up.droppedEvents, up.rawBytes,
+                           up.compressedBytes, up.connects})
+            counters.push_back({names[counters.size()], value});
+        auto pool = InternPool::instance().metrics();
+        for (auto value : {pool.entries, pool.bytes, pool.lookups, pool.hits, pool.sharedBytes, pool.evicted})
+            counters.push_back({names[counters.size()], value});
+        for (auto value : {_procPipeline.stage<EventFilter>().filtered(), _procPipeline.stage<RateLimiter>().limited()})
+            counters.push_back({names[counters.size()], value});
+        for (size_t s = 0; _latency && s < static_cast<size_t>(LatencyStage::NUM_OF_STAGES); ++s) {
+            auto lat = _latency->stats(static_cast<LatencyStage>(s));
+            for (auto value : {lat.count, lat.p50Ns / 1000, lat.p99Ns / 1000, lat.maxNs / 1000})
+                counters.push_back({names[counters.size()], value});
+        }
+        if (_latency)
+            _latency->flush();
+        publish(_msgSerializer.serializeCounters("metrics", counters.data(), counters.size()));
+    }
+    // Per-thread CPU: <thread>_cpu_us since --profile enabled it, <thread>_cpu_permille of one CPU over the period
+    void publishProfile() {
+        auto threads = SelfProfiler::sampleThreads();
+        std::vector<std::string> names;
+        names.reserve(threads.size() * 2);
+        std::vector<EventSerializer::Counter> counters;
+        for (const auto& t : threads) {
+            names.push_back(t.name + "_cpu_us");
+            counters.push_back({names.back(), t.cpuNs / 1000});
+            names.push_back(t.name + "_cpu_permille");
+            counters.push_back({names.back(), t.permille});
+        }
+        publish(_msgSerializer.serializeCounters("profile", counters.data(), counters.size()));
+    }
+    void dumpProfile() {
+        std::string dir = Config::ProfileDumpDir, path = dir + "/profile.folded";
+        bool ok = privateDir(dir) && replaceFile(path + ".tmp", path, SelfProfiler::folded());
+        publish(_msgSerializer.serializeMessage("profile", (ok ? "folded stacks written to " : "cannot write ") + path));
+    }
     void runDaemon() {
+        SelfProfiler::nameThread("socket_loop", false); // the main thread keeps the process name
         _server.init();
+        _pamServer.allowSenders({0, geteuid()}); // the PAM stacks run as root; the daemon's own user for tests
+        if (!_pamServer.init())
+            perror("PAM notification socket");
         _client.init();
-        _client.clientSend("New daemon connection\n");
+        publish(_msgSerializer.serializeMessage("daemon", "New daemon connection"));
         _procTreeMonitor.run();
         _running = true;
-        while(_running) {
+        auto nextMetrics = std::chrono::steady_clock::now() + std::chrono::milliseconds(Config::MetricsIntervalMs);
+        auto nextProfile = std::chrono::steady_clock::now() + std::chrono::milliseconds(Config::ProfileIntervalMs);
+        while(_running && !stopRequested) {
             _server.serverUpdate();
+            _pamServer.serverUpdate();
+            _client.clientUpdate();
+            _correlator.advance(std::chrono::steady_clock::now());
+            if (std::chrono::steady_clock::now() >= nextMetrics) {
+                publishMetrics();
+                nextMetrics += std::chrono::milliseconds(Config::MetricsIntervalMs);
+            }
+            if (SelfProfiler::enabled() && std::chrono::steady_clock::now() >= nextProfile) {
+                publishProfile();
+                nextProfile += std::chrono::milliseconds(Config::ProfileIntervalMs);
+            }
+            if (profileDumpRequested.exchange(false))
+                dumpProfile();
         }
+        _client.clientFlush(std::chrono::milliseconds(Config::ClientCloseFlushMs));
     }
 private:
+    struct SessionTrace {
+        std::string id;        // the plugin's trace id
+        uint64_t sentNs = 0;   // plugin mono_ns of the last session message
+        uint64_t parsedNs = 0;
+        uint64_t createdNs = 0; // the root's Created callback
+        bool pending = false;  // waiting for the root's Created/Died
+    };
+    std::unique_ptr<LatencyTracer> _latency; // null: latency tracing disabled, declared before the monitor using it
+    std::unique_ptr<UpstreamForwarder> _upstream; // null: no --upstream collector
+    std::mutex _tracesMtx;                    // the daemon loop and the monitor callbacks
+    std::unordered_map<pid_t, SessionTrace> _traces;
     std::atomic_bool _running = false;
     UdsSocket _server;
+    UdsSocket _pamServer;
     UdsSocket _client;
+    EventSerializer _procSerializer;
+    EventSerializer _msgSerializer;
+    ProcPipeline _procPipeline; // the monitor's records: filter, rate limit, serialize, fan out
     ProcTreeMonitor _procTreeMonitor;
+    SessionCorrelator _correlator; // only used from the daemon loop thread
 };
 }
 using namespace SudoMonitor;
+// Only flags the stop: the daemon loop returns, and destroying the Daemon joins the monitor threads and then stops the
+// forwarder, whose open batch goes to the spool
 void cleanup(int sig) {
-    std::cout << "Exiting..." << std::endl;
-    exit(0);
+    stopRequested = true;
+}
+void usage(const char* name) {
+    std::cerr << "Usage: " << name << " [--attr-tiers status=start,io=periodic,...] [--attr-interval-ms N] [--taskstats]"
+              << " [--cgroup] [--cgroup-base PATH] [--record TRACE] [--session-mem-cap BYTES]" << std::endl
+              << "  [--burst-enter N] [--burst-exit N] [--burst-window-ms N] [--burst-summary-ms N]"
+              << " [--latency] [--trace-spans FILE] [--poll-only]" << std::endl
+              << "  [--upstream HOST:PORT] [--spool DIR] [--spool-max BYTES] [--profile]"
+              << " [--events Created,Exec,...] [--max-event-rate N]" << std::endl
+              << "  burst: a parent creating N children per window is reported through Summary events, 0 disables" << std::endl
+              << "  poll-only: processes are found by the tree passes only, not from the connector's fork/exec/exit" << std::endl
+              << "  latency: per-stage histograms in the metrics record, --trace-spans also writes Chrome trace events" << std::endl
+              << "  upstream: records are also forwarded in compressed batches to sudo_collector, spooled in "
+              << Config::UpstreamSpoolDir << " until acknowledged" << std::endl
+              << "  events: process records of these types only, of Created, Died, Removed, Summary, Exec" << std::endl
+              << "  max-event-rate: new child processes reported per second, each with its Died and Removed; execs, sessions and summaries always pass" << std::endl
+              << "  profile: per-thread CPU records, SIGUSR1 writes folded stacks to " << Config::ProfileDumpDir << "/profile.folded"
+              << std::endl
+              << "  attributes: status, io, fd, cwd, exe, cgroup; tiers: start, demand, periodic, off" << std::endl
+              << "  demand: read when a process_query <pid> message on " << Config::SudoToDaemonSock
+              << " asks for the process, answered with a Queried record" << std::endl
+              << "  default: " << Config::DefaultAttrTiers << std::endl;
 }
-int main() {
+int main(int argc, char* argv[]) {
+    MonitorOptions options;
+    bool latency = false;
+    std::string traceSpans;
+    UpstreamOptions upstream;
+    PipelineOptions pipeline;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (arg == "--taskstats") {
+            options.taskstats = true;
+        } else if (arg == "--cgroup") {
+            options.cgroups = true;
+        } else if (arg == "--cgroup-base" && value) {
+            options.cgroups = true;
+            options.cgroupBase = value;
+            ++i;
+        } else if (arg == "--record" && value) {
+            options.recordPath = value;
+            ++i;
+        } else if (arg == "--session-mem-cap" && value && isdigit(static_cast<unsigned char>(value[0]))) {
+            options.sessionMemoryCap = strtoull(value, nullptr, 10);
+            ++i;
+        } else if (arg == "--burst-enter" && value && isdigit(static_cast<unsigned char>(value[0]))) {
+            options.bursts.enterChildren = static_cast<uint32_t>(atoi(value));
+            ++i;
+        } else if (arg == "--burst-exit" && value && isdigit(static_cast<unsigned char>(value[0]))) {
+            options.bursts.exitChildren = static_cast<uint32_t>(atoi(value));
+            ++i;
+        } else if (arg == "--burst-window-ms" && value && atoi(value) > 0) {
+            options.bursts.window = std::chrono::milliseconds(atoi(value));
+            ++i;
+        } else if (arg == "--burst-summary-ms" && value && atoi(value) > 0) {
+            options.bursts.summaryInterval = std::chrono::milliseconds(atoi(value));
+            ++i;
+        } else if (arg == "--poll-only") {
+            options.procEvents = false;
+        } else if (arg == "--latency") {
+            latency = true;
+        } else if (arg == "--trace-spans" && value) {
+            latency = true;
+            traceSpans = value;
+            ++i;
+        } else if (arg == "--upstream" && value && strrchr(value, ':')) {
+            std::string_view hostPort = value;
+            auto colon = hostPort.rfind(':');
+            upstream.host = hostPort.substr(0, colon);
+            upstream.port = hostPort.substr(colon + 1);
+            ++i;
+        } else if (arg == "--spool" && value) {
+            upstream.spoolDir = value;
+            ++i;
+        } else if (arg == "--spool-max" && value && isdigit(static_cast<unsigned char>(value[0]))) {
+            upstream.spoolMaxBytes = strtoull(value, nullptr, 10);
+            ++i;
+        } else if (arg == "--events" && value && EventFilter::parse(value, pipeline.eventMask)) {
+            ++i;
+        } else if (arg == "--max-event-rate" && value && isdigit(static_cast<unsigned char>(value[0]))) {
+            pipeline.maxEventRate = static_cast<uint32_t>(atoi(value));
+            ++i;
+        } else if (arg == "--profile") {
+            SelfProfiler::enable();
+        } else if (arg == "--attr-tiers" && value && options.attrs.parse(value)) {
+            ++i;
+        } else if (arg == "--attr-interval-ms" && value && atoi(value) > 0) {
+            options.attrs.periodicInterval = std::chrono::milliseconds(atoi(value));
+            ++i;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    std::unique_ptr<LatencyTracer> tracer;
+    if (latency) {
+        tracer = std::make_unique<LatencyTracer>(traceSpans);
+        if (!tracer->init()) {
+            perror(traceSpans.c_str());
+            return 1;
+        }
+    }
+    std::unique_ptr<UpstreamForwarder> forwarder;
+    if (!upstream.host.empty()) {
+        forwarder = std::make_unique<UpstreamForwarder>(upstream);
+        if (!forwarder->init()) {
+            perror(upstream.spoolDir.c_str());
+            return 1;
+        }
+    }
     signal(SIGINT, cleanup);
-    Daemon daemon;
-    daemon.runDaemon();
+    if (SelfProfiler::enabled())
+        signal(SIGUSR1, [](int) { profileDumpRequested = true; });
+    {
+        Daemon daemon(options, pipeline, std::move(tracer), std::move(forwarder));
+        daemon.runDaemon();
+        std::cout << "Exiting..." << std::endl;
+    }
     return 0;
 }
@@ -3,42 +3,121 @@
 
 #include <security/pam_modules.h>
 #include <security/pam_ext.h>
-#include <sys/socket.h>
-#include <sys/un.h>
-#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
 #include <memory>
 #include <string>
-#include <syslog.h>
+#include <unistd.h>
 
 #include "common.h"
 
-std::unique_ptr<SudoMonitor::UdsSocket> clientSocket;
-std::string username;
-void log(const std::string& msg) {
-    static bool wasInitialized = false;
-    if (!wasInitialized) {
-        openlog("SudoMonitorPAM", LOG_PID | LOG_CONS, LOG_AUTH);
-        wasInitialized = true;
+// The notifier runs inside the login/sudo PAM stack, so it must never delay it:
+// state is per PAM handle (pam_set_data), messages are single non-blocking datagrams,
+// and a send that fails or takes longer than the budget silences the handle for PamNotifyRetryMs.
+// Module arguments: socket=PATH (default Config::PamToDaemonSock), budget_us=N.
+namespace {
+constexpr auto StateKey = "sudo_monitor_notifier";
+
+int64_t monotonicUs() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct NotifierState {
+    std::unique_ptr<SudoMonitor::UdsSocket> socket;
+    std::string user = SudoMonitor::SUDO_UNKNOWN;
+    std::string ruser; // the invoking user, set by sudo/su; user, ruser and tty are kept escaped (escapeField)
+    std::string tty;
+    int64_t budgetUs = SudoMonitor::Config::PamNotifyBudgetUs;
+    int64_t suspendedUntilUs = 0;
+    unsigned dropped = 0; // not delivered since the last sent message, which reports them
+
+    NotifierState(int argc, const char** argv) {
+        const char* path = SudoMonitor::Config::PamToDaemonSock;
+        for (int i = 0; i < argc; ++i) {
+            if (strncmp(argv[i], "socket=", 7) == 0)
+                path = argv[i] + 7;
+            else if (strncmp(argv[i], "budget_us=", 10) == 0)
+                budgetUs = atol(argv[i] + 10);
+        }
+        socket = std::make_unique<SudoMonitor::UdsSocket>(path, SudoMonitor::UdsSocket::Mode::DGRAM_CLIENT);
+        if (!socket->init())
+            socket.reset();
     }
-    syslog(LOG_INFO, "PAM_CUSTOM_INFO %s", msg.c_str());
+
+    void notify(SudoMonitor::SudoMsgType type) {
+        auto start = monotonicUs();
+        if (!socket || start < suspendedUntilUs) {
+            ++dropped;
+            return;
+        }
+        char msg[SudoMonitor::Config::SocketBufSize];
+        int len = snprintf(msg, sizeof(msg), "%s %s pid=%d ppid=%d ruser=%s tty=%s",
+                           SudoMonitor::Messages[static_cast<int>(type)].c_str(), user.c_str(),
+                           getpid(), getppid(), ruser.c_str(), tty.c_str());
+        if (dropped && len > 0 && static_cast<size_t>(len) < sizeof(msg))
+            len += snprintf(msg + len, sizeof(msg) - len, " dropped=%u", dropped);
+        bool sent = len > 0 && socket->clientSend({msg, std::min(static_cast<size_t>(len), sizeof(msg) - 1)});
+        if (sent)
+            dropped = 0;
+        else
+            ++dropped;
+        if (!sent || monotonicUs() - start > budgetUs)
+            suspendedUntilUs = start + SudoMonitor::Config::PamNotifyRetryMs * 1000;
+    }
+};
+
+void cleanupState(pam_handle_t*, void* data, int) {
+    delete static_cast<NotifierState*>(data);
 }
-void notify_daemon(const std::string& msg) {
-    if (!clientSocket) {
-        clientSocket = std::make_unique<SudoMonitor::UdsSocket>(SudoMonitor::Config::SudoToDaemonSock, SudoMonitor::UdsSocket::Mode::CLIENT);
-        clientSocket->init(); //TODO: add error handling
+
+NotifierState* getState(pam_handle_t* pamh, int argc, const char** argv) {
+    const void* data = nullptr;
+    if (pam_get_data(pamh, StateKey, &data) == PAM_SUCCESS && data)
+        return static_cast<NotifierState*>(const_cast<void*>(data));
+    auto state = new NotifierState(argc, argv);
+    if (pam_set_data(pamh, StateKey, state, cleanupState) != PAM_SUCCESS) {
+        delete state;
+        return nullptr;
     }
-    auto nullTerminated = msg + "";
-    clientSocket->clientSend(nullTerminated);
-    log(std::string("Sent message: " + nullTerminated));
+    return state;
+}
+
+void notify(pam_handle_t* pamh, int argc, const char** argv, SudoMonitor::SudoMsgType type) {
+    if (!pamh)
+        return;
+    auto state = getState(pamh, argc, argv);
+    if (!state)
+        return;
+    auto item = [pamh](int type, std::string& out) {
+        const void* value = nullptr;
+        if (pam_get_item(pamh, type, &value) == PAM_SUCCESS && value)
+            out = static_cast<const char*>(value);
+    };
+    if (state->user == SudoMonitor::SUDO_UNKNOWN) {
+        std::string user, ruser, tty;
+        item(PAM_USER, user);
+        item(PAM_RUSER, ruser);
+        item(PAM_TTY, tty);
+        if (!user.empty()) // chosen by the caller, escaped like every value of the message
+            state->user = SudoMonitor::escapeField(user);
+        state->ruser = SudoMonitor::escapeField(ruser);
+        state->tty = SudoMonitor::escapeField(tty);
+    }
+    state->notify(type);
+}
 }
 
 // Called by PAM during the authentication phase
 PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv) {
     const char *user = nullptr;
-    pam_get_user(pamh, &user, NULL);
-    username = user ? user : "unknown";
-    std::string smsg = "pam_auth_attempt " + username;
-    notify_daemon(smsg);
+    if (pamh)
+        pam_get_user(pamh, &user, NULL);
+    notify(pamh, argc, argv, SudoMonitor::SudoMsgType::PAM_AUTH_ATTEMPT);
 
     // We return PAM_IGNORE because we aren't deciding IF the user can log in,
     // we are just "tapping" the line to listen.
@@ -47,7 +126,17 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
 
 // Called after the real auth module (like pam_unix) finishes
 PAM_EXTERN int pam_sm_setcred(pam_handle_t *pamh, int flags, int argc, const char **argv) {
-    std::string smsg = "pam_auth_success " + username;
-    notify_daemon(smsg);
+    if (!(flags & PAM_DELETE_CRED))
+        notify(pamh, argc, argv, SudoMonitor::SudoMsgType::PAM_AUTH_SUCCESS);
+    return PAM_SUCCESS;
+}
+
+PAM_EXTERN int pam_sm_open_session(pam_handle_t *pamh, int flags, int argc, const char **argv) {
+    notify(pamh, argc, argv, SudoMonitor::SudoMsgType::PAM_AUTH_START_SESSION);
     return PAM_SUCCESS;
-}
\ No newline at end of file
+}
+
+PAM_EXTERN int pam_sm_close_session(pam_handle_t *pamh, int flags, int argc, const char **argv) {
+    notify(pamh, argc, argv, SudoMonitor::SudoMsgType::PAM_AUTH_END_SESSION);
+    return PAM_SUCCESS;
+}
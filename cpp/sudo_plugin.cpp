@@ -1,5 +1,7 @@
 #include "monitor_subprocesses.h"
 #include "common.h"
+#include "event_pipeline.h"
+#include "event_serializer.h"
 #include "uds_socket.h"
 #include "protocol.h"
 
@@ -18,6 +20,7 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <poll.h>
+#include <sys/random.h>
 
 static sudo_printf_t plugin_printf = nullptr;
 static sudo_printf_t log_printf = nullptr;
@@ -26,6 +29,9 @@ static bool use_daemon = false;
 static bool use_monitor = false;
 static std::unique_ptr<SudoMonitor::UdsSocket> clientSocket;
 static std::unique_ptr<SudoMonitor::ProcTreeMonitor> monitorTree;
+static SudoMonitor::EventSerializer monitorSerializer; // buffer of monitorPipeline
+static char trace_id[17]; // shared by the start and end messages of this session
+static SudoMonitor::MonitorOptions monitorOptions;
 
 void logToFile(const char *fmt, ...) {
     if (!log_file)
@@ -45,6 +51,14 @@ void logToFile(const char *fmt, ...) {
 #define LOG_INFO(fmt, ...) LOG(SUDO_CONV_INFO_MSG,  "[INFO] " fmt "\n", ##__VA_ARGS__)
 #define LOG_ERROR(fmt, ...) LOG(SUDO_CONV_ERROR_MSG, "[ERROR] " fmt "\n", ##__VA_ARGS__)
 
+struct LogRecord {
+    void operator()(std::string_view record) const {
+        LOG_INFO("=== %.*s", static_cast<int>(record.size()) - 1, record.data()); // drop the record's own newline
+    }
+};
+static SudoMonitor::EventPipeline<SudoMonitor::Serialize, SudoMonitor::WriteRecord<LogRecord>>
+    monitorPipeline(monitorSerializer, LogRecord{}); // used only under the monitor lock
+
 using ParameterHandler = std::function<void(const char*)>;
 using Handlers = std::map<std::string, ParameterHandler>;
 
@@ -52,7 +66,8 @@ static Handlers handlers = {
     {"console_log", [](const char* value) {if (strcmp(value, "true") == 0) log_printf = plugin_printf;}},
     {"log_file", [](const char* value) {log_file = fopen(value, "w");}}, //TODO: error handling and pid/time as filename part
     {"use_daemon", [](const char* value) {use_daemon = strcmp(value, "true") == 0;}}, //TODO: socket path instead "true"
-    {"monitor_tree", [](const char* value) {use_monitor = strcmp(value, "true") == 0;}}
+    {"monitor_tree", [](const char* value) {use_monitor = strcmp(value, "true") == 0;}},
+    {"attr_tiers", [](const char* value) {monitorOptions.attrs.parse(value);}} //TODO: error handling
 };
 
 
@@ -89,14 +104,34 @@ void apply_custom_options(char* const options[])
 static bool connect_to_socket(const std::string& path) {
     if (clientSocket)
         return true;
-    clientSocket = std::make_unique<SudoMonitor::UdsSocket>(path, SudoMonitor::UdsSocket::Mode::CLIENT);
+    clientSocket = std::make_unique<SudoMonitor::UdsSocket>(path, SudoMonitor::UdsSocket::Mode::QUEUED_CLIENT, nullptr,
+                                                            SudoMonitor::Config::PluginQueueBytes);
     return clientSocket->init();
 }
 
 static bool send_to_socket(const SudoMonitor::SudoMsg& msg) {
     if (!clientSocket)
         return false;
-    return clientSocket->clientSend(msg.toString());
+    // sudo_open/sudo_close return right after, so wait (briefly) until the message is written
+    return clientSocket->clientSend(msg.toString() + "\n") &&
+           clientSocket->clientFlush(std::chrono::milliseconds(SudoMonitor::Config::SudoToDaemonSockTimeoutMs));
+}
+
+static void new_trace_id() {
+    uint64_t id = 0;
+    if (getrandom(&id, sizeof(id), GRND_NONBLOCK) != sizeof(id))
+        id = (static_cast<uint64_t>(getpid()) << 32) ^ static_cast<uint64_t>(time(nullptr));
+    snprintf(trace_id, sizeof(trace_id), "%016llx", static_cast<unsigned long long>(id));
+}
+
+// Value of a "name=value" entry of a sudo info list
+static const char* info_value(char * const info[], const char* name) {
+    size_t len = strlen(name);
+    for (int i = 0; info && info[i] != NULL; i++) {
+        if (strncmp(info[i], name, len) == 0 && info[i][len] == '=')
+            return info[i] + len + 1;
+    }
+    return nullptr;
 }
 
 static void log_info(const char* prefix, char * const info[]) {
@@ -135,14 +170,18 @@ static int sudo_open(
 
         if (use_daemon) {
             connect_to_socket(SudoMonitor::Config::SudoToDaemonSock);
-            send_to_socket({SudoMonitor::SudoMsgType::START_SESSION, getpid()});
+            // user/tty/ppid let the daemon join the session with the PAM attempts that preceded it
+            SudoMonitor::SudoMsg start(SudoMonitor::SudoMsgType::START_SESSION, getpid());
+            for (auto name : {"user", "tty", "ppid"}) {
+                if (auto value = info_value(user_info, name))
+                    start.add(name, value);
+            }
+            new_trace_id();
+            send_to_socket(start.stamp(trace_id));
         } else if (use_monitor) {
-            monitorTree = std::make_unique<SudoMonitor::ProcTreeMonitor>([&](const SudoMonitor::ProcessData& data, SudoMonitor::ProcStatEvent stat){
-               std::stringstream ss;
-                ss << "Process: " << data.pid << "; Event: " << stat << "; Props: " << data;
-                auto tmp = ss.str();
-                LOG_INFO("=== %s", ss.str().c_str());
-            });
+            monitorTree = std::make_unique<SudoMonitor::ProcTreeMonitor>([](const SudoMonitor::ProcessData& data, SudoMonitor::ProcStatEvent stat){
+                monitorPipeline(data, stat);
+            }, monitorOptions);
             // monitorTree->run();
             monitorTree->addRootProc(getpid());
         }
@@ -157,7 +196,10 @@ static void sudo_close(int exit_status, int error) {
         monitorTree->rootProcDied(getpid());
         monitorTree.reset();
     }
-    send_to_socket({SudoMonitor::SudoMsgType::END_SESSION, getpid()});
+    if (use_daemon) {
+        SudoMonitor::SudoMsg end(SudoMonitor::SudoMsgType::END_SESSION, getpid());
+        send_to_socket(end.stamp(trace_id));
+    }
 
     if (error != 0) {
         LOG_ERROR("Sudo command failed to execute. Error: %d", error);
@@ -0,0 +1,218 @@
+#include "taskstats_listener.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/genetlink.h>
+#include <linux/netlink.h>
+#include <linux/taskstats.h>
+
+namespace SudoMonitor {
+namespace {
+constexpr size_t RecvBufSize = 16384;
+constexpr int SocketRcvBuf = 4 * 1024 * 1024; // absorbs exit storms between two recv calls
+
+const nlattr* nextAttr(const nlattr* attr, int& remaining) {
+    int len = NLA_ALIGN(attr->nla_len);
+    remaining -= len;
+    return reinterpret_cast<const nlattr*>(reinterpret_cast<const char*>(attr) + len);
+}
+bool attrOk(const nlattr* attr, int remaining) {
+    return remaining >= static_cast<int>(sizeof(nlattr)) && attr->nla_len >= sizeof(nlattr) &&
+           attr->nla_len <= remaining;
+}
+const void* attrData(const nlattr* attr) {
+    return reinterpret_cast<const char*>(attr) + NLA_HDRLEN;
+}
+int attrLen(const nlattr* attr) {
+    return attr->nla_len - NLA_HDRLEN;
+}
+void putAttr(char* buf, size_t& len, uint16_t type, const void* data, size_t size) {
+    auto attr = reinterpret_cast<nlattr*>(buf + len);
+    attr->nla_type = type;
+    attr->nla_len = static_cast<uint16_t>(NLA_HDRLEN + size);
+    memcpy(buf + len + NLA_HDRLEN, data, size);
+    len += NLA_ALIGN(attr->nla_len);
+}
+}
+
+struct TaskstatsListener::Impl {
+    OnExit _onExit;
+    int _fd = -1;
+    uint16_t _familyId = 0;
+    std::string _cpuMask;
+    std::atomic<uint64_t> _records{0};
+    std::atomic<uint64_t> _overruns{0};
+
+    explicit Impl(const OnExit& onExit) : _onExit(onExit) {}
+    ~Impl() {
+        if (_fd < 0)
+            return;
+        if (_familyId)
+            sendCommand(_familyId, TASKSTATS_CMD_GET, TASKSTATS_CMD_ATTR_DEREGISTER_CPUMASK,
+                        _cpuMask.c_str(), _cpuMask.size() + 1);
+        close(_fd);
+    }
+
+    bool sendCommand(uint16_t family, uint8_t cmd, uint16_t attrType, const void* data, size_t size) {
+        char buf[256] = {};
+        auto nlh = reinterpret_cast<nlmsghdr*>(buf);
+        nlh->nlmsg_type = family;
+        nlh->nlmsg_flags = NLM_F_REQUEST;
+        nlh->nlmsg_pid = 0;
+        auto genl = static_cast<genlmsghdr*>(NLMSG_DATA(nlh));
+        genl->cmd = cmd;
+        genl->version = family == GENL_ID_CTRL ? 1 : TASKSTATS_GENL_VERSION;
+        size_t len = NLMSG_LENGTH(GENL_HDRLEN);
+        if (len + NLA_HDRLEN + NLA_ALIGN(size) > sizeof(buf))
+            return false;
+        putAttr(buf, len, attrType, data, size);
+        nlh->nlmsg_len = static_cast<uint32_t>(len);
+        return send(_fd, buf, len, 0) == static_cast<ssize_t>(len);
+    }
+
+    bool resolveFamily() {
+        if (!sendCommand(GENL_ID_CTRL, CTRL_CMD_GETFAMILY, CTRL_ATTR_FAMILY_NAME,
+                         TASKSTATS_GENL_NAME, sizeof(TASKSTATS_GENL_NAME)))
+            return false;
+        char buf[RecvBufSize];
+        ssize_t n = recv(_fd, buf, sizeof(buf), 0);
+        auto nlh = reinterpret_cast<nlmsghdr*>(buf);
+        if (n <= 0 || !NLMSG_OK(nlh, n) || nlh->nlmsg_type == NLMSG_ERROR)
+            return false;
+        int remaining = static_cast<int>(nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN));
+        auto attr = reinterpret_cast<const nlattr*>(static_cast<char*>(NLMSG_DATA(nlh)) + GENL_HDRLEN);
+        for (; attrOk(attr, remaining); attr = nextAttr(attr, remaining)) {
+            if (attr->nla_type == CTRL_ATTR_FAMILY_ID) {
+                _familyId = *static_cast<const uint16_t*>(attrData(attr));
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool registerCpuMask() {
+        long cpus = sysconf(_SC_NPROCESSORS_CONF);
+        _cpuMask = "0-" + std::to_string(std::max(cpus, 1L) - 1);
+        uint16_t family = _familyId;
+        _familyId = 0; // nothing to deregister until the kernel accepts the mask
+        char buf[256] = {};
+        auto nlh = reinterpret_cast<nlmsghdr*>(buf);
+        if (!sendCommand(family, TASKSTATS_CMD_GET, TASKSTATS_CMD_ATTR_REGISTER_CPUMASK,
+                         _cpuMask.c_str(), _cpuMask.size() + 1))
+            return false;
+        // without NLM_F_ACK a successful registration is silent, so only wait one receive timeout for an error
+        ssize_t n = recv(_fd, buf, sizeof(buf), MSG_PEEK);
+        if (n > 0 && NLMSG_OK(nlh, n) && nlh->nlmsg_type == NLMSG_ERROR) {
+            auto err = static_cast<nlmsgerr*>(NLMSG_DATA(nlh));
+            if (err->error != 0) {
+                errno = -err->error;
+                return false;
+            }
+            recv(_fd, buf, sizeof(buf), 0);
+        }
+        _familyId = family;
+        return true;
+    }
+
+    void parseStats(const nlattr* aggr) {
+        int remaining = attrLen(aggr);
+        auto attr = static_cast<const nlattr*>(attrData(aggr));
+        pid_t id = 0;
+        const taskstats* stats = nullptr;
+        size_t statsLen = 0;
+        for (; attrOk(attr, remaining); attr = nextAttr(attr, remaining)) {
+            if (attr->nla_type == TASKSTATS_TYPE_PID)
+                id = static_cast<pid_t>(*static_cast<const uint32_t*>(attrData(attr)));
+            else if (attr->nla_type == TASKSTATS_TYPE_STATS) {
+                stats = static_cast<const taskstats*>(attrData(attr));
+                statsLen = static_cast<size_t>(attrLen(attr));
+            }
+        }
+        if (!id || !stats)
+            return;
+        // older kernels send a shorter struct; missing fields stay zero
+        taskstats ts{};
+        memcpy(&ts, stats, std::min(statsLen, sizeof(ts)));
+        // per-thread records of secondary threads are not process exits
+        if (ts.ac_tgid && ts.ac_tgid != ts.ac_pid)
+            return;
+        ExitRecord rec;
+        rec.pid = id;
+        rec.ppid = static_cast<pid_t>(ts.ac_ppid);
+        rec.exitStatus = ts.ac_exitcode;
+        rec.utimeUs = ts.ac_utime;
+        rec.stimeUs = ts.ac_stime;
+        rec.elapsedUs = ts.ac_etime;
+        rec.hiwaterRssKb = ts.hiwater_rss;
+        rec.hiwaterVmKb = ts.hiwater_vm;
+        rec.readBytes = ts.read_bytes;
+        rec.writeBytes = ts.write_bytes;
+        static_assert(sizeof(rec.comm) >= TS_COMM_LEN);
+        memcpy(rec.comm, ts.ac_comm, TS_COMM_LEN);
+        rec.comm[TS_COMM_LEN - 1] = '\0';
+        _records.fetch_add(1, std::memory_order_relaxed);
+        if (_onExit)
+            _onExit(rec);
+    }
+
+    void run(const std::atomic<bool>& running) {
+        char buf[RecvBufSize];
+        while (running) {
+            ssize_t n = recv(_fd, buf, sizeof(buf), 0);
+            if (n < 0) {
+                if (errno == ENOBUFS)
+                    _overruns.fetch_add(1, std::memory_order_relaxed);
+                else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    perror("taskstats recv");
+                    break;
+                }
+                continue;
+            }
+            auto nlh = reinterpret_cast<nlmsghdr*>(buf);
+            for (int len = static_cast<int>(n); NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+                if (nlh->nlmsg_type != _familyId)
+                    continue;
+                int remaining = static_cast<int>(nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN));
+                auto attr = reinterpret_cast<const nlattr*>(static_cast<char*>(NLMSG_DATA(nlh)) + GENL_HDRLEN);
+                for (; attrOk(attr, remaining); attr = nextAttr(attr, remaining)) {
+                    // the leader's AGGR_PID is the process exit; the AGGR_TGID that follows the last thread
+                    // carries delay accounting only (no exit code, times, ppid or comm)
+                    if (attr->nla_type == TASKSTATS_TYPE_AGGR_PID)
+                        parseStats(attr);
+                }
+            }
+        }
+    }
+};
+
+TaskstatsListener::TaskstatsListener(const OnExit& onExit) : pimpl(std::make_unique<Impl>(onExit)) {}
+
+TaskstatsListener::~TaskstatsListener() = default;
+
+bool TaskstatsListener::init() {
+    pimpl->_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+    if (pimpl->_fd < 0)
+        return false;
+    sockaddr_nl sa{};
+    sa.nl_family = AF_NETLINK;
+    if (bind(pimpl->_fd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) < 0)
+        return false;
+    setsockopt(pimpl->_fd, SOL_SOCKET, SO_RCVBUF, &SocketRcvBuf, sizeof(SocketRcvBuf));
+    timeval timeout{0, 100000}; // also bounds how long run() takes to notice a stop request
+    setsockopt(pimpl->_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return pimpl->resolveFamily() && pimpl->registerCpuMask();
+}
+
+void TaskstatsListener::run(const std::atomic<bool>& running) {
+    pimpl->run(running);
+}
+
+TaskstatsListener::Metrics TaskstatsListener::metrics() const {
+    return {pimpl->_records.load(std::memory_order_relaxed), pimpl->_overruns.load(std::memory_order_relaxed)};
+}
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <sys/types.h>
+
+namespace SudoMonitor {
+// Final accounting of an exited process as reported by the kernel (TASKSTATS genetlink)
+struct ExitRecord {
+    pid_t pid = 0;
+    pid_t ppid = 0;
+    uint32_t exitStatus = 0;      // wait(2) status encoding
+    uint64_t utimeUs = 0;
+    uint64_t stimeUs = 0;
+    uint64_t elapsedUs = 0;
+    uint64_t hiwaterRssKb = 0;
+    uint64_t hiwaterVmKb = 0;
+    uint64_t readBytes = 0;
+    uint64_t writeBytes = 0;
+    char comm[32] = {};
+};
+
+// Receives one kernel message per exiting task for all CPUs, without reading /proc.
+// Needs CAP_NET_ADMIN; init() returns false when taskstats is unavailable.
+class TaskstatsListener {
+public:
+    using OnExit = std::function<void(const ExitRecord&)>;
+    struct Metrics {
+        uint64_t records = 0; // process exit records delivered
+        uint64_t overruns = 0; // receive buffer overflows (records lost)
+    };
+
+    explicit TaskstatsListener(const OnExit& onExit);
+    ~TaskstatsListener();
+    TaskstatsListener(const TaskstatsListener&) = delete;
+    TaskstatsListener& operator=(const TaskstatsListener&) = delete;
+
+    bool init();
+    // Receives until running turns false (checked at least every 100ms)
+    void run(const std::atomic<bool>& running);
+    [[nodiscard]] Metrics metrics() const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> pimpl;
+};
+}
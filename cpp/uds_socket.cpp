@@ -1,11 +1,19 @@
 #include "uds_socket.h"
+#include "common.h"
 
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <cerrno>
 #include <cstring>
 #include <algorithm>
 #include <iostream>
@@ -17,8 +25,28 @@ struct UdsSocket::Impl {
     int _commonFd = -1;
     std::vector<struct pollfd> _pollFds;
     OnNewData _onNewData;
+    struct sockaddr_un _addr{};
+    std::unordered_map<int, std::string> _partial; // SERVER: bytes after the last '\n' of each client
 
-    Impl(const std::string& p, Mode m, const OnNewData& onNewData) : path(p), _mode(m), _onNewData(onNewData)  {}
+    // QUEUED_CLIENT, all under _queueMtx. _ring holds the queued messages back to back from _head,
+    // _frames their lengths; the first _headWritten bytes of the first one are already written.
+    using Clock = std::chrono::steady_clock;
+    mutable std::mutex _queueMtx;
+    std::vector<char> _ring;
+    size_t _head = 0;
+    size_t _size = 0;
+    std::deque<uint32_t> _frames;
+    size_t _headWritten = 0;
+    Clock::time_point _nextConnect{};
+    std::chrono::milliseconds _backoff{Config::ClientReconnectMinMs};
+    size_t _queueBytes;
+    ClientStats _stats;
+
+    std::vector<uid_t> _senders; // DGRAM_SERVER allowed uids, empty: any
+    std::atomic<uint64_t> _rejected{0};
+
+    Impl(const std::string& p, Mode m, const OnNewData& onNewData, size_t queueBytes)
+        : path(p), _mode(m), _onNewData(onNewData), _queueBytes(queueBytes) {}
 
     void setNonBlocking(int fd) {
         int flags = fcntl(fd, F_GETFL, 0);
@@ -30,27 +58,222 @@ struct UdsSocket::Impl {
         for (auto& pfd : _pollFds) {
             if (pfd.fd != _commonFd) close(pfd.fd);
         }
-        if (_mode == Mode::SERVER) unlink(path.c_str());
+        if (_mode == Mode::SERVER || _mode == Mode::DGRAM_SERVER) unlink(path.c_str());
+    }
+    // false: the unterminated rest is over Config::ServerMessageMaxBytes, it is dropped and the client must be closed
+    bool deliver(int fd, const char* data, size_t len) {
+        auto& partial = _partial[fd];
+        partial.append(data, len);
+        size_t begin = 0, end;
+        while ((end = partial.find('\n', begin)) != std::string::npos) {
+            if (_onNewData && end > begin)
+                _onNewData(fd, partial.substr(begin, end - begin));
+            begin = end + 1;
+        }
+        partial.erase(0, begin);
+        if (partial.size() <= Config::ServerMessageMaxBytes)
+            return true;
+        _partial.erase(fd);
+        return false;
+    }
+    void closeClient(int fd) {
+        // an unterminated last message is still a message
+        auto it = _partial.find(fd);
+        if (it != _partial.end()) {
+            if (_onNewData && !it->second.empty())
+                _onNewData(fd, it->second);
+            _partial.erase(it);
+        }
+        close(fd);
+    }
+
+    void failConnect() {
+        if (_commonFd != -1) close(_commonFd);
+        _commonFd = -1;
+        _stats.state = ConnState::Disconnected;
+        _nextConnect = Clock::now() + _backoff;
+        _backoff = std::min(_backoff * 2, std::chrono::milliseconds(Config::ClientReconnectMaxMs));
+    }
+    void connected() {
+        _stats.state = ConnState::Connected;
+        ++_stats.connects;
+        _backoff = std::chrono::milliseconds(Config::ClientReconnectMinMs);
+    }
+    void startConnect() {
+        if (Clock::now() < _nextConnect)
+            return;
+        _commonFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (_commonFd < 0) {
+            ++_stats.connectFailures;
+            failConnect();
+            return;
+        }
+        if (connect(_commonFd, (struct sockaddr*)&_addr, sizeof(_addr)) == 0) {
+            connected();
+        } else if (errno == EINPROGRESS || errno == EAGAIN) {
+            // EAGAIN: the listen backlog is full, the connect completes like an EINPROGRESS one
+            _stats.state = ConnState::Connecting;
+        } else {
+            ++_stats.connectFailures;
+            failConnect();
+        }
+    }
+    void finishConnect() {
+        struct pollfd pfd{_commonFd, POLLOUT, 0};
+        if (poll(&pfd, 1, 0) <= 0)
+            return;
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(_commonFd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            ++_stats.connectFailures;
+            failConnect();
+            return;
+        }
+        connected();
+    }
+    void disconnect() {
+        ++_stats.disconnects;
+        if (_headWritten > 0) {
+            // the server can not make sense of the rest of a message cut by the disconnect
+            consume(_frames.front() - _headWritten);
+            _frames.pop_front();
+            _headWritten = 0;
+            ++_stats.dropped;
+        }
+        failConnect();
+        _backoff = std::chrono::milliseconds(Config::ClientReconnectMinMs);
+        _nextConnect = Clock::now();
+    }
+    void consume(size_t n) {
+        _head = (_head + n) % _ring.size();
+        _size -= n;
+        if (_size == 0)
+            _head = 0;
+    }
+    bool enqueue(std::string_view msg) {
+        if (msg.size() > _ring.size() - _size) {
+            ++_stats.dropped;
+            return false;
+        }
+        size_t tail = (_head + _size) % _ring.size();
+        size_t first = std::min(msg.size(), _ring.size() - tail);
+        memcpy(_ring.data() + tail, msg.data(), first);
+        memcpy(_ring.data(), msg.data() + first, msg.size() - first);
+        _size += msg.size();
+        _frames.push_back(static_cast<uint32_t>(msg.size()));
+        ++_stats.queued;
+        return true;
+    }
+    // Writes the ring (at most two iovecs, however many messages it holds) until it is empty or the socket is full
+    void flush() {
+        while (_size > 0 && _stats.state == ConnState::Connected) {
+            struct iovec iov[2];
+            size_t first = std::min(_size, _ring.size() - _head);
+            iov[0] = {_ring.data() + _head, first};
+            iov[1] = {_ring.data(), _size - first};
+            struct msghdr mh{};
+            mh.msg_iov = iov;
+            mh.msg_iovlen = iov[1].iov_len ? 2 : 1;
+            ssize_t n = sendmsg(_commonFd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    ++_stats.wouldBlock;
+                else
+                    disconnect();
+                return;
+            }
+            ++_stats.writes;
+            if (static_cast<size_t>(n) < _size)
+                ++_stats.partialWrites;
+            _stats.bytes += n;
+            consume(n);
+            _headWritten += n;
+            while (!_frames.empty() && _headWritten >= _frames.front()) {
+                _headWritten -= _frames.front();
+                _frames.pop_front();
+                ++_stats.sent;
+            }
+        }
+    }
+    void update() {
+        if (_stats.state == ConnState::Disconnected)
+            startConnect();
+        if (_stats.state == ConnState::Connecting)
+            finishConnect();
+        flush();
+    }
+
+    [[nodiscard]] bool datagram() const { return _mode == Mode::DGRAM_SERVER || _mode == Mode::DGRAM_CLIENT; }
+    void readDatagrams() {
+        char buf[Config::SocketBufSize];
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(ucred))];
+        for (;;) {
+            iovec iov{buf, sizeof(buf)};
+            msghdr msg{};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            auto n = recvmsg(_commonFd, &msg, MSG_DONTWAIT);
+            if (n <= 0)
+                break;
+            if (!allowedSender(msg))
+                ++_rejected;
+            else if (_onNewData)
+                _onNewData(_commonFd, std::string(buf, static_cast<size_t>(n)));
+        }
+    }
+    bool allowedSender(msghdr& msg) const {
+        if (_senders.empty())
+            return true;
+        for (auto c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_CREDENTIALS)
+                continue;
+            ucred cred{};
+            memcpy(&cred, CMSG_DATA(c), sizeof(cred));
+            return std::find(_senders.begin(), _senders.end(), cred.uid) != _senders.end();
+        }
+        return false;
     }
 };
 
-UdsSocket::UdsSocket(const std::string& path, Mode _mode, const OnNewData& onNewData )
-    : pimpl(std::make_unique<Impl>(path, _mode, onNewData)) {}
+UdsSocket::UdsSocket(const std::string& path, Mode _mode, const OnNewData& onNewData, size_t queueBytes)
+    : pimpl(std::make_unique<Impl>(path, _mode, onNewData, queueBytes)) {}
 
 UdsSocket::~UdsSocket() = default;
 
 bool UdsSocket::init() {
+    auto& addr = pimpl->_addr;
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, pimpl->path.c_str(), sizeof(addr.sun_path) - 1);
 
-    pimpl->_commonFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (pimpl->_mode == Mode::QUEUED_CLIENT) {
+        // (re)connects in clientUpdate, the server may come up later
+        std::lock_guard lock(pimpl->_queueMtx);
+        pimpl->_ring.resize(pimpl->_queueBytes);
+        pimpl->update();
+        return true;
+    }
+
+    pimpl->_commonFd = socket(AF_UNIX, (pimpl->datagram() ? SOCK_DGRAM : SOCK_STREAM) | SOCK_CLOEXEC, 0);
     if (pimpl->_commonFd < 0) return false;
 
     pimpl->setNonBlocking(pimpl->_commonFd);
 
-    struct sockaddr_un addr{};
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, pimpl->path.c_str(), sizeof(addr.sun_path) - 1);
-
-    if (pimpl->_mode == Mode::SERVER) {
+    if (pimpl->_mode == Mode::DGRAM_SERVER) {
+        unlink(pimpl->path.c_str());
+        if (bind(pimpl->_commonFd, (struct sockaddr*)&addr, sizeof(addr)) < 0) return false;
+        chmod(pimpl->path.c_str(), Config::PamToDaemonSockMode);
+        int on = 1;
+        if (!pimpl->_senders.empty() &&
+            setsockopt(pimpl->_commonFd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) < 0)
+            return false;
+        pimpl->_pollFds.push_back({pimpl->_commonFd, POLLIN, 0});
+    } else if (pimpl->_mode == Mode::DGRAM_CLIENT) {
+        // nothing to connect, see clientSend
+    } else if (pimpl->_mode == Mode::SERVER) {
         unlink(pimpl->path.c_str());
         if (bind(pimpl->_commonFd, (struct sockaddr*)&addr, sizeof(addr)) < 0) return false;
         if (listen(pimpl->_commonFd, SOMAXCONN) < 0) return false;
@@ -64,6 +287,10 @@ bool UdsSocket::init() {
 }
 
 void UdsSocket::serverUpdate() {
+    if (pimpl->_mode == Mode::DGRAM_SERVER) {
+        pimpl->readDatagrams();
+        return;
+    }
     if (pimpl->_mode != Mode::SERVER)
         return;
 
@@ -81,15 +308,13 @@ void UdsSocket::serverUpdate() {
                     pimpl->_pollFds.push_back({clientFd, POLLIN, 0});
                 }
             } else {
-                char buf[2048];
-                ssize_t n = recv(pimpl->_pollFds[i].fd, buf, sizeof(buf) - 1, 0);
-                if (n > 0) {
-                    buf[n] = '\0';
-                    if (pimpl->_onNewData)
-                        pimpl->_onNewData(pimpl->_pollFds[i].fd, buf);
-                } else if (n == 0) {
-                    // Client closed connection
-                    close(pimpl->_pollFds[i].fd);
+                char buf[Config::SocketBufSize];
+                ssize_t n = recv(pimpl->_pollFds[i].fd, buf, sizeof(buf), 0);
+                bool closed = n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR); // Client closed connection
+                if (n > 0 && !pimpl->deliver(pimpl->_pollFds[i].fd, buf, static_cast<size_t>(n)))
+                    closed = true; // an oversized message
+                if (closed) {
+                    pimpl->closeClient(pimpl->_pollFds[i].fd);
                     pimpl->_pollFds.erase(pimpl->_pollFds.begin() + i);
                     --i;
                 }
@@ -98,10 +323,76 @@ void UdsSocket::serverUpdate() {
     }
 }
 
-bool UdsSocket::clientSend(const std::string& msg) {
+bool UdsSocket::clientSend(std::string_view msg) {
+    if (pimpl->_mode == Mode::QUEUED_CLIENT) {
+        std::lock_guard lock(pimpl->_queueMtx);
+        if (pimpl->_ring.empty())
+            return false;
+        bool queued = pimpl->enqueue(msg);
+        if (pimpl->_size >= Config::ClientWriteBatchBytes)
+            pimpl->update();
+        return queued;
+    }
     if (pimpl->_commonFd == -1)
         return false;
-    ssize_t n = send(pimpl->_commonFd, msg.c_str(), msg.length(), MSG_DONTWAIT);
+    if (pimpl->_mode == Mode::DGRAM_CLIENT) {
+        ssize_t n = sendto(pimpl->_commonFd, msg.data(), msg.size(), MSG_DONTWAIT | MSG_NOSIGNAL,
+                           (struct sockaddr*)&pimpl->_addr, sizeof(pimpl->_addr));
+        return n == static_cast<ssize_t>(msg.size());
+    }
+    ssize_t n = send(pimpl->_commonFd, msg.data(), msg.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
     return n > 0;
 }
-}
\ No newline at end of file
+
+void UdsSocket::clientUpdate() {
+    if (pimpl->_mode != Mode::QUEUED_CLIENT)
+        return;
+    std::lock_guard lock(pimpl->_queueMtx);
+    if (!pimpl->_ring.empty())
+        pimpl->update();
+}
+
+bool UdsSocket::clientFlush(std::chrono::milliseconds timeout) {
+    if (pimpl->_mode != Mode::QUEUED_CLIENT)
+        return true;
+    auto deadline = Impl::Clock::now() + timeout;
+    std::unique_lock lock(pimpl->_queueMtx);
+    while (true) {
+        pimpl->update();
+        if (pimpl->_size == 0)
+            return true;
+        auto now = Impl::Clock::now();
+        if (now >= deadline)
+            return false;
+        auto state = pimpl->_stats.state;
+        if (state == ConnState::Disconnected && pimpl->_nextConnect >= deadline)
+            return false;
+        int fd = pimpl->_commonFd;
+        auto nextConnect = pimpl->_nextConnect;
+        lock.unlock();
+        if (state == ConnState::Disconnected) {
+            std::this_thread::sleep_until(std::min(deadline, nextConnect));
+        } else {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count();
+            struct pollfd pfd{fd, POLLOUT, 0};
+            poll(&pfd, 1, static_cast<int>(std::max<int64_t>(1, left)));
+        }
+        lock.lock();
+    }
+}
+
+UdsSocket::ClientStats UdsSocket::clientStats() const {
+    std::lock_guard lock(pimpl->_queueMtx);
+    ClientStats stats = pimpl->_stats;
+    stats.queueBytes = pimpl->_size;
+    return stats;
+}
+
+void UdsSocket::allowSenders(std::vector<uid_t> uids) {
+    pimpl->_senders = std::move(uids);
+}
+
+uint64_t UdsSocket::rejectedDatagrams() const {
+    return pimpl->_rejected.load(std::memory_order_relaxed);
+}
+}
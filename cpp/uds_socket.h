@@ -1,16 +1,47 @@
 #pragma once
 
+#include "common.h"
+
+#include <chrono>
+#include <cstdint>
 #include <functional>
 #include <string>
+#include <string_view>
 #include <memory>
+#include <vector>
+#include <sys/types.h>
 
 namespace SudoMonitor {
 
 class UdsSocket {
 public:
-    enum class Mode { SERVER, CLIENT };
+    // DGRAM_*: connectionless, one message per datagram. A DGRAM_CLIENT never blocks and needs no
+    // reconnect: each send is addressed, and fails at once while the server is not bound.
+    // QUEUED_CLIENT: stream client that queues the messages in a bounded ring, writes them in writev batches as the
+    // socket accepts them (partial writes resume where they stopped) and reconnects with backoff. A message is only
+    // dropped when the ring is full, or when a disconnect cuts it after its first bytes were written.
+    // A SERVER splits its input into '\n' terminated messages (the terminator is not passed on), and closes a client
+    // that sends more than Config::ServerMessageMaxBytes without one.
+    enum class Mode { SERVER, CLIENT, DGRAM_SERVER, DGRAM_CLIENT, QUEUED_CLIENT };
+    enum class ConnState { Disconnected, Connecting, Connected };
+    struct ClientStats {
+        uint64_t queued = 0;          // messages accepted by clientSend
+        uint64_t sent = 0;            // messages completely written to the socket
+        uint64_t dropped = 0;         // ring full, or cut by a disconnect
+        uint64_t bytes = 0;           // written to the socket
+        uint64_t writes = 0;          // writev calls that wrote something
+        uint64_t partialWrites = 0;   // of those, the ones that did not take the whole batch
+        uint64_t wouldBlock = 0;      // EAGAIN, the queue waits for the next clientUpdate
+        uint64_t connects = 0;
+        uint64_t connectFailures = 0;
+        uint64_t disconnects = 0;
+        uint64_t queueBytes = 0;      // currently queued
+        ConnState state = ConnState::Disconnected;
+    };
     using OnNewData = std::function<void(int fd, const std::string&)>;
-    UdsSocket(const std::string& path, Mode mode, const OnNewData& onNewData = nullptr);
+    // queueBytes: QUEUED_CLIENT ring capacity, the longest message it can queue
+    UdsSocket(const std::string& path, Mode mode, const OnNewData& onNewData = nullptr,
+              size_t queueBytes = Config::ClientQueueBytes);
     ~UdsSocket();
 
     UdsSocket(const UdsSocket&) = delete;
@@ -21,8 +52,20 @@ public:
     // For Server: Non-blocking check for incoming data
     void serverUpdate();
 
-    // For Client: Non-blocking send
-    bool clientSend(const std::string& msg);
+    // For Client: Non-blocking send. QUEUED_CLIENT: only queues the message (false when it was dropped), the queue is
+    // written by clientUpdate/clientFlush, or here once Config::ClientWriteBatchBytes are waiting
+    bool clientSend(std::string_view msg);
+    // QUEUED_CLIENT: completes a pending connect, reconnects once the backoff expired and writes the queue;
+    // to be called from the owner's loop
+    void clientUpdate();
+    // QUEUED_CLIENT: writes until the queue is empty (true) or the timeout expires, without waiting for a
+    // reconnect that is not due before it
+    bool clientFlush(std::chrono::milliseconds timeout);
+    [[nodiscard]] ClientStats clientStats() const;
+    // DGRAM_SERVER: only the datagrams sent by these uids (SO_PASSCRED) are passed on, the others are counted in
+    // rejectedDatagrams. Empty (the default): any sender. Call before init.
+    void allowSenders(std::vector<uid_t> uids);
+    [[nodiscard]] uint64_t rejectedDatagrams() const;
 
 private:
     struct Impl; // Forward declaration of the implementation
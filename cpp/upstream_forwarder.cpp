@@ -0,0 +1,459 @@
+#include "upstream_forwarder.h"
+#include "private_file.h"
+#include "self_profiler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <dirent.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <mutex>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace SudoMonitor {
+namespace {
+void put32(char* out, uint32_t v) {
+    v = htobe32(v);
+    memcpy(out, &v, sizeof(v));
+}
+void put64(char* out, uint64_t v) {
+    v = htobe64(v);
+    memcpy(out, &v, sizeof(v));
+}
+uint32_t get32(const char* in) {
+    uint32_t v;
+    memcpy(&v, in, sizeof(v));
+    return be32toh(v);
+}
+uint64_t get64(const char* in) {
+    uint64_t v;
+    memcpy(&v, in, sizeof(v));
+    return be64toh(v);
+}
+bool sendAll(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+bool readFile(const std::string& path, std::string& out) {
+    int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st{};
+    bool ok = fstat(fd, &st) == 0;
+    out.resize(ok ? static_cast<size_t>(st.st_size) : 0);
+    size_t done = 0;
+    while (ok && done < out.size()) {
+        ssize_t n = read(fd, out.data() + done, out.size() - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        ok = n > 0;
+        done += ok ? static_cast<size_t>(n) : 0;
+    }
+    close(fd);
+    return ok;
+}
+}
+
+void UpstreamWire::BatchHeader::encode(char* out) const {
+    put32(out, BatchMagic);
+    put64(out + 4, seq);
+    put32(out + 12, events);
+    put32(out + 16, rawBytes);
+    put32(out + 20, payloadBytes);
+}
+
+bool UpstreamWire::BatchHeader::decode(const char* in) {
+    if (get32(in) != BatchMagic)
+        return false;
+    seq = get64(in + 4);
+    events = get32(in + 12);
+    rawBytes = get32(in + 16);
+    payloadBytes = get32(in + 20);
+    return rawBytes <= MaxFrameBytes && payloadBytes <= MaxFrameBytes;
+}
+
+void UpstreamWire::encodeAck(char* out, uint64_t seq) {
+    put32(out, AckMagic);
+    put64(out + 4, seq);
+}
+
+bool UpstreamWire::decodeAck(const char* in, uint64_t& seq) {
+    if (get32(in) != AckMagic)
+        return false;
+    seq = get64(in + 4);
+    return true;
+}
+
+std::string UpstreamWire::hello(std::string_view host) {
+    std::string out(HelloHeaderBytes, '\0');
+    put32(out.data(), HelloMagic);
+    put32(out.data() + 4, static_cast<uint32_t>(host.size()));
+    out.append(host);
+    return out;
+}
+
+bool UpstreamWire::inflate(const char* payload, size_t payloadBytes, size_t rawBytes, std::string& out) {
+    out.resize(rawBytes);
+    z_stream zs{};
+    if (inflateInit(&zs) != Z_OK)
+        return false;
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(payload));
+    zs.avail_in = static_cast<uInt>(payloadBytes);
+    zs.next_out = reinterpret_cast<Bytef*>(out.data());
+    zs.avail_out = static_cast<uInt>(rawBytes);
+    bool ok = ::inflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out == rawBytes;
+    inflateEnd(&zs);
+    return ok;
+}
+
+struct UpstreamForwarder::Impl {
+    using Clock = std::chrono::steady_clock;
+    struct Batch {
+        uint64_t seq;
+        uint32_t events;
+        uint64_t bytes; // spool file size
+    };
+    UpstreamOptions options;
+
+    // The open batch, appended to by the daemon threads
+    std::mutex _openMtx;
+    std::string _open;
+    uint32_t _openEvents = 0;
+    uint64_t _published = 0;
+    Clock::time_point _openSince;
+
+    // Sender thread state; _pending and _metrics change under _mtx for metrics()
+    mutable std::mutex _mtx;
+    std::deque<Batch> _pending; // spooled batches, oldest first, the first _inflight of them are sent
+    size_t _inflight = 0;
+    UpstreamMetrics _metrics;
+    uint64_t _nextSeq = 0;
+    int _fd = -1;
+    Clock::time_point _nextConnect{};
+    Clock::time_point _lastAck{};
+    std::chrono::milliseconds _backoff{Config::UpstreamReconnectMinMs};
+    std::string _acks;   // received bytes not yet forming a whole ack
+    std::string _frame;  // scratch: a sealed batch, a batch read back from the spool
+    z_stream _zs{};
+    bool _zsInit = false;
+    std::atomic_bool _running = false;
+    std::thread _thread;
+
+    explicit Impl(const UpstreamOptions& o) : options(o) {}
+    ~Impl() {
+        stop();
+        if (_zsInit)
+            deflateEnd(&_zs);
+    }
+    void stop() {
+        if (!_running.exchange(false))
+            return;
+        _thread.join();
+        seal();
+        if (_fd != -1)
+            close(_fd);
+        _fd = -1;
+    }
+
+    [[nodiscard]] std::string spoolPath(uint64_t seq, const char* suffix = ".batch") const {
+        char name[32];
+        snprintf(name, sizeof(name), "/%020llu", static_cast<unsigned long long>(seq));
+        return options.spoolDir + name + suffix;
+    }
+
+    void loadSpool() {
+        uint64_t maxSeq = 0;
+        if (DIR* dir = opendir(options.spoolDir.c_str())) {
+            while (auto entry = readdir(dir)) {
+                std::string_view name = entry->d_name;
+                std::string path = options.spoolDir + "/" + entry->d_name;
+                if (name.size() > 4 && name.substr(name.size() - 4) == ".tmp")
+                    unlink(path.c_str()); // a write cut by a crash
+                if (name.size() <= 6 || name.substr(name.size() - 6) != ".batch")
+                    continue;
+                UpstreamWire::BatchHeader header;
+                char buf[UpstreamWire::BatchHeader::Bytes];
+                struct stat st{};
+                int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+                bool ok = fd >= 0 && fstat(fd, &st) == 0 && read(fd, buf, sizeof(buf)) == sizeof(buf) &&
+                          header.decode(buf) &&
+                          static_cast<uint64_t>(st.st_size) == sizeof(buf) + header.payloadBytes;
+                if (fd >= 0)
+                    close(fd);
+                if (!ok) {
+                    unlink(path.c_str()); // truncated by a crash while it was written
+                    continue;
+                }
+                _pending.push_back({header.seq, header.events, static_cast<uint64_t>(st.st_size)});
+                _metrics.spoolBytes += static_cast<uint64_t>(st.st_size);
+                maxSeq = std::max(maxSeq, header.seq);
+            }
+            closedir(dir);
+        }
+        std::sort(_pending.begin(), _pending.end(), [](const Batch& a, const Batch& b) { return a.seq < b.seq; });
+        _metrics.spooled = _pending.size();
+        // the last sealed seq keeps the sequence increasing across restarts with an empty spool, whatever the clock
+        // does; only a spool that never sealed a batch starts from realtime microseconds
+        std::string last;
+        if (readFile(options.spoolDir + "/seq", last) && !last.empty()) {
+            _nextSeq = std::max<uint64_t>(maxSeq, strtoull(last.c_str(), nullptr, 10)) + 1;
+        } else {
+            auto now = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+            _nextSeq = std::max(maxSeq + 1, static_cast<uint64_t>(now));
+        }
+    }
+
+    [[nodiscard]] bool sealDue() {
+        std::lock_guard lock(_openMtx);
+        return !_open.empty() && (_open.size() >= Config::UpstreamBatchBytes ||
+                                  _openEvents >= Config::UpstreamBatchEvents ||
+                                  Clock::now() - _openSince >= std::chrono::milliseconds(Config::UpstreamBatchMs));
+    }
+
+    void seal() {
+        std::string raw;
+        uint32_t events;
+        {
+            std::lock_guard lock(_openMtx);
+            raw.swap(_open);
+            events = _openEvents;
+            _openEvents = 0;
+        }
+        if (raw.empty())
+            return;
+        UpstreamWire::BatchHeader header{_nextSeq++, events, static_cast<uint32_t>(raw.size()), 0};
+        deflateReset(&_zs);
+        _frame.resize(UpstreamWire::BatchHeader::Bytes + deflateBound(&_zs, raw.size()));
+        _zs.next_in = reinterpret_cast<Bytef*>(raw.data());
+        _zs.avail_in = static_cast<uInt>(raw.size());
+        _zs.next_out = reinterpret_cast<Bytef*>(_frame.data() + UpstreamWire::BatchHeader::Bytes);
+        _zs.avail_out = static_cast<uInt>(_frame.size() - UpstreamWire::BatchHeader::Bytes);
+        bool ok = deflate(&_zs, Z_FINISH) == Z_STREAM_END;
+        header.payloadBytes = static_cast<uint32_t>(_zs.total_out);
+        _frame.resize(UpstreamWire::BatchHeader::Bytes + header.payloadBytes);
+        header.encode(_frame.data());
+
+        // the seq is stored before the batch, so no batch the collector may have seen is ever numbered again
+        auto seq = std::to_string(header.seq);
+        ok = ok && replaceFile(options.spoolDir + "/seq.tmp", options.spoolDir + "/seq", seq) &&
+             replaceFile(spoolPath(header.seq, ".tmp"), spoolPath(header.seq), _frame);
+
+        std::lock_guard lock(_mtx);
+        if (!ok) {
+            _metrics.droppedEvents += events;
+            return;
+        }
+        _pending.push_back({header.seq, events, _frame.size()});
+        ++_metrics.batches;
+        ++_metrics.spooled;
+        _metrics.rawBytes += raw.size();
+        _metrics.compressedBytes += header.payloadBytes;
+        _metrics.spoolBytes += _frame.size();
+        // a full spool gives up the oldest batches not in flight
+        while (_metrics.spoolBytes > options.spoolMaxBytes && _pending.size() > _inflight)
+            drop(_pending.begin() + static_cast<ptrdiff_t>(_inflight), false);
+    }
+
+    // under _mtx
+    void drop(std::deque<Batch>::iterator it, bool acked) {
+        unlink(spoolPath(it->seq).c_str());
+        if (acked)
+            ++_metrics.acked;
+        else
+            _metrics.droppedEvents += it->events;
+        --_metrics.spooled;
+        _metrics.spoolBytes -= it->bytes;
+        _pending.erase(it);
+    }
+
+    void connectCollector() {
+        struct addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo* addrs = nullptr;
+        if (getaddrinfo(options.host.c_str(), options.port.c_str(), &hints, &addrs) == 0) {
+            for (auto* ai = addrs; ai && _fd < 0; ai = ai->ai_next) {
+                int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+                if (fd < 0)
+                    continue;
+                bool ok = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+                if (!ok && errno == EINPROGRESS) {
+                    struct pollfd pfd{fd, POLLOUT, 0};
+                    int err = 0;
+                    socklen_t len = sizeof(err);
+                    ok = poll(&pfd, 1, Config::UpstreamConnectTimeoutMs) == 1 &&
+                         getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0;
+                }
+                if (ok) {
+                    // sends block, up to the connect timeout
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+                    struct timeval tv{Config::UpstreamConnectTimeoutMs / 1000, (Config::UpstreamConnectTimeoutMs % 1000) * 1000};
+                    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+                    auto hello = UpstreamWire::hello(options.hostName);
+                    ok = sendAll(fd, hello.data(), hello.size());
+                }
+                if (ok)
+                    _fd = fd;
+                else
+                    close(fd);
+            }
+            freeaddrinfo(addrs);
+        }
+        if (_fd < 0) {
+            _nextConnect = Clock::now() + _backoff;
+            _backoff = std::min(_backoff * 2, std::chrono::milliseconds(Config::UpstreamReconnectMaxMs));
+            return;
+        }
+        _backoff = std::chrono::milliseconds(Config::UpstreamReconnectMinMs);
+        _acks.clear();
+        std::lock_guard lock(_mtx);
+        _inflight = 0;
+        ++_metrics.connects;
+        _metrics.connected = true;
+    }
+
+    void disconnect() {
+        close(_fd);
+        _fd = -1;
+        _nextConnect = Clock::now() + _backoff;
+        _backoff = std::min(_backoff * 2, std::chrono::milliseconds(Config::UpstreamReconnectMaxMs));
+        std::lock_guard lock(_mtx);
+        _inflight = 0; // sent again after the reconnect
+        _metrics.connected = false;
+    }
+
+    // Only this thread changes _pending, so it is read without the lock
+    void sendPending() {
+        while (_fd >= 0 && _inflight < Config::UpstreamWindow && _inflight < _pending.size()) {
+            const auto& batch = _pending[_inflight];
+            if (!readFile(spoolPath(batch.seq), _frame) || _frame.size() != batch.bytes) {
+                std::lock_guard lock(_mtx);
+                drop(_pending.begin() + static_cast<ptrdiff_t>(_inflight), false);
+                continue;
+            }
+            if (!sendAll(_fd, _frame.data(), _frame.size())) {
+                disconnect();
+                return;
+            }
+            if (_inflight == 0)
+                _lastAck = Clock::now();
+            std::lock_guard lock(_mtx);
+            ++_inflight;
+        }
+    }
+
+    void readAcks() {
+        char buf[UpstreamWire::AckBytes * 64];
+        ssize_t n = recv(_fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            disconnect();
+            return;
+        }
+        if (n > 0)
+            _acks.append(buf, static_cast<size_t>(n));
+        size_t used = 0;
+        for (; _acks.size() - used >= UpstreamWire::AckBytes; used += UpstreamWire::AckBytes) {
+            uint64_t seq;
+            if (!UpstreamWire::decodeAck(_acks.data() + used, seq)) {
+                disconnect();
+                return;
+            }
+            std::lock_guard lock(_mtx);
+            while (_inflight > 0 && _pending.front().seq <= seq) {
+                drop(_pending.begin(), true);
+                --_inflight;
+            }
+            _lastAck = Clock::now();
+        }
+        _acks.erase(0, used);
+        if (_inflight > 0 && Clock::now() - _lastAck > std::chrono::milliseconds(Config::UpstreamAckTimeoutMs))
+            disconnect();
+    }
+
+    void run() {
+        while (_running) {
+            if (sealDue())
+                seal();
+            if (_fd < 0 && Clock::now() >= _nextConnect)
+                connectCollector();
+            if (_fd < 0) {
+                SLEEP_MS(10);
+                continue;
+            }
+            sendPending();
+            if (_fd < 0)
+                continue;
+            struct pollfd pfd{_fd, POLLIN, 0};
+            poll(&pfd, 1, 10);
+            readAcks();
+        }
+    }
+};
+
+UpstreamForwarder::UpstreamForwarder(const UpstreamOptions& options) : pimpl(std::make_unique<Impl>(options)) {}
+
+UpstreamForwarder::~UpstreamForwarder() = default;
+
+bool UpstreamForwarder::init() {
+    if (!privateDir(pimpl->options.spoolDir)) // it holds the audit records
+        return false;
+    if (pimpl->options.hostName.empty()) {
+        char name[256] = {};
+        gethostname(name, sizeof(name) - 1);
+        pimpl->options.hostName = name;
+    }
+    if (deflateInit(&pimpl->_zs, Z_DEFAULT_COMPRESSION) != Z_OK)
+        return false;
+    pimpl->_zsInit = true;
+    pimpl->loadSpool();
+    pimpl->_running = true;
+    pimpl->_thread = std::thread([this] {
+        SelfProfiler::nameThread("upstream");
+        pimpl->run();
+    });
+    return true;
+}
+
+void UpstreamForwarder::publish(std::string_view record) {
+    std::lock_guard lock(pimpl->_openMtx);
+    if (pimpl->_open.empty())
+        pimpl->_openSince = Impl::Clock::now();
+    pimpl->_open.append(record);
+    ++pimpl->_openEvents;
+    ++pimpl->_published;
+}
+
+void UpstreamForwarder::stop() {
+    pimpl->stop();
+}
+
+UpstreamMetrics UpstreamForwarder::metrics() const {
+    UpstreamMetrics m;
+    {
+        std::lock_guard lock(pimpl->_mtx);
+        m = pimpl->_metrics;
+    }
+    std::lock_guard lock(pimpl->_openMtx);
+    m.events = pimpl->_published;
+    return m;
+}
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace SudoMonitor {
+// TCP framing between the forwarder and sudo_collector, integers in network byte order:
+//   hello  (forwarder, once per connection): magic, u32 length, host name
+//   batch  (forwarder): BatchHeader, then payloadBytes of a zlib stream holding rawBytes of NDJSON records
+//   ack    (collector, per batch, in order): magic, u64 seq
+// Acks are cumulative: an ack for seq also acknowledges every earlier batch of the connection.
+struct UpstreamWire {
+    static constexpr uint32_t HelloMagic = 0x534d4831; // "SMH1"
+    static constexpr uint32_t BatchMagic = 0x534d4231; // "SMB1"
+    static constexpr uint32_t AckMagic = 0x534d4131;   // "SMA1"
+    static constexpr size_t HelloHeaderBytes = 8;
+    static constexpr size_t AckBytes = 12;
+    static constexpr uint32_t MaxFrameBytes = 64 << 20;
+
+    struct BatchHeader {
+        static constexpr size_t Bytes = 24;
+        uint64_t seq = 0;       // increasing per host, across daemon restarts
+        uint32_t events = 0;
+        uint32_t rawBytes = 0;
+        uint32_t payloadBytes = 0;
+        void encode(char* out) const;
+        bool decode(const char* in); // false: not a batch header
+    };
+    static void encodeAck(char* out, uint64_t seq);
+    static bool decodeAck(const char* in, uint64_t& seq);
+    static std::string hello(std::string_view host);
+    // false: corrupt stream or not exactly rawBytes long
+    static bool inflate(const char* payload, size_t payloadBytes, size_t rawBytes, std::string& out);
+};
+
+struct UpstreamOptions {
+    std::string host;
+    std::string port = Config::UpstreamPort;
+    std::string spoolDir = Config::UpstreamSpoolDir;
+    uint64_t spoolMaxBytes = Config::UpstreamSpoolMaxBytes;
+    std::string hostName; // sent in the hello, empty: gethostname()
+};
+
+struct UpstreamMetrics {
+    uint64_t events = 0;          // records published
+    uint64_t batches = 0;         // batches sealed into the spool
+    uint64_t rawBytes = 0;
+    uint64_t compressedBytes = 0;
+    uint64_t acked = 0;           // batches acknowledged by the collector
+    uint64_t spooled = 0;         // batches in the spool, not acknowledged yet
+    uint64_t spoolBytes = 0;
+    uint64_t droppedEvents = 0;   // oldest batches removed from a full spool, or not spooled on a write error
+    uint64_t connects = 0;
+    bool connected = false;
+};
+
+// Forwards the daemon's records to a central collector. publish() appends to the open batch; a sender thread seals
+// it (UpstreamBatchBytes, UpstreamBatchEvents or UpstreamBatchMs), deflates it and writes it to the spool directory
+// before sending, so a batch is kept until the collector acknowledges it, across disconnects and daemon restarts.
+// At most UpstreamWindow batches are in flight; after a reconnect the unacknowledged ones are sent again (at least once).
+class UpstreamForwarder {
+public:
+    explicit UpstreamForwarder(const UpstreamOptions& options);
+    ~UpstreamForwarder(); // stop()
+    UpstreamForwarder(const UpstreamForwarder&) = delete;
+    UpstreamForwarder& operator=(const UpstreamForwarder&) = delete;
+
+    // Creates the spool directory (0700), loads the batches left in it and starts the sender thread. false (EPERM): the
+    // spool is a link, or not a directory of the effective user closed to everyone else.
+    bool init();
+    void publish(std::string_view record); // one NDJSON record, newline terminated
+    // Stops the sender thread and seals the open batch into the spool, for the next start to send.
+    // publish() remains safe afterwards, its records are no longer forwarded.
+    void stop();
+    [[nodiscard]] UpstreamMetrics metrics() const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> pimpl;
+};
+}